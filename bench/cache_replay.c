@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/proxy_cache/cache.h"
+
+/*
+ * cache_replay - Replay a trace of requests through the cache with one of
+ *     its policies and print the hit ratio. Each line of the trace is the
+ *     key of a request and the size of its response; a miss caches it.
+ *     Exits with 1 if a response that fits was dropped for want of slab
+ *     memory, which evicting from its shard should always find.
+ *
+ *     usage: cache_replay [-p clock|tinylfu] [-c cache-bytes]
+ *                         [-o max-object-bytes] trace
+ */
+
+#define TRACE_LINE 1024
+
+static void
+usage(const char *prog);
+
+static const char *response_line = "HTTP/1.1 200 OK\r\n";
+static const char *response_hdrs = "Content-Type: application/octet-stream\r\n";
+
+int
+main(int argc, char **argv)
+{
+    int opt;
+    size_t cache_size = MAX_CACHE_SIZE, max_object = MAX_OBJECT_SIZE, size;
+    unsigned long requests = 0, hits = 0, failures = 0;
+    unsigned long long bytes = 0, hit_bytes = 0;
+    char line[TRACE_LINE], key[TRACE_LINE], *body;
+    time_t now;
+    enum cache_policy policy = CACHE_CLOCK;
+    Cache cache;
+    CacheEntry *entry;
+    FILE *trace;
+    struct iovec content;
+
+    while ((opt = getopt(argc, argv, "p:c:o:")) != -1) {
+        switch (opt) {
+        case 'p':
+            if (!strcmp(optarg, "clock"))
+                policy = CACHE_CLOCK;
+            else if (!strcmp(optarg, "tinylfu"))
+                policy = CACHE_TINYLFU;
+            else
+                usage(argv[0]);
+            break;
+        case 'c':
+            cache_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            max_object = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+    if (!(trace = fopen(argv[optind], "r"))) {
+        perror(argv[optind]);
+        exit(1);
+    }
+
+    cache_init(&cache, cache_size, max_object, policy, CACHE_DEFAULT_TTL, 0);
+    body = calloc(1, max_object);
+    now = time(NULL);
+
+    while (fgets(line, sizeof(line), trace)) {
+        if (sscanf(line, "%s %zu", key, &size) != 2)
+            continue;
+        requests++;
+        bytes += size;
+
+        if ((entry = cache_fetch(&cache, key, strlen(key)))) {
+            hits++;
+            hit_bytes += size;
+            cache_release(entry);
+            continue;
+        }
+        if (size > max_object)
+            continue;
+        content.iov_base = body;
+        content.iov_len = size;
+        cache_write(&cache, key, strlen(key), response_line, response_hdrs,
+                    &content, 1, now, now + 3600, now + 3600);
+    }
+
+    for (int i = 0; i < cache.nshards; i++)
+        failures += cache.shards[i].failures;
+
+    printf("policy=%s requests=%lu hits=%lu hit_ratio=%.3f "
+           "byte_hit_ratio=%.3f failures=%lu\n",
+           policy == CACHE_TINYLFU ? "tinylfu" : "clock", requests, hits,
+           requests ? (double) hits / requests : 0.0,
+           bytes ? (double) hit_bytes / bytes : 0.0, failures);
+    fclose(trace);
+    return failures ? 1 : 0;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-p clock|tinylfu] [-c cache-bytes] "
+            "[-o max-object-bytes] trace\n", prog);
+    exit(1);
+}
@@ -0,0 +1,413 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/proxy_http/http.h"
+
+/*
+ * http_parse - Parse the same message head over and over, with the parser
+ *     of proxy_http and with the line by line one it replaced, and print
+ *     the heads parsed a second by each. Both look at the headers the proxy
+ *     looks at and copy the ones it forwards. The head is a request, or a
+ *     response if it starts with "HTTP/"; files of fuzz/corpus do.
+ *
+ *     usage: http_parse [-n rounds] head
+ */
+
+#define OLD_BUFSIZE     8192        /* Read buffer of the old sio */
+#define OLD_MAX_LINE    8192
+#define OLD_MAX_BUF     1048576
+#define OLD_USED_HDRS   130
+#define HEAD_MAX        65536
+
+/* The old buffered reader, filled from memory rather than a descriptor */
+typedef struct old_sio {
+    const char *os_src;
+    size_t os_left;
+    int os_cnt;
+    char *os_bufptr;
+    char os_buf[OLD_BUFSIZE];
+} OldSio;
+
+static int
+old_request(OldSio *sio);
+
+static int
+old_response(OldSio *sio);
+
+static ssize_t
+old_read(OldSio *sio, char *usrbuf, size_t n);
+
+static ssize_t
+old_read_line(OldSio *sio, char *usrbuf, size_t maxlen);
+
+static void
+old_strtolwr(char *str);
+
+static int
+old_is_hop_by_hop(const char *hdr_line);
+
+static int
+new_request(const char *buf, size_t len);
+
+static int
+new_response(const char *buf, size_t len);
+
+static int
+new_is_hop_by_hop(const HttpHdr *hdr);
+
+static double
+now_s(void);
+
+static void
+usage(const char *prog);
+
+static const char *hop_by_hop_hdrs[] = {
+    "Connection:", "Proxy-Connection:", "Keep-Alive:", "TE:", "Trailer:",
+    "Transfer-Encoding:", "Upgrade:", NULL
+};
+
+static char hdrs[OLD_MAX_BUF];
+static volatile int sink;
+
+int
+main(int argc, char **argv)
+{
+    int opt, response;
+    long rounds = 1000000;
+    size_t len;
+    char head[HEAD_MAX];
+    double start, old_s, new_s;
+    FILE *file;
+    OldSio sio;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n')
+            rounds = atol(optarg);
+        else
+            usage(argv[0]);
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+    if (!(file = fopen(argv[optind], "r"))) {
+        perror(argv[optind]);
+        exit(1);
+    }
+    len = fread(head, 1, sizeof(head), file);
+    fclose(file);
+    response = len >= 5 && !memcmp(head, "HTTP/", 5);
+
+    http_init();
+    if (!http_head_end(head, len)) {
+        fprintf(stderr, "%s: not a whole head\n", argv[optind]);
+        exit(1);
+    }
+
+    start = now_s();
+    for (long i = 0; i < rounds; i++) {
+        sio.os_src = head;
+        sio.os_left = len;
+        sio.os_cnt = 0;
+        sink += response ? old_response(&sio) : old_request(&sio);
+    }
+    old_s = now_s() - start;
+
+    start = now_s();
+    for (long i = 0; i < rounds; i++)
+        sink += response ? new_response(head, len) : new_request(head, len);
+    new_s = now_s() - start;
+
+    printf("%s bytes=%zu rounds=%ld line_heads_per_s=%.0f "
+           "http_heads_per_s=%.0f speedup=%.2f\n",
+           response ? "response" : "request", len, rounds, rounds / old_s,
+           rounds / new_s, old_s / new_s);
+    return 0;
+}
+
+/*
+ * old_request - The request line read with sscanf, then the headers a line
+ *     at a time, lowered to be compared
+ */
+static int
+old_request(OldSio *sio)
+{
+    int keep_alive;
+    ssize_t nread = OLD_MAX_BUF - OLD_USED_HDRS;
+    char line[OLD_MAX_LINE], method[16], url[OLD_MAX_LINE], version[16];
+    char hdr_linebuf[OLD_MAX_LINE], lwr_linebuf[OLD_MAX_LINE];
+    char *copy;
+
+    if (old_read_line(sio, line, OLD_MAX_LINE) <= 0 ||
+        sscanf(line, "%s %s %s", method, url, version) != 3 ||
+        strcmp(method, "GET"))
+        return -1;
+    keep_alive = !strcmp(version, "HTTP/1.1");
+
+    hdrs[0] = '\0';
+    do {
+        if (old_read_line(sio, hdr_linebuf, OLD_MAX_LINE) < 0)
+            return -1;
+        strcpy(lwr_linebuf, hdr_linebuf);
+        old_strtolwr(lwr_linebuf);
+        if (!strncmp(lwr_linebuf, "connection:", 11) ||
+            !strncmp(lwr_linebuf, "proxy-connection:", 17)) {
+            if (strstr(lwr_linebuf, "close"))
+                keep_alive = 0;
+            else if (strstr(lwr_linebuf, "keep-alive"))
+                keep_alive = 1;
+        }
+        if (!strncmp(lwr_linebuf, "content-length:", 15) ||
+            !strncmp(lwr_linebuf, "transfer-encoding:", 18))
+            keep_alive = 0;
+        strncat(hdrs, hdr_linebuf, nread);
+        nread -= strlen(hdr_linebuf);
+    } while (strcmp(hdr_linebuf, "\r\n") && nread > 0);
+
+    copy = strdup(hdrs);
+    free(copy);
+    return keep_alive;
+}
+
+/*
+ * old_response - The status read with sscanf, then the headers a line at a
+ *     time, the hop-by-hop ones dropped
+ */
+static int
+old_response(OldSio *sio)
+{
+    int status, chunked = 0, server_close;
+    ssize_t content_len = -1;
+    char line[OLD_MAX_LINE], hdr_linebuf[OLD_MAX_LINE];
+    char lwr_linebuf[OLD_MAX_LINE];
+    char *copy;
+
+    if (old_read_line(sio, line, OLD_MAX_LINE) <= 0 ||
+        sscanf(line, "HTTP/%*d.%*d %d", &status) != 1)
+        return -1;
+    server_close = !strncmp(line, "HTTP/1.0", 8);
+
+    hdrs[0] = '\0';
+    while (1) {
+        if (old_read_line(sio, hdr_linebuf, OLD_MAX_LINE) <= 0)
+            return -1;
+        if (!strcmp(hdr_linebuf, "\r\n") || !strcmp(hdr_linebuf, "\n"))
+            break;
+        strcpy(lwr_linebuf, hdr_linebuf);
+        old_strtolwr(lwr_linebuf);
+        if (sscanf(lwr_linebuf, "content-length: %zd", &content_len) == 1)
+            continue;
+        if (old_is_hop_by_hop(hdr_linebuf)) {
+            if (!strncmp(lwr_linebuf, "transfer-encoding:", 18))
+                chunked = strstr(lwr_linebuf, "chunked") != NULL;
+            if (!strncmp(lwr_linebuf, "connection:", 11)) {
+                if (strstr(lwr_linebuf, "close"))
+                    server_close = 1;
+                else if (strstr(lwr_linebuf, "keep-alive"))
+                    server_close = 0;
+            }
+            continue;
+        }
+        strcat(hdrs, hdr_linebuf);
+    }
+
+    copy = strdup(line);
+    free(copy);
+    copy = strdup(hdrs);
+    free(copy);
+    return status + chunked + server_close + (content_len > 0);
+}
+
+/*
+ * old_read - Copy up to n bytes out of the buffer, refilled once empty
+ */
+static ssize_t
+old_read(OldSio *sio, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    if (sio->os_cnt <= 0) {
+        if (!sio->os_left)
+            return 0;
+        sio->os_cnt = sio->os_left < OLD_BUFSIZE ? sio->os_left
+                                                 : OLD_BUFSIZE;
+        memcpy(sio->os_buf, sio->os_src, sio->os_cnt);
+        sio->os_src += sio->os_cnt;
+        sio->os_left -= sio->os_cnt;
+        sio->os_bufptr = sio->os_buf;
+    }
+    cnt = n;
+    if (sio->os_cnt < n)
+        cnt = sio->os_cnt;
+    memcpy(usrbuf, sio->os_bufptr, cnt);
+    sio->os_bufptr += cnt;
+    sio->os_cnt -= cnt;
+    return cnt;
+}
+
+/*
+ * old_read_line - Read a line a byte at a time, as sio_read_line did
+ */
+static ssize_t
+old_read_line(OldSio *sio, char *usrbuf, size_t maxlen)
+{
+    int n, rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+        if ((rc = old_read(sio, &c, 1)) == 1) {
+            *bufp++ = c;
+            if (c == '\n') {
+                n++;
+                break;
+            }
+        } else if (rc == 0) {
+            if (n == 1)
+                return 0;
+            break;
+        } else {
+            return -1;
+        }
+    }
+    *bufp = 0;
+    return n - 1;
+}
+
+static void
+old_strtolwr(char *str)
+{
+    for (int i = 0; str[i] != '\0'; i++) {
+        if (isalpha(str[i]))
+            str[i] = tolower(str[i]);
+    }
+}
+
+static int
+old_is_hop_by_hop(const char *hdr_line)
+{
+    for (int i = 0; hop_by_hop_hdrs[i]; i++) {
+        if (!strncasecmp(hdr_line, hop_by_hop_hdrs[i],
+                         strlen(hop_by_hop_hdrs[i])))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * new_request - The head parsed in place, then its headers looked at as
+ *     parse_request_hdrs does
+ */
+static int
+new_request(const char *buf, size_t len)
+{
+    int keep_alive;
+    size_t n = 0;
+    const HttpHdr *hdr;
+    HttpHead head;
+
+    if (!http_head_end(buf, len) || http_parse_head(buf, len, &head) <= 0 ||
+        head.hd_line_len < 3 || memcmp(head.hd_line, "GET", 3))
+        return -1;
+    keep_alive = head.hd_line_len >= 8 &&
+                 !memcmp(head.hd_line + head.hd_line_len - 8, "HTTP/1.1", 8);
+
+    for (int i = 0; i < head.hd_nhdrs; i++) {
+        hdr = &head.hd_hdrs[i];
+        if (http_hdr_is(hdr, "connection") ||
+            http_hdr_is(hdr, "proxy-connection")) {
+            if (http_has_token(hdr->hh_value, hdr->hh_value_len, "close"))
+                keep_alive = 0;
+            else if (http_has_token(hdr->hh_value, hdr->hh_value_len,
+                                    "keep-alive"))
+                keep_alive = 1;
+        }
+        if (http_hdr_is(hdr, "content-length") ||
+            http_hdr_is(hdr, "transfer-encoding"))
+            keep_alive = 0;
+        memcpy(hdrs + n, hdr->hh_name, hdr->hh_size);
+        n += hdr->hh_size;
+    }
+    memcpy(hdrs + n, "\r\n", 3);
+    return keep_alive;
+}
+
+/*
+ * new_response - The head parsed in place, then its headers looked at as
+ *     parse_response_hdrs does
+ */
+static int
+new_response(const char *buf, size_t len)
+{
+    int status, chunked = 0, server_close, digits;
+    ssize_t content_len = -1, n;
+    size_t copied = 0;
+    const HttpHdr *hdr;
+    HttpHead head;
+
+    if (!http_head_end(buf, len) || http_parse_head(buf, len, &head) <= 0 ||
+        head.hd_line_len < 12)
+        return -1;
+    status = atoi(head.hd_line + 9);
+    server_close = !memcmp(head.hd_line, "HTTP/1.0", 8);
+
+    for (int i = 0; i < head.hd_nhdrs; i++) {
+        hdr = &head.hd_hdrs[i];
+        if (http_hdr_is(hdr, "content-length")) {
+            for (n = digits = 0; digits < hdr->hh_value_len &&
+                 isdigit((unsigned char) hdr->hh_value[digits]); digits++)
+                n = n * 10 + hdr->hh_value[digits] - '0';
+            if (digits > 0 && digits < 19) {
+                content_len = n;
+                continue;
+            }
+        }
+        if (new_is_hop_by_hop(hdr)) {
+            if (http_hdr_is(hdr, "transfer-encoding"))
+                chunked = http_has_token(hdr->hh_value, hdr->hh_value_len,
+                                         "chunked");
+            if (http_hdr_is(hdr, "connection")) {
+                if (http_has_token(hdr->hh_value, hdr->hh_value_len,
+                                   "close"))
+                    server_close = 1;
+                else if (http_has_token(hdr->hh_value, hdr->hh_value_len,
+                                        "keep-alive"))
+                    server_close = 0;
+            }
+            continue;
+        }
+        memcpy(hdrs + copied, hdr->hh_name, hdr->hh_size);
+        copied += hdr->hh_size;
+    }
+    hdrs[copied] = '\0';
+    return status + chunked + server_close + (content_len > 0);
+}
+
+static int
+new_is_hop_by_hop(const HttpHdr *hdr)
+{
+    for (int i = 0; hop_by_hop_hdrs[i]; i++) {
+        if (!strncasecmp(hdr->hh_name, hop_by_hop_hdrs[i],
+                         strlen(hop_by_hop_hdrs[i])))
+            return 1;
+    }
+    return 0;
+}
+
+static double
+now_s(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n rounds] head\n", prog);
+    exit(1);
+}
@@ -0,0 +1,133 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * trace_gen - Print a trace for cache_replay: requests following a Zipf
+ *     law over a set of objects, mixed with a scan asking once for objects
+ *     never seen again, as a crawler would. Sizes are spread evenly on a
+ *     log scale from 1KB to 64KB. The same seed gives the same trace on
+ *     every platform.
+ *
+ *     usage: trace_gen [-n objects] [-r requests] [-z exponent]
+ *                      [-x scan-fraction] [-s seed]
+ */
+
+#define MIN_SIZE_LOG    10          /* Smallest object, 1KB */
+#define MAX_SIZE_LOG    16          /* Largest object, 64KB */
+
+static double
+uniform(void);
+
+static size_t
+random_size(void);
+
+static void
+usage(const char *prog);
+
+static uint64_t state;
+
+int
+main(int argc, char **argv)
+{
+    int opt;
+    long nobjects = 5000, nrequests = 40000, nscanned = 0, lo, hi, mid, j, t;
+    long *ranks;
+    double zipf = 0.9, scan = 0.25, total, pick;
+    double *cumulative;
+    size_t *sizes;
+
+    state = 7;
+    while ((opt = getopt(argc, argv, "n:r:z:x:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nobjects = atol(optarg);
+            break;
+        case 'r':
+            nrequests = atol(optarg);
+            break;
+        case 'z':
+            zipf = atof(optarg);
+            break;
+        case 'x':
+            scan = atof(optarg);
+            break;
+        case 's':
+            state = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || nobjects < 1)
+        usage(argv[0]);
+
+    /* The rank of an object is its popularity, its key a shuffled one */
+    cumulative = malloc(nobjects * sizeof(*cumulative));
+    sizes = malloc(nobjects * sizeof(*sizes));
+    ranks = malloc(nobjects * sizeof(*ranks));
+    total = 0;
+    for (long i = 0; i < nobjects; i++) {
+        total += 1 / pow(i + 1, zipf);
+        cumulative[i] = total;
+        sizes[i] = random_size();
+        ranks[i] = i;
+    }
+    for (long i = nobjects - 1; i > 0; i--) {
+        j = uniform() * (i + 1);
+        t = ranks[i];
+        ranks[i] = ranks[j];
+        ranks[j] = t;
+    }
+
+    for (long i = 0; i < nrequests; i++) {
+        if (uniform() < scan) {
+            printf("s%ld %zu\n", nscanned++, random_size());
+            continue;
+        }
+        pick = uniform() * total;
+        for (lo = 0, hi = nobjects - 1; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (cumulative[mid] <= pick)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        printf("%ld %zu\n", ranks[lo], sizes[ranks[lo]]);
+    }
+
+    free(cumulative);
+    free(sizes);
+    free(ranks);
+    return 0;
+}
+
+/*
+ * uniform - A double in [0, 1) from a splitmix64 generator
+ */
+static double
+uniform(void)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    z ^= z >> 31;
+    return (z >> 11) * 0x1.0p-53;
+}
+
+static size_t
+random_size(void)
+{
+    return exp2(MIN_SIZE_LOG + uniform() * (MAX_SIZE_LOG - MIN_SIZE_LOG));
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n objects] [-r requests] [-z exponent] "
+            "[-x scan-fraction] [-s seed]\n", prog);
+    exit(1);
+}
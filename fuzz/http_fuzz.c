@@ -0,0 +1,199 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The scanners are static, the parser is built in here to reach them */
+#include "../src/proxy_http/http.c"
+
+/*
+ * http_fuzz - Parse each input with every scanner of proxy_http the
+ *     processor has, and abort if they disagree or a head points out of
+ *     its input. Built with -DLIBFUZZER it is a libFuzzer target, else it
+ *     runs the files given, then mutations of them.
+ *
+ *     usage: http_fuzz [-n mutations] [-s seed] file...
+ */
+
+#define FUZZ_MAX    4096            /* Bytes of a mutated input */
+#define FUZZ_SEEDS  256
+
+typedef const char *(*Finder)(const char *p, const char *end, char a, char b);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static void
+parse_with(Finder finder, const char *buf, size_t len, int *rc,
+           size_t *end, HttpHead *head);
+
+static void
+check_head(const char *buf, size_t len, size_t end, const HttpHead *head);
+
+static void
+same_head(const HttpHead *a, const HttpHead *b);
+
+static Finder finders[3];
+static int nfinders;
+
+/*
+ * LLVMFuzzerTestOneInput - Parse the input with the scalar scanner and
+ *     check the others agree with it. The input is copied to a buffer of
+ *     its size, so a sanitizer catches a read past it.
+ */
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    int rc, other_rc;
+    size_t end, other_end;
+    char *buf;
+    HttpHead head, other;
+
+    if (!nfinders) {
+        finders[nfinders++] = find_scalar;
+#ifdef __SSE2__
+        finders[nfinders++] = find_sse2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            finders[nfinders++] = find_avx2;
+#endif
+    }
+
+    buf = malloc(size ? size : 1);
+    memcpy(buf, data, size);
+    parse_with(finders[0], buf, size, &rc, &end, &head);
+    if (rc == 1)
+        check_head(buf, size, end, &head);
+    for (int i = 1; i < nfinders; i++) {
+        parse_with(finders[i], buf, size, &other_rc, &other_end, &other);
+        if (other_rc != rc || other_end != end)
+            abort();
+        if (rc == 1)
+            same_head(&head, &other);
+    }
+    free(buf);
+    return 0;
+}
+
+static void
+parse_with(Finder finder, const char *buf, size_t len, int *rc,
+           size_t *end, HttpHead *head)
+{
+    find = finder;
+    *end = http_head_end(buf, len);
+    *rc = http_parse_head(buf, len, head);
+}
+
+/*
+ * check_head - Abort unless the head and its headers lie in the input and
+ *     its length is the one http_head_end gave
+ */
+static void
+check_head(const char *buf, size_t len, size_t end, const HttpHead *head)
+{
+    const HttpHdr *hdr;
+
+    if (head->hd_len > len || (end && end != head->hd_len) ||
+        head->hd_line != buf || head->hd_line_size > head->hd_len ||
+        head->hd_nhdrs < 0 || head->hd_nhdrs > HTTP_MAX_HDRS)
+        abort();
+    for (int i = 0; i < head->hd_nhdrs; i++) {
+        hdr = &head->hd_hdrs[i];
+        if (hdr->hh_name < buf || hdr->hh_name + hdr->hh_size > buf + len ||
+            hdr->hh_name + hdr->hh_name_len > hdr->hh_name + hdr->hh_size ||
+            hdr->hh_value < hdr->hh_name ||
+            hdr->hh_value + hdr->hh_value_len > hdr->hh_name + hdr->hh_size)
+            abort();
+        http_has_token(hdr->hh_value, hdr->hh_value_len, "close");
+    }
+}
+
+static void
+same_head(const HttpHead *a, const HttpHead *b)
+{
+    const HttpHdr *x, *y;
+
+    if (a->hd_len != b->hd_len || a->hd_line_len != b->hd_line_len ||
+        a->hd_line_size != b->hd_line_size || a->hd_nhdrs != b->hd_nhdrs)
+        abort();
+    for (int i = 0; i < a->hd_nhdrs; i++) {
+        x = &a->hd_hdrs[i];
+        y = &b->hd_hdrs[i];
+        if (x->hh_name != y->hh_name || x->hh_name_len != y->hh_name_len ||
+            x->hh_value != y->hh_value || x->hh_value_len != y->hh_value_len ||
+            x->hh_size != y->hh_size)
+            abort();
+    }
+}
+
+#ifndef LIBFUZZER
+int
+main(int argc, char **argv)
+{
+    int opt, nseeds = 0, op, pos;
+    long mutations = 100000;
+    unsigned int seed = 1;
+    size_t len, lens[FUZZ_SEEDS];
+    char *seeds[FUZZ_SEEDS], buf[FUZZ_MAX];
+    const char *alphabet = "\r\n: \t,;=\"aZ09-";
+    FILE *file;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        if (opt == 'n') {
+            mutations = atol(optarg);
+        } else if (opt == 's') {
+            seed = atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-n mutations] [-s seed] file...\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    for (; optind < argc && nseeds < FUZZ_SEEDS; optind++) {
+        if (!(file = fopen(argv[optind], "r"))) {
+            perror(argv[optind]);
+            exit(1);
+        }
+        seeds[nseeds] = malloc(FUZZ_MAX);
+        lens[nseeds] = fread(seeds[nseeds], 1, FUZZ_MAX, file);
+        fclose(file);
+        LLVMFuzzerTestOneInput((uint8_t *) seeds[nseeds], lens[nseeds]);
+        nseeds++;
+    }
+    if (!nseeds) {
+        fprintf(stderr, "%s: no file to start from\n", argv[0]);
+        exit(1);
+    }
+
+    /* Bytes changed, inserted and deleted, then the input cut anywhere */
+    srand(seed);
+    for (long i = 0; i < mutations; i++) {
+        op = rand() % nseeds;
+        len = lens[op];
+        memcpy(buf, seeds[op], len);
+        for (int m = rand() % 8; m > 0; m--) {
+            op = rand() % 3;
+            pos = len ? rand() % len : 0;
+            if (op == 0 && len) {
+                buf[pos] = alphabet[rand() % strlen(alphabet)];
+            } else if (op == 1 && len < FUZZ_MAX) {
+                memmove(buf + pos + 1, buf + pos, len - pos);
+                buf[pos] = alphabet[rand() % strlen(alphabet)];
+                len++;
+            } else if (len) {
+                memmove(buf + pos, buf + pos + 1, len - pos - 1);
+                len--;
+            }
+        }
+        LLVMFuzzerTestOneInput((uint8_t *) buf, rand() % (len + 1));
+    }
+    printf("inputs=%d mutations=%ld scanners=%d\n", nseeds, mutations,
+           nfinders);
+    while (nseeds--)
+        free(seeds[nseeds]);
+    return 0;
+}
+#endif
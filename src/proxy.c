@@ -1,15 +1,34 @@
+#include <errno.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+#include "proxy_arena/arena.h"
+#include "proxy_buf/buf.h"
 #include "proxy_cache/cache.h"
+#include "proxy_disk/disk.h"
+#include "proxy_dns/dns.h"
+#include "proxy_event/event.h"
+#include "proxy_flight/flight.h"
+#include "proxy_http/http.h"
+#include "proxy_listen/listen.h"
+#include "proxy_pool/pool.h"
+#include "proxy_refresh/refresh.h"
+#include "proxy_restart/restart.h"
 #include "proxy_serve/serve.h"
+#include "proxy_stats/stats.h"
+#include "proxy_upstream/upstream.h"
+#include "proxy_warm/warm.h"
+#include "safe_io/sio.h"
 #include "socket_interface/interface.h"
 
+
 typedef struct sockaddr SA;
 
 typedef struct vargp {
@@ -17,105 +36,491 @@ typedef struct vargp {
     int clientfd;
 } Vargp;
 
+/* Accept loop of a listener other than the first, run on a thread */
+typedef struct acceptor {
+    Cache *ac_cache;
+    Pool *ac_pool;              /* NULL when a thread serves each client */
+    int ac_listener;
+} Acceptor;
+
+/* Options without a short form */
+enum long_opt {
+    OPT_UPSTREAM_IDLE = 256,
+    OPT_UPSTREAM_TIMEOUT,
+    OPT_MAX_OBJECT,
+    OPT_CACHE_POLICY,
+    OPT_DEFAULT_TTL,
+    OPT_STALE_WINDOW,
+    OPT_REFRESH_RATE,
+    OPT_DISK_CACHE,
+    OPT_DISK_SIZE,
+    OPT_RESTART_SOCKET,
+    OPT_WARM,
+    OPT_WARM_PARALLEL,
+    OPT_WARM_DEADLINE,
+    OPT_DNS_THREADS,
+    OPT_DNS_TTL,
+    OPT_CONNECT_TIMEOUT,
+    OPT_READ_TIMEOUT,
+    OPT_WRITE_TIMEOUT,
+    OPT_NO_SPLICE,
+    OPT_ZEROCOPY,
+    OPT_LISTENERS,
+    OPT_DEFER_ACCEPT
+};
+
+enum mode {
+    MODE_THREAD,    /* A thread per client */
+    MODE_POOL,      /* A fixed pool of worker threads */
+    MODE_EVENT      /* Event loops over non-blocking sockets */
+};
+
+static void
+usage(const char *prog);
+
+static void
+thread_run(Cache *proxy_cache);
+
+static void
+pool_run(Cache *proxy_cache, int nworkers, size_t depth);
+
+static void
+start_acceptors(Cache *proxy_cache, Pool *pool);
+
 static void *
-client_serve(void *vargp);
+acceptor_thread(void *vargp);
 
 static void
-free_resources(Request *request, Response *response);
+thread_accept(int listener, Cache *proxy_cache);
+
+static void
+pool_accept(int listener, Pool *pool);
+
+static void *
+client_thread(void *vargp);
+
+static void
+client_serve(int clientfd, void *proxy_cache);
+
+static void
+stop_accepting(void);
+
+static Pool *running_pool;
+
+static const struct option long_opts[] = {
+    { "mode",        required_argument, NULL, 'm' },
+    { "loops",       required_argument, NULL, 'n' },
+    { "workers",     required_argument, NULL, 'w' },
+    { "queue-depth", required_argument, NULL, 'q' },
+    { "cache-size",  required_argument, NULL, 'c' },
+    { "max-object-size", required_argument, NULL, OPT_MAX_OBJECT },
+    { "cache-policy", required_argument, NULL, OPT_CACHE_POLICY },
+    { "default-ttl", required_argument, NULL, OPT_DEFAULT_TTL },
+    { "stale-window", required_argument, NULL, OPT_STALE_WINDOW },
+    { "refresh-rate", required_argument, NULL, OPT_REFRESH_RATE },
+    { "disk-cache",  required_argument, NULL, OPT_DISK_CACHE },
+    { "disk-size",   required_argument, NULL, OPT_DISK_SIZE },
+    { "restart-socket", required_argument, NULL, OPT_RESTART_SOCKET },
+    { "warm",        required_argument, NULL, OPT_WARM },
+    { "warm-parallel", required_argument, NULL, OPT_WARM_PARALLEL },
+    { "warm-deadline", required_argument, NULL, OPT_WARM_DEADLINE },
+    { "dns-threads", required_argument, NULL, OPT_DNS_THREADS },
+    { "dns-ttl",     required_argument, NULL, OPT_DNS_TTL },
+    { "connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT },
+    { "read-timeout", required_argument, NULL, OPT_READ_TIMEOUT },
+    { "write-timeout", required_argument, NULL, OPT_WRITE_TIMEOUT },
+    { "no-splice",   no_argument,       NULL, OPT_NO_SPLICE },
+    { "zerocopy",    no_argument,       NULL, OPT_ZEROCOPY },
+    { "listeners",   required_argument, NULL, OPT_LISTENERS },
+    { "defer-accept", required_argument, NULL, OPT_DEFER_ACCEPT },
+    { "upstream-max-idle", required_argument, NULL, OPT_UPSTREAM_IDLE },
+    { "upstream-idle-timeout", required_argument, NULL, OPT_UPSTREAM_TIMEOUT },
+    { NULL, 0, NULL, 0 }
+};
 
 int 
 main(int argc, char **argv)
 {
-    int connfd, listenfd;
-    char hostname[MAX_LINE], port[PORT_LEN];
-    socklen_t client_len;
-    struct sockaddr_storage client_addr;
-    pthread_t tid;
+    int opt, listenfd, nloops = 0, nworkers = 0;
+    int upstream_idle = DEFAULT_MAX_IDLE, upstream_timeout = DEFAULT_IDLE_TIMEOUT;
+    size_t depth = DEFAULT_QUEUE_DEPTH, cache_size = MAX_CACHE_SIZE;
+    size_t max_object = MAX_OBJECT_SIZE;
+    time_t default_ttl = CACHE_DEFAULT_TTL, stale_window = 0;
+    int refresh_rate = DEFAULT_REFRESH_RATE;
+    const char *disk_path = NULL;
+    size_t disk_size = DISK_DEFAULT_SIZE;
+    const char *restart_path = NULL, *warm_path = NULL;
+    int warm_parallel = DEFAULT_WARM_PARALLEL;
+    int warm_deadline = DEFAULT_WARM_DEADLINE;
+    int dns_threads = DEFAULT_DNS_THREADS, dns_ttl = DEFAULT_DNS_TTL;
+    int connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+    int read_timeout = DEFAULT_READ_TIMEOUT;
+    int write_timeout = DEFAULT_WRITE_TIMEOUT;
+    int nlisteners = 1, defer_accept = 0;
+    enum mode mode = MODE_THREAD;
+    enum cache_policy policy = CACHE_CLOCK;
     Cache proxy_cache;
-    Vargp *vargp;
     
     signal(SIGPIPE, SIG_IGN);
 
     /* Check command-line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt_long(argc, argv, "m:n:w:q:c:", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            if (!strcmp(optarg, "thread"))
+                mode = MODE_THREAD;
+            else if (!strcmp(optarg, "pool"))
+                mode = MODE_POOL;
+            else if (!strcmp(optarg, "event"))
+                mode = MODE_EVENT;
+            else
+                usage(argv[0]);
+            break;
+        case 'n':
+            nloops = atoi(optarg);
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'q':
+            depth = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            cache_size = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_MAX_OBJECT:
+            max_object = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_CACHE_POLICY:
+            if (!strcmp(optarg, "clock"))
+                policy = CACHE_CLOCK;
+            else if (!strcmp(optarg, "tinylfu"))
+                policy = CACHE_TINYLFU;
+            else
+                usage(argv[0]);
+            break;
+        case OPT_DEFAULT_TTL:
+            default_ttl = atol(optarg);
+            break;
+        case OPT_STALE_WINDOW:
+            stale_window = atol(optarg);
+            break;
+        case OPT_REFRESH_RATE:
+            refresh_rate = atoi(optarg);
+            break;
+        case OPT_DISK_CACHE:
+            disk_path = optarg;
+            break;
+        case OPT_DISK_SIZE:
+            disk_size = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_RESTART_SOCKET:
+            restart_path = optarg;
+            break;
+        case OPT_WARM:
+            warm_path = optarg;
+            break;
+        case OPT_WARM_PARALLEL:
+            warm_parallel = atoi(optarg);
+            break;
+        case OPT_WARM_DEADLINE:
+            warm_deadline = atoi(optarg);
+            break;
+        case OPT_DNS_THREADS:
+            dns_threads = atoi(optarg);
+            break;
+        case OPT_DNS_TTL:
+            dns_ttl = atoi(optarg);
+            break;
+        case OPT_CONNECT_TIMEOUT:
+            connect_timeout = atoi(optarg);
+            break;
+        case OPT_READ_TIMEOUT:
+            read_timeout = atoi(optarg);
+            break;
+        case OPT_WRITE_TIMEOUT:
+            write_timeout = atoi(optarg);
+            break;
+        case OPT_NO_SPLICE:
+            set_splice(0);
+            break;
+        case OPT_ZEROCOPY:
+            set_zerocopy(1);
+            break;
+        case OPT_LISTENERS:
+            nlisteners = atoi(optarg);
+            break;
+        case OPT_DEFER_ACCEPT:
+            defer_accept = atoi(optarg);
+            break;
+        case OPT_UPSTREAM_IDLE:
+            upstream_idle = atoi(optarg);
+            break;
+        case OPT_UPSTREAM_TIMEOUT:
+            upstream_timeout = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+    /* The next generation is handed a single socket */
+    if (restart_path && nlisteners > 1) {
+        fprintf(stderr, "--listeners is ignored with --restart-socket\n");
+        nlisteners = 1;
+    }
+
+    /* Before any other thread, so SIGUSR1 reaches only the stats thread */
+    stats_init();
+    cache_init(&proxy_cache, cache_size, max_object, policy, default_ttl,
+               stale_window);
+
+    /* A running generation hands over its socket and its cache */
+    listenfd = restart_path ? restart_takeover(restart_path, &proxy_cache)
+                            : -1;
+    if (listenfd < 0 &&
+        (listenfd = open_listenfd(argv[optind], nlisteners > 1)) < 0) {
+        fprintf(stderr, "Can not listen on port %s\n", argv[optind]);
+        exit(1);
+    }
+    if (listen_init(listenfd, argv[optind], nlisteners, defer_accept) < 0)
+        exit(1);
+    if (disk_path && disk_init(&proxy_cache, disk_path, disk_size) < 0)
         exit(1);
+    http_init();
+    arena_init();
+    buf_init();
+    sio_init();
+    dns_init(dns_threads, dns_ttl);
+    set_client_timeouts(connect_timeout, read_timeout, write_timeout);
+    upstream_init(upstream_idle, upstream_timeout);
+    flight_init();
+    refresh_init(&proxy_cache, refresh_rate);
+    if (restart_path)
+        restart_serve(restart_path, &proxy_cache, listenfd,
+                      mode == MODE_EVENT ? event_stop_accepting
+                                         : stop_accepting);
+    /* The first clients find the listed responses cached, unless the
+     * warm-up takes longer than they may wait for accept */
+    if (warm_path && warm_start(warm_path, &proxy_cache, warm_parallel) == 0)
+        warm_wait(warm_deadline);
+
+    switch (mode) {
+    case MODE_POOL:
+        pool_run(&proxy_cache, nworkers, depth);
+        break;
+    case MODE_EVENT:
+        event_run(&proxy_cache, nloops);
+        break;
+    default:
+        thread_run(&proxy_cache);
     }
 
-    listenfd = open_listenfd(argv[1]);
-    cache_init(&proxy_cache);
-    while (1) {
-        client_len = sizeof(client_addr);
-        if ((connfd = accept(listenfd, (SA* ) &client_addr, &client_len)) < 0) {
-            fprintf(stderr, "Connection to (%s, %s) failed\n", hostname, port);
+    /* Handed off, the clients left are served until the process exits */
+    pthread_exit(NULL);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-m thread|pool|event] [-n loops] [-w workers] "
+            "[-q queue-depth] [-c cache-bytes]\n"
+            "       [--cache-policy clock|tinylfu] [--max-object-size bytes] "
+            "[--default-ttl secs]\n"
+            "       [--stale-window secs] [--refresh-rate n] "
+            "[--disk-cache file] [--disk-size bytes]\n"
+            "       [--restart-socket path] [--warm file] [--warm-parallel n] "
+            "[--warm-deadline secs]\n"
+            "       [--dns-threads n] [--dns-ttl secs] [--connect-timeout secs] "
+            "[--read-timeout secs]\n"
+            "       [--write-timeout secs] [--no-splice] [--zerocopy] "
+            "[--listeners n]\n"
+            "       [--defer-accept secs] [--upstream-max-idle n] "
+            "[--upstream-idle-timeout secs] <port>\n", prog);
+    exit(1);
+}
+
+/*
+ * thread_run - Serve every accepted client on a thread of its own, the
+ *     thread of the acceptor of its listener starts it
+ */
+static void
+thread_run(Cache *proxy_cache)
+{
+    start_acceptors(proxy_cache, NULL);
+    thread_accept(0, proxy_cache);
+}
+
+/*
+ * pool_run - Serve the accepted clients on a fixed pool of workers,
+ *     accepting only while the pool has room for another client
+ */
+static void
+pool_run(Cache *proxy_cache, int nworkers, size_t depth)
+{
+    /* The workers serve on once the main thread is out of here */
+    static Pool pool;
+
+    pool_init(&pool, nworkers, depth, client_serve, proxy_cache);
+    running_pool = &pool;
+    start_acceptors(proxy_cache, &pool);
+    pool_accept(0, &pool);
+}
+
+/*
+ * start_acceptors - Accept on every listener but the first on a thread of
+ *     its own, the main thread accepts on the first one
+ */
+static void
+start_acceptors(Cache *proxy_cache, Pool *pool)
+{
+    pthread_t tid;
+    Acceptor *acceptor;
+
+    for (int i = 1; i < listen_count(); i++) {
+        acceptor = malloc(sizeof(Acceptor));
+        acceptor->ac_cache = proxy_cache;
+        acceptor->ac_pool = pool;
+        acceptor->ac_listener = i;
+        pthread_create(&tid, NULL, acceptor_thread, acceptor);
+    }
+}
+
+static void *
+acceptor_thread(void *vargp)
+{
+    Acceptor acceptor = *(Acceptor *) vargp;
+
+    free(vargp);
+    pthread_detach(pthread_self());
+    if (acceptor.ac_pool)
+        pool_accept(acceptor.ac_listener, acceptor.ac_pool);
+    else
+        thread_accept(acceptor.ac_listener, acceptor.ac_cache);
+    return NULL;
+}
+
+/*
+ * thread_accept - Accept clients on the listener, each served by a thread
+ *     that runs on the CPU of the listener like the acceptor
+ */
+static void
+thread_accept(int listener, Cache *proxy_cache)
+{
+    int connfd;
+    pthread_t tid;
+    Vargp *vargp;
+
+    listen_pin(listener);
+    set_nonblocking(listen_fd(listener));
+    while (listen_wait(listener) == 0) {
+        /* Another acceptor may have taken the client */
+        if ((connfd = listen_accept(listener, SOCK_CLOEXEC)) < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                perror("accept");
             continue;
         }
         vargp = malloc(sizeof(Vargp));
         vargp->clientfd = connfd;
-        vargp->proxy_cache = &proxy_cache;
-        pthread_create(&tid, NULL, client_serve, vargp);
+        vargp->proxy_cache = proxy_cache;
+        pthread_create(&tid, NULL, client_thread, vargp);
     }
 }
 
+/*
+ * pool_accept - Accept clients on the listener while the pool has room,
+ *     queued for the workers on the CPU of the listener first
+ */
+static void
+pool_accept(int listener, Pool *pool)
+{
+    int connfd;
+
+    listen_pin(listener);
+    set_nonblocking(listen_fd(listener));
+    while (pool_wait_slot(pool) == 0) {
+        if (listen_wait(listener) < 0) {
+            pool_release_slot(pool);
+            break;
+        }
+        if ((connfd = listen_accept(listener, SOCK_CLOEXEC)) < 0) {
+            pool_release_slot(pool);
+            continue;
+        }
+        pool_submit(pool, listener, connfd);
+    }
+}
+
+/*
+ * stop_accepting - Get the acceptors out of their loop once the proxy is
+ *     handed off to its next generation, wherever they wait
+ */
+static void
+stop_accepting(void)
+{
+    listen_stop();
+    if (running_pool)
+        pool_stop(running_pool);
+}
+
 static void *
-client_serve(void *vargp)
+client_thread(void *vargp)
 {
     int clientfd;
     Cache *proxy_cache;
-    Request client_request;
-    Response server_response;
 
     clientfd = ((Vargp *) vargp)->clientfd;
     proxy_cache = ((Vargp *) vargp)->proxy_cache;
     free(vargp);
 
     pthread_detach(pthread_self());
-    /* Initialize client_request and server_response structs with NULL */
-    memset(&client_request, 0, sizeof(client_request));
-    memset(&server_response, 0, sizeof(server_response));
-    
-    /* Parse the HTTP request */
-    if (!(parse_request(clientfd, &client_request) < 0)) {
-        /* Forward the client request to the server after parsing successfully */
-        if (!(forward_client_request(&client_request, proxy_cache,
-                                     &server_response) < 0)) {
-            /* Forward the server response to the client after requesting 
-             * successfully */
-            if (!(forward_server_response(clientfd, &server_response) < 0)) {
-                /* Action taking on successful serving */
-            }
-        }
-    }
-
-    free_resources(&client_request, &server_response);
-    close(clientfd);
+    client_serve(clientfd, proxy_cache);
     return NULL;
 }
 
 static void
-free_resources(Request *request, Response *response)
+client_serve(int clientfd, void *proxy_cache)
 {
-    if (request->rq_method)
-        free(request->rq_method);
-
-    if (request->rq_hostname)
-        free(request->rq_hostname);
+    int keep_alive;
+    Sio client_sio;
+    Request client_request;
+    Response server_response;
+    Arena arena;
+    struct timeval timeout = { CLIENT_IDLE_TIMEOUT, 0 };
 
-    if (request->rq_port)
-        free(request->rq_port);
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    zerocopy_client(clientfd);
 
-    if (request->rq_path)
-        free(request->rq_path);
+    /* Initialize safe read buffer associated with the clientfd, it keeps
+     * the pipelined requests read along with the current one */
+    sio_initbuf(&client_sio, clientfd);
+    arena_start(&arena);
 
-    if (request->rq_hdrs)
-        free(request->rq_hdrs);
+    do {
+        /* The requests of the connection take turns with one arena */
+        init_resources(&client_request, &server_response, &arena);
+        keep_alive = 0;
 
-    if (response->rs_line)
-        free(response->rs_line);
+        /* Parse the HTTP request */
+        if (!(parse_request(&client_sio, &client_request) < 0)) {
+            /* Forward the client request to the server after parsing successfully */
+            if (!(forward_client_request(&client_request, proxy_cache,
+                                         &server_response) < 0)) {
+                /* Forward the server response to the client after requesting 
+                 * successfully */
+                if (!(forward_server_response(clientfd, &client_request,
+                                              &server_response) < 0)) {
+                    /* Serve the next request of the connection */
+                    keep_alive = !server_response.rs_client_close;
+                }
+            }
+        }
 
-    if (response->rs_hdrs)
-        free(response->rs_hdrs);
+        free_resources(&client_request, &server_response);
+    } while (keep_alive);
 
-    if (response->rs_content)
-        free(response->rs_content);
+    sio_release(&client_sio);
+    arena_free(&arena);
+    close(clientfd);
 }
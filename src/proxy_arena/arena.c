@@ -0,0 +1,162 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "../proxy_stats/stats.h"
+
+static void
+new_block(Arena *arena, size_t n);
+
+static void
+drop_blocks(Arena *arena, int keep);
+
+static void
+arena_report(FILE *out, void *arg);
+
+static atomic_long arenas;
+static atomic_size_t held;              /* Bytes of the blocks of them all */
+static atomic_ulong resets, allocs, mallocs;
+
+void
+arena_init(void)
+{
+    stats_register("arena", arena_report, NULL);
+}
+
+/*
+ * arena_start - Set up an empty arena, its first block is allocated with
+ *     its first allocation
+ */
+void
+arena_start(Arena *arena)
+{
+    arena->ar_blocks = NULL;
+    arena->ar_ptr = arena->ar_end = NULL;
+    arena->ar_allocs = arena->ar_mallocs = 0;
+    atomic_fetch_add_explicit(&arenas, 1, memory_order_relaxed);
+}
+
+/*
+ * arena_alloc - Take n bytes from the arena, aligned for any type. A new
+ *     block is allocated when the newest one has no room left, as large
+ *     as n if it is larger than a block.
+ */
+void *
+arena_alloc(Arena *arena, size_t n)
+{
+    char *p;
+
+    n = (n + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (n > (size_t) (arena->ar_end - arena->ar_ptr))
+        new_block(arena, n);
+    p = arena->ar_ptr;
+    arena->ar_ptr += n;
+    arena->ar_allocs++;
+    return p;
+}
+
+char *
+arena_strdup(Arena *arena, const char *s)
+{
+    return arena_strndup(arena, s, strlen(s));
+}
+
+/*
+ * arena_strndup - Copy the n bytes of s to the arena as a string
+ */
+char *
+arena_strndup(Arena *arena, const char *s, size_t n)
+{
+    char *p = arena_alloc(arena, n + 1);
+
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+/*
+ * arena_reset - Drop everything allocated from the arena at once, once a
+ *     request is served. Only its first block is kept, if it has the usual
+ *     size.
+ */
+void
+arena_reset(Arena *arena)
+{
+    /* A connection closed before its next request served none */
+    if (arena->ar_allocs)
+        atomic_fetch_add_explicit(&resets, 1, memory_order_relaxed);
+    drop_blocks(arena, 1);
+}
+
+/*
+ * arena_free - Free all the blocks of the arena
+ */
+void
+arena_free(Arena *arena)
+{
+    drop_blocks(arena, 0);
+    atomic_fetch_sub_explicit(&arenas, 1, memory_order_relaxed);
+}
+
+/*
+ * drop_blocks - Free the blocks of the arena but the first one if keep is
+ *     set, and account for the allocations made since the last time
+ */
+static void
+drop_blocks(Arena *arena, int keep)
+{
+    ArenaBlock *block = arena->ar_blocks, *next;
+
+    while (block && (!keep || block->ab_next ||
+                     block->ab_size != ARENA_BLOCK_SIZE)) {
+        next = block->ab_next;
+        atomic_fetch_sub_explicit(&held, block->ab_size,
+                                  memory_order_relaxed);
+        free(block);
+        block = next;
+    }
+    arena->ar_blocks = block;
+    arena->ar_ptr = block ? block->ab_data : NULL;
+    arena->ar_end = block ? block->ab_data + block->ab_size : NULL;
+
+    /* The counts are shared once a request, not on every allocation */
+    atomic_fetch_add_explicit(&allocs, arena->ar_allocs,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&mallocs, arena->ar_mallocs,
+                              memory_order_relaxed);
+    arena->ar_allocs = arena->ar_mallocs = 0;
+}
+
+static void
+new_block(Arena *arena, size_t n)
+{
+    size_t size = n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE;
+    ArenaBlock *block;
+
+    if (!(block = malloc(sizeof(ArenaBlock) + size))) {
+        perror("arena");
+        exit(1);
+    }
+    block->ab_size = size;
+    block->ab_next = arena->ar_blocks;
+    arena->ar_blocks = block;
+    arena->ar_ptr = block->ab_data;
+    arena->ar_end = block->ab_data + size;
+    arena->ar_mallocs++;
+    atomic_fetch_add_explicit(&held, size, memory_order_relaxed);
+}
+
+static void
+arena_report(FILE *out, void *arg)
+{
+    unsigned long nresets = atomic_load(&resets);
+
+    fprintf(out, " arenas=%ld bytes=%zu requests=%lu allocs=%lu mallocs=%lu "
+            "allocs_per_request=%.2f mallocs_per_request=%.3f",
+            atomic_load(&arenas), atomic_load(&held), nresets,
+            atomic_load(&allocs), atomic_load(&mallocs),
+            nresets ? (double) atomic_load(&allocs) / nresets : 0.0,
+            nresets ? (double) atomic_load(&mallocs) / nresets : 0.0);
+}
@@ -0,0 +1,50 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE    16384   /* Block kept across resets */
+#define ARENA_ALIGN         16
+
+typedef struct arena_block {
+    struct arena_block *ab_next;    /* Block allocated before it */
+    size_t ab_size;                 /* Bytes of ab_data */
+    _Alignas(ARENA_ALIGN) char ab_data[];
+} ArenaBlock;
+
+/*
+ * Bump allocator for the strings and buffers of a request and its
+ * response: they are never freed one by one, the arena is reset once the
+ * request is served. Its first block is kept for the next request, so a
+ * connection serving ordinary requests calls malloc once.
+ */
+typedef struct arena {
+    ArenaBlock *ar_blocks;          /* Newest first */
+    char *ar_ptr;                   /* Free bytes of the newest block */
+    char *ar_end;
+    unsigned long ar_allocs;        /* Since the last reset */
+    unsigned long ar_mallocs;
+} Arena;
+
+void
+arena_init(void);
+
+void
+arena_start(Arena *arena);
+
+void *
+arena_alloc(Arena *arena, size_t n);
+
+char *
+arena_strdup(Arena *arena, const char *s);
+
+char *
+arena_strndup(Arena *arena, const char *s, size_t n);
+
+void
+arena_reset(Arena *arena);
+
+void
+arena_free(Arena *arena);
+
+#endif
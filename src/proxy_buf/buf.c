@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "buf.h"
+#include "../proxy_stats/stats.h"
+
+#define INDEX_MASK 0xffffffffUL
+
+static BufPage *
+pop_page(void);
+
+static void
+push_page(BufPage *page);
+
+static void
+buf_report(FILE *out, void *arg);
+
+/*
+ * The pool pages are carved from one mapping reserved at startup, in the
+ * order they are first needed. The free ones make a stack: its head packs
+ * the index + 1 of the top page with a count of the changes made to it, so
+ * a page popped and pushed back meanwhile does not fool a pop.
+ */
+static BufPage pages[BUF_POOL_PAGES];
+static char *region;
+static atomic_ulong free_head;
+static atomic_uint carved;
+static atomic_long outstanding, nfree;
+static atomic_ulong gets, hits, overflows;
+
+/*
+ * buf_init - Reserve the pool pages, memory is only used as they are
+ *     carved. Without the mapping every page is allocated on its own.
+ */
+void
+buf_init(void)
+{
+    region = mmap(NULL, (size_t) BUF_POOL_PAGES * BUF_PAGE_SIZE,
+                  PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        perror("buf");
+        region = NULL;
+        atomic_store(&carved, BUF_POOL_PAGES);
+    }
+    stats_register("buf", buf_report, NULL);
+}
+
+/*
+ * buf_page_get - Take a page with one reference: a free one of the pool,
+ *     else one never used, else one allocated outside of the pool when it
+ *     is all taken. Returns NULL if there is no memory left.
+ */
+BufPage *
+buf_page_get(void)
+{
+    unsigned int i;
+    BufPage *page;
+
+    atomic_fetch_add_explicit(&gets, 1, memory_order_relaxed);
+    if ((page = pop_page())) {
+        atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+    } else if (atomic_load(&carved) < BUF_POOL_PAGES &&
+               (i = atomic_fetch_add(&carved, 1)) < BUF_POOL_PAGES) {
+        page = &pages[i];
+        page->pg_data = region + (size_t) i * BUF_PAGE_SIZE;
+    } else {
+        if (!(page = malloc(sizeof(BufPage) + BUF_PAGE_SIZE)))
+            return NULL;
+        page->pg_data = (char *) (page + 1);
+        atomic_fetch_add_explicit(&overflows, 1, memory_order_relaxed);
+    }
+
+    atomic_init(&page->pg_refs, 1);
+    atomic_fetch_add_explicit(&outstanding, 1, memory_order_relaxed);
+    return page;
+}
+
+BufPage *
+buf_page_ref(BufPage *page)
+{
+    atomic_fetch_add_explicit(&page->pg_refs, 1, memory_order_relaxed);
+    return page;
+}
+
+/*
+ * buf_page_put - Drop a reference to the page, the last one gives it back
+ */
+void
+buf_page_put(BufPage *page)
+{
+    if (atomic_fetch_sub_explicit(&page->pg_refs, 1,
+                                  memory_order_acq_rel) != 1)
+        return;
+
+    atomic_fetch_sub_explicit(&outstanding, 1, memory_order_relaxed);
+    if (page >= pages && page < pages + BUF_POOL_PAGES)
+        push_page(page);
+    else
+        free(page);
+}
+
+/*
+ * buf_page_shared - Whether others than the caller hold bytes of the page,
+ *     which must not be written over then
+ */
+int
+buf_page_shared(BufPage *page)
+{
+    return atomic_load_explicit(&page->pg_refs, memory_order_acquire) > 1;
+}
+
+/*
+ * buf_chain_append - Add len bytes of the page at data to the chain. Bytes
+ *     following the last ones of the chain in the same page extend its
+ *     last slice, others take a reference to their page.
+ */
+void
+buf_chain_append(BufChain *chain, Arena *arena, BufPage *page,
+                 const char *data, size_t len)
+{
+    BufSlice *slice = chain->bc_tail;
+
+    chain->bc_len += len;
+    if (slice && slice->bs_page == page &&
+        slice->bs_data + slice->bs_len == data) {
+        slice->bs_len += len;
+        return;
+    }
+
+    slice = arena_alloc(arena, sizeof(BufSlice));
+    slice->bs_page = buf_page_ref(page);
+    slice->bs_data = data;
+    slice->bs_len = len;
+    slice->bs_next = NULL;
+    if (chain->bc_tail)
+        chain->bc_tail->bs_next = slice;
+    else
+        chain->bc_head = slice;
+    chain->bc_tail = slice;
+    chain->bc_nslices++;
+}
+
+/*
+ * buf_chain_iov - Describe the bytes of the chain with bc_nslices buffers
+ *     allocated from arena
+ */
+struct iovec *
+buf_chain_iov(const BufChain *chain, Arena *arena)
+{
+    int i = 0;
+    struct iovec *iov;
+
+    iov = arena_alloc(arena, (chain->bc_nslices + 1) * sizeof(*iov));
+    for (BufSlice *slice = chain->bc_head; slice; slice = slice->bs_next) {
+        iov[i].iov_base = (void *) slice->bs_data;
+        iov[i++].iov_len = slice->bs_len;
+    }
+    return iov;
+}
+
+/*
+ * buf_chain_release - Drop the pages of the chain and empty it, its slices
+ *     go with the arena
+ */
+void
+buf_chain_release(BufChain *chain)
+{
+    for (BufSlice *slice = chain->bc_head; slice; slice = slice->bs_next)
+        buf_page_put(slice->bs_page);
+    chain->bc_head = chain->bc_tail = NULL;
+    chain->bc_len = 0;
+    chain->bc_nslices = 0;
+}
+
+static BufPage *
+pop_page(void)
+{
+    unsigned long head, next;
+    BufPage *page;
+
+    head = atomic_load_explicit(&free_head, memory_order_acquire);
+    do {
+        if (!(head & INDEX_MASK))
+            return NULL;
+        page = &pages[(head & INDEX_MASK) - 1];
+        next = ((head >> 32) + 1) << 32 |
+               atomic_load_explicit(&page->pg_next, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&free_head, &head, next,
+                                                    memory_order_acquire,
+                                                    memory_order_acquire));
+    atomic_fetch_sub_explicit(&nfree, 1, memory_order_relaxed);
+    return page;
+}
+
+static void
+push_page(BufPage *page)
+{
+    unsigned long head, next;
+
+    head = atomic_load_explicit(&free_head, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&page->pg_next, head & INDEX_MASK,
+                              memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | (unsigned long) (page - pages + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&free_head, &head, next,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    atomic_fetch_add_explicit(&nfree, 1, memory_order_relaxed);
+}
+
+static void
+buf_report(FILE *out, void *arg)
+{
+    unsigned long ngets = atomic_load(&gets);
+    unsigned int ncarved = atomic_load(&carved);
+
+    fprintf(out, " pages=%ld free=%ld carved=%u max=%d gets=%lu hits=%lu "
+            "hit_ratio=%.1f%% overflows=%lu", atomic_load(&outstanding),
+            atomic_load(&nfree),
+            ncarved < BUF_POOL_PAGES ? ncarved : BUF_POOL_PAGES,
+            BUF_POOL_PAGES, ngets, atomic_load(&hits),
+            ngets ? 100.0 * atomic_load(&hits) / ngets : 0.0,
+            atomic_load(&overflows));
+}
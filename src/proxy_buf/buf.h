@@ -0,0 +1,68 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "../proxy_arena/arena.h"
+
+#define BUF_PAGE_SIZE   16384   /* Bytes of a page, a message head fits */
+#define BUF_POOL_PAGES  8192    /* Pages the pool reserves, 128MB */
+
+/*
+ * Page of the bytes read from a connection. Whoever keeps bytes of it
+ * holds a reference: the buffer it is read into, and the copy of a body
+ * being cached or output waiting for the client. It goes back to the pool
+ * once the last one is dropped.
+ */
+typedef struct buf_page {
+    atomic_uint pg_refs;
+    atomic_uint pg_next;            /* Free page under it, index + 1 */
+    char *pg_data;                  /* BUF_PAGE_SIZE bytes */
+} BufPage;
+
+/* Bytes of a page, the page is referenced once per chain */
+typedef struct buf_slice {
+    BufPage *bs_page;
+    const char *bs_data;
+    size_t bs_len;
+    struct buf_slice *bs_next;
+} BufSlice;
+
+/*
+ * Bytes kept without copying them, in the pages they were read into. Its
+ * slices are allocated from the arena of the request it belongs to.
+ */
+typedef struct buf_chain {
+    BufSlice *bc_head, *bc_tail;
+    size_t bc_len;
+    int bc_nslices;
+} BufChain;
+
+void
+buf_init(void);
+
+BufPage *
+buf_page_get(void);
+
+BufPage *
+buf_page_ref(BufPage *page);
+
+void
+buf_page_put(BufPage *page);
+
+int
+buf_page_shared(BufPage *page);
+
+void
+buf_chain_append(BufChain *chain, Arena *arena, BufPage *page,
+                 const char *data, size_t len);
+
+struct iovec *
+buf_chain_iov(const BufChain *chain, Arena *arena);
+
+void
+buf_chain_release(BufChain *chain);
+
+#endif
@@ -1,185 +1,1091 @@
-#include <semaphore.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "cache.h"
+#include "../proxy_disk/disk.h"
+#include "../proxy_ebr/ebr.h"
+#include "../proxy_slab/slab.h"
+#include "../proxy_stats/stats.h"
+
+static void
+write_entry(Cache *cache, const char *key, size_t key_len,
+            const char *response_line, const char *response_hdrs,
+            const struct iovec *content, int content_cnt,
+            size_t content_len, time_t date, time_t expires,
+            time_t stale_until, int vary);
+
+static void
+insert_entry(Cache *cache, CacheShard *shard, CacheEntry *entry);
 
 static unsigned long
-generate_tag(const char *request_line, const char *request_hdrs);
+hash_key(const char *key, size_t key_len);
 
-static int
-find_empty_line(Cache *cache);
+static CacheShard *
+find_shard(Cache *cache, unsigned long tag);
+
+static CacheEntry *
+take_entry(CacheShard *shard, unsigned long tag, const char *key,
+           size_t key_len);
+
+static CacheEntry *
+find_entry(CacheTable *table, unsigned long tag, const char *key,
+           size_t key_len);
+
+static size_t
+find_slot(CacheTable *table, unsigned long tag, const char *key,
+          size_t key_len);
 
 static int
-find_victim(Cache *cache);
+has_key(const CacheEntry *entry, const char *key, size_t key_len);
+
+static CacheTable *
+new_table(size_t nslots);
+
+static void
+insert_slot(CacheShard *shard, CacheEntry *entry);
+
+static void
+place_entry(CacheTable *table, CacheEntry *entry);
+
+static void
+remove_slot(CacheTable *table, size_t slot);
+
+static CacheEntry *
+clock_victim(CacheShard *shard);
+
+static void
+evict_entry(Cache *cache, CacheShard *shard);
+
+static void
+make_room(Cache *cache, CacheShard *shard, size_t bytes);
 
 static int
-find_line(Cache *cache, unsigned int tag);
+evict_class(Cache *cache, CacheShard *shard, size_t chunk);
+
+static void
+discard_entry(CacheShard *shard, CacheEntry *entry);
 
 static void
-destruct_line(Cache *cache, int idx);
+admit_window(CacheShard *shard);
+
+static CacheEntry *
+main_victim(CacheShard *shard);
+
+static void
+link_entry(CacheShard *shard, CacheEntry *entry, int segment);
+
+static void
+unlink_entry(CacheShard *shard, CacheEntry *entry);
+
+static CacheEntry *
+new_entry(SlabPool *slabs, size_t *bytes, unsigned long tag,
+          const char *key, size_t key_len, const char *response_line,
+          const char *response_hdrs, const struct iovec *content,
+          int content_cnt, size_t content_len, time_t date, time_t expires,
+          time_t stale_until, int vary);
+
+static CacheEntry *
+copy_entry(SlabPool *slabs, unsigned long tag, const CacheEntry *image);
+
+static CacheStripe *
+my_stripe(Cache *cache);
 
+static void
+unref_entry(void *entry);
+
+static void
+destruct_table(void *table);
+
+static void
+cache_report(FILE *out, void *arg);
+
+static const char *keep_alive_hdr = "Connection: keep-alive\r\n\r\n";
+static const char *policy_names[] = { "clock", "tinylfu" };
+
+static atomic_int next_stripe;
+static __thread int stripe = -1;
+
+/*
+ * cache_init - Split the cache into shards of max_size / nshards bytes,
+ *     with fewer shards for small caches so every shard still holds a
+ *     few of the largest objects. The entries of a shard are allocated
+ *     from slabs of its own that never take more than its share, so
+ *     evicting from the shard always frees the memory it needs.
+ */
 void
-cache_init(Cache *cache)
+cache_init(Cache *cache, size_t max_size, size_t max_object,
+           enum cache_policy policy, time_t default_ttl,
+           time_t stale_window)
 {
-    cache->readcnt = 0;
-    cache->highest_timestamp = 0;
-    sem_init(&cache->write_mutex, 0, 1);
-    sem_init(&cache->readcnt_mutex, 0, 1);
-    sem_init(&cache->timestamp_mutex, 0, 1);
-    memset(cache->cache_set, 0, sizeof(cache->cache_set));
+    size_t main_size;
+    CacheShard *shard;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->max_size = max_size ? max_size : MAX_CACHE_SIZE;
+    cache->max_object = max_object ? max_object : MAX_OBJECT_SIZE;
+    cache->policy = policy;
+    cache->default_ttl = default_ttl;
+    cache->stale_window = stale_window;
+    cache->nshards = CACHE_SHARDS;
+    while (cache->nshards > 1 &&
+           cache->max_size / cache->nshards < 4 * cache->max_object)
+        cache->nshards /= 2;
+
+    for (int i = 0; i < cache->nshards; i++) {
+        shard = &cache->shards[i];
+        slab_init(&shard->slabs, cache->max_size / cache->nshards,
+                  sizeof(CacheEntry) + cache->max_object + CACHE_FRAMING_SIZE
+                  + CACHE_KEY_ROOM);
+        shard->max_size = cache->max_size / cache->nshards
+                          * (100 - CACHE_SLAB_SLACK_PCT) / 100;
+        atomic_init(&shard->table, new_table(CACHE_MIN_SLOTS));
+        pthread_mutex_init(&shard->write_mutex, NULL);
+
+        if (policy != CACHE_TINYLFU)
+            continue;
+        shard->segments[CACHE_WINDOW].max_size = shard->max_size
+                                                 * CACHE_WINDOW_PCT / 100;
+        /* Probation may take all of the main share the protected one
+         * leaves */
+        main_size = shard->max_size - shard->segments[CACHE_WINDOW].max_size;
+        shard->segments[CACHE_PROBATION].max_size = main_size;
+        shard->segments[CACHE_PROTECTED].max_size = main_size
+                                                    * CACHE_PROTECTED_PCT / 100;
+        sketch_init(&shard->sketch, shard->max_size / CACHE_SKETCH_OBJECT);
+    }
+
+    ebr_init();
+    stats_register("cache", cache_report, cache);
 }
 
+/*
+ * cache_write - Cache a response under key, replacing what it holds. Its
+ *     body is gathered from the content_cnt buffers of content. It is
+ *     fresh until expires and may be sent stale until stale_until, date is
+ *     when its age was 0.
+ */
 void
-cache_write(Cache *cache, const char *request_line, const char *request_hdrs,
-            const char *response_line, const char *response_hdrs, 
-            const void *content, const size_t content_len)
+cache_write(Cache *cache, const char *key, size_t key_len,
+            const char *response_line, const char *response_hdrs,
+            const struct iovec *content, int content_cnt,
+            time_t date, time_t expires, time_t stale_until)
 {
-    int idx;
-    unsigned int tag; 
-    size_t object_size;
-    char *response_line_copy, *response_hdrs_copy;
-    void *content_copy;
+    size_t content_len = 0;
+
+    for (int i = 0; i < content_cnt; i++)
+        content_len += content[i].iov_len;
+    write_entry(cache, key, key_len, response_line, response_hdrs, content,
+                content_cnt, content_len, date, expires, stale_until, 0);
+}
+
+/*
+ * cache_write_vary - Note under key the request headers, named by the
+ *     Vary header of its response, whose values extend the key the
+ *     response itself is cached under
+ */
+void
+cache_write_vary(Cache *cache, const char *key, size_t key_len,
+                 const char *vary)
+{
+    struct iovec content = { (void *) vary, strlen(vary) };
+
+    write_entry(cache, key, key_len, "", "", &content, 1, content.iov_len, 0,
+                0, 0, 1);
+}
+
+static void
+write_entry(Cache *cache, const char *key, size_t key_len,
+            const char *response_line, const char *response_hdrs,
+            const struct iovec *content, int content_cnt,
+            size_t content_len, time_t date, time_t expires,
+            time_t stale_until, int vary)
+{
+    unsigned long tag;
+    size_t object_size, slot, bytes;
+    CacheShard *shard;
+    CacheTable *table;
+    CacheEntry *entry, *victim;
+
+    tag = hash_key(key, key_len);
+    shard = find_shard(cache, tag);
 
     object_size = content_len + strlen(response_line) + strlen(response_hdrs);
-    /* Check if the total size of the object not exceeding the MAX_OBJECT_SIZE */
-    if (object_size > MAX_OBJECT_SIZE)
+    /* Check if the total size of the object not exceeding the max object size,
+     * a long key takes from it */
+    if (object_size > cache->max_object || object_size > shard->max_size ||
+        key_len > CACHE_KEY_SIZE ||
+        object_size + key_len > cache->max_object + CACHE_KEY_ROOM)
         return;
 
-    tag = generate_tag(request_line, request_hdrs);
-    response_line_copy = strdup(response_line);
-    response_hdrs_copy = strdup(response_hdrs);
-    content_copy = malloc(content_len);
-    memcpy(content_copy, content, content_len);
-
-    /* Acquire the the write mutex to protect writing process */
-    sem_wait(&cache->write_mutex);
-
-    /* Find empty cache line */
-    idx = find_empty_line(cache);
-    if (idx < 0) {
-        idx = find_victim(cache);
-        destruct_line(cache, idx);
-    }
-    
-    /* Place cache line */
-    cache->cache_set[idx].valid = 1;
-    cache->cache_set[idx].tag = tag;
-    cache->cache_set[idx].timestamp = ++cache->highest_timestamp;
-    cache->cache_set[idx].content_len = content_len;
-    cache->cache_set[idx].response_line = response_line_copy;
-    cache->cache_set[idx].response_hdrs = response_hdrs_copy;
-    cache->cache_set[idx].content = content_copy;
-
-    /* Release the write_mutex */
-    sem_post(&cache->write_mutex);
-}
-
-int
-cache_fetch(Cache *cache, const char *request_line, const char *request_hdrs,
-            char **response_line, char **response_hdrs,
-            void **content, size_t *content_len)
-{
-    unsigned int tag;
-    int idx, is_cached;
-
-    tag = generate_tag(request_line, request_hdrs);
-    sem_wait(&cache->readcnt_mutex);
-    cache->readcnt++;
-    if (cache->readcnt == 1)    /* First in */
-        sem_wait(&cache->write_mutex);
-    sem_post(&cache->readcnt_mutex);
-
-    idx = find_line(cache, tag);
-    if (idx < 0) {
-        is_cached = 0;
+    entry = new_entry(&shard->slabs, &bytes, tag, key, key_len,
+                      response_line, response_hdrs, content, content_cnt,
+                      content_len, date, expires, stale_until, vary);
+
+    /* Writers of a shard take turns, its readers never wait for them */
+    pthread_mutex_lock(&shard->write_mutex);
+    table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+
+    /* A response fetched by two clients at once replaces the older one */
+    if ((slot = find_slot(table, tag, key, key_len)) < table->nslots) {
+        victim = atomic_load_explicit(&table->entries[slot],
+                                      memory_order_relaxed);
+        remove_slot(table, slot);
+        if (cache->policy == CACHE_TINYLFU)
+            unlink_entry(shard, victim);
+        shard->count--;
+        shard->size -= victim->size;
+        ebr_retire(victim, unref_entry);
+    }
+
+    /* The slabs of the shard may be out of room while the shard is not,
+     * full of other classes or waiting for retired entries */
+    while (!entry && shard->count > 0) {
+        make_room(cache, shard, bytes);
+        entry = new_entry(&shard->slabs, &bytes, tag, key, key_len,
+                          response_line, response_hdrs, content, content_cnt,
+                          content_len, date, expires, stale_until, vary);
+    }
+    if (!entry)
+        shard->failures++;
+    if (!entry || entry->size > shard->max_size) {
+        pthread_mutex_unlock(&shard->write_mutex);
+        if (entry)
+            cache_release(entry);
+        return;
+    }
+
+    insert_entry(cache, shard, entry);
+    pthread_mutex_unlock(&shard->write_mutex);
+}
+
+/*
+ * insert_entry - Put a new entry in the shard, making room for it the way
+ *     the policy does. Called with its write mutex held.
+ */
+static void
+insert_entry(Cache *cache, CacheShard *shard, CacheEntry *entry)
+{
+    if (cache->policy == CACHE_TINYLFU) {
+        /* New entries go through the window, its oldest ones then have
+         * to win their place in the main segments */
+        insert_slot(shard, entry);
+        shard->count++;
+        shard->size += entry->size;
+        link_entry(shard, entry, CACHE_WINDOW);
+        admit_window(shard);
     } else {
-        is_cached = 1;
-        *response_line = strdup(cache->cache_set[idx].response_line);
-        *response_hdrs = strdup(cache->cache_set[idx].response_hdrs);
+        /* Evict the entries the clock hand finds unused until it fits */
+        while (shard->size + entry->size > shard->max_size)
+            evict_entry(cache, shard);
 
-        *content_len = cache->cache_set[idx].content_len;
-        *content = malloc(cache->cache_set[idx].content_len);
-        memcpy(*content, cache->cache_set[idx].content, 
-               cache->cache_set[idx].content_len);
+        insert_slot(shard, entry);
+        shard->count++;
+        shard->size += entry->size;
+    }
+}
+
+/*
+ * cache_restore - Cache again an entry saved from the cache, the way the
+ *     disk tier keeps the evicted ones. image is the saved entry, followed
+ *     by its data and key. An entry cached under its key meanwhile is
+ *     newer and kept instead. Returns the entry cached under the key with
+ *     a reference taken, NULL if the image does not fit anymore.
+ */
+CacheEntry *
+cache_restore(Cache *cache, const CacheEntry *image)
+{
+    unsigned long tag;
+    size_t bytes = sizeof(CacheEntry) + image->len + image->key_len;
+    const char *key = image->data + image->len;
+    CacheShard *shard;
+    CacheTable *table;
+    CacheEntry *entry;
+
+    if (image->len > cache->max_object + CACHE_FRAMING_SIZE ||
+        image->key_len > CACHE_KEY_SIZE ||
+        image->len + image->key_len > cache->max_object + CACHE_FRAMING_SIZE
+                                      + CACHE_KEY_ROOM)
+        return NULL;
+    tag = hash_key(key, image->key_len);
+    shard = find_shard(cache, tag);
+    entry = copy_entry(&shard->slabs, tag, image);
 
-        sem_wait(&cache->timestamp_mutex);
-        cache->cache_set[idx].timestamp = ++cache->highest_timestamp;
-        sem_post(&cache->timestamp_mutex);
+    pthread_mutex_lock(&shard->write_mutex);
+    table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    if (find_slot(table, tag, key, image->key_len) < table->nslots) {
+        pthread_mutex_unlock(&shard->write_mutex);
+        if (entry)
+            cache_release(entry);
+        return take_entry(shard, tag, key, image->key_len);
+    }
+
+    while (!entry && shard->count > 0) {
+        make_room(cache, shard, bytes);
+        entry = copy_entry(&shard->slabs, tag, image);
+    }
+    if (!entry)
+        shard->failures++;
+    if (!entry || entry->size > shard->max_size) {
+        pthread_mutex_unlock(&shard->write_mutex);
+        if (entry)
+            cache_release(entry);
+        return NULL;
     }
 
-    sem_wait(&cache->readcnt_mutex);
-    cache->readcnt--;
-    if (cache->readcnt == 0)    /* Last out */
-        sem_post(&cache->write_mutex);
-    sem_post(&cache->readcnt_mutex);
+    /* The reference of the caller first, the policy may drop it at once */
+    insert_entry(cache, shard, cache_retain(entry));
+    pthread_mutex_unlock(&shard->write_mutex);
+    return entry;
+}
+
+/*
+ * cache_fetch - Find the entry cached under key and take a reference to
+ *     it, given back with cache_release. Returns NULL on a miss. A Vary
+ *     entry is not counted, the lookup it leads to is.
+ */
+CacheEntry *
+cache_fetch(Cache *cache, const char *key, size_t key_len)
+{
+    unsigned long tag;
+    CacheShard *shard;
+    CacheEntry *entry;
+
+    tag = hash_key(key, key_len);
+    shard = find_shard(cache, tag);
+    if (cache->policy == CACHE_TINYLFU)
+        sketch_increment(&shard->sketch, tag);
+
+    /* Only the first hit since the policy looked at it writes */
+    if ((entry = take_entry(shard, tag, key, key_len)) &&
+        !atomic_load_explicit(&entry->referenced, memory_order_relaxed))
+        atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+
+    if (entry && entry->vary)
+        return entry;
+    if (entry)
+        atomic_fetch_add_explicit(&my_stripe(cache)->hits, 1,
+                                  memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit(&my_stripe(cache)->misses, 1,
+                                  memory_order_relaxed);
+    return entry;
+}
+
+/*
+ * cache_lookup - cache_fetch for the cache itself rather than a client:
+ *     neither counted nor seen by the policy
+ */
+CacheEntry *
+cache_lookup(Cache *cache, const char *key, size_t key_len)
+{
+    unsigned long tag = hash_key(key, key_len);
+
+    return take_entry(find_shard(cache, tag), tag, key, key_len);
+}
+
+/*
+ * cache_retain - Take another reference to an entry already held
+ */
+CacheEntry *
+cache_retain(CacheEntry *entry)
+{
+    atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+    return entry;
+}
+
+/*
+ * cache_release - Drop a reference, the last one frees the entry
+ */
+void
+cache_release(CacheEntry *entry)
+{
+    if (atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) == 1)
+        slab_free(entry);
+}
 
-    return is_cached;
+/*
+ * cache_revalidated - Count a stale entry checked with its server. One
+ *     that was not modified saves the server sending its body again.
+ */
+void
+cache_revalidated(Cache *cache, const CacheEntry *entry, int not_modified)
+{
+    atomic_fetch_add_explicit(&cache->revalidations, 1, memory_order_relaxed);
+    if (!not_modified)
+        return;
+    atomic_fetch_add_explicit(&cache->not_modified, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cache->saved_bytes,
+                              entry->len - entry->head_len,
+                              memory_order_relaxed);
 }
 
+/*
+ * cache_hash - Hash of a key, the tag its entry is stored with
+ */
+unsigned long
+cache_hash(const char *key, size_t key_len)
+{
+    return hash_key(key, key_len);
+}
+
+/*
+ * cache_walk - Call visit on every entry of the cache, holding off the
+ *     writers of its shard meanwhile
+ */
+void
+cache_walk(Cache *cache, CacheVisit visit, void *arg)
+{
+    CacheShard *shard;
+    CacheTable *table;
+    CacheEntry *entry;
+
+    for (int i = 0; i < cache->nshards; i++) {
+        shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->write_mutex);
+        table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+        for (size_t j = 0; j < table->nslots; j++) {
+            if ((entry = atomic_load_explicit(&table->entries[j],
+                                              memory_order_relaxed)))
+                visit(entry, arg);
+        }
+        pthread_mutex_unlock(&shard->write_mutex);
+    }
+}
+
+/*
+ * cache_counts - Sum the hits and the misses of the cache so far
+ */
+void
+cache_counts(Cache *cache, unsigned long *hits, unsigned long *misses)
+{
+    *hits = *misses = 0;
+    for (int i = 0; i < CACHE_STRIPES; i++) {
+        *hits += atomic_load(&cache->stripes[i].hits);
+        *misses += atomic_load(&cache->stripes[i].misses);
+    }
+}
+
+/*
+ * hash_key - Hash the key eight bytes at a time, mixing each word in
+ *     like MurmurHash3 does and finishing with its 64-bit finalizer
+ */
 static unsigned long
-generate_tag(const char *request_line, const char *request_hdrs)
+hash_key(const char *key, size_t key_len)
 {
-    size_t len = strlen(request_line) + strlen(request_hdrs);
-    unsigned long hash = 5381;
-    char *hash_str;
+    unsigned long hash = key_len * 0x9e3779b97f4a7c15UL, word;
 
-    /* Build the string that will be hashed */
-    hash_str = (char *) malloc(len + 1);
-    hash_str[0] = '\0';
-    strcat(hash_str, request_line);
-    strcat(hash_str, request_hdrs);
-    
-    for (int i = 0; i < len; i++)
-        hash = ((hash << 5) + hash) + hash_str[i]; /* hash * 33 + c */
-    
-    free(hash_str);
-    return hash;
+    for (; key_len >= 8; key += 8, key_len -= 8) {
+        memcpy(&word, key, 8);
+        word *= 0x87c37b91114253d5UL;
+        hash ^= (word << 31 | word >> 33) * 0x4cf5ad432745937fUL;
+        hash = (hash << 27 | hash >> 37) * 5 + 0x52dce729;
+    }
+    word = 0;
+    memcpy(&word, key, key_len);
+    hash ^= word * 0x87c37b91114253d5UL;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53UL;
+    hash ^= hash >> 33;
+
+    /* Tag 0 marks an empty slot */
+    return hash ? hash : 1;
 }
 
-static int
-find_empty_line(Cache *cache)
+/*
+ * find_shard - The low bits of a tag pick its slot, the high ones its shard
+ */
+static CacheShard *
+find_shard(Cache *cache, unsigned long tag)
+{
+    return &cache->shards[(tag >> 32) % cache->nshards];
+}
+
+/*
+ * take_entry - Find the entry of the shard cached under key and take a
+ *     reference to it
+ */
+static CacheEntry *
+take_entry(CacheShard *shard, unsigned long tag, const char *key,
+           size_t key_len)
 {
-    for (int i = 0; i < CACHE_LINES; i++) {
-        if (cache->cache_set[i].valid) 
+    CacheEntry *entry;
+
+    /* The table reference of an entry found in here is not dropped before
+     * ebr_exit, so the entry can still be taken */
+    ebr_enter();
+    entry = find_entry(atomic_load_explicit(&shard->table,
+                                            memory_order_acquire),
+                       tag, key, key_len);
+    if (entry)
+        atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+    ebr_exit();
+    return entry;
+}
+
+/*
+ * find_entry - Probe the table from the home slot of tag up to the first
+ *     empty slot without locking. A writer may be moving entries, so the
+ *     entry of a matching slot is checked again and the probe may miss;
+ *     that only costs a trip to the server. Its key is compared too, so
+ *     a hash collision is a miss rather than the wrong response.
+ */
+static CacheEntry *
+find_entry(CacheTable *table, unsigned long tag, const char *key,
+           size_t key_len)
+{
+    unsigned long slot_tag;
+    size_t mask = table->nslots - 1;
+    CacheEntry *entry;
+
+    for (size_t i = tag & mask;
+         (slot_tag = atomic_load_explicit(&table->tags[i],
+                                          memory_order_acquire));
+         i = (i + 1) & mask) {
+        if (slot_tag != tag)
+            continue;
+        entry = atomic_load_explicit(&table->entries[i], memory_order_acquire);
+        if (entry && entry->tag == tag && has_key(entry, key, key_len))
+            return entry;
+    }
+
+    return NULL;
+}
+
+/*
+ * find_slot - Slot of key for a writer, or nslots if it is not there
+ */
+static size_t
+find_slot(CacheTable *table, unsigned long tag, const char *key,
+          size_t key_len)
+{
+    unsigned long slot_tag;
+    size_t mask = table->nslots - 1;
+
+    for (size_t i = tag & mask;
+         (slot_tag = atomic_load_explicit(&table->tags[i],
+                                          memory_order_relaxed));
+         i = (i + 1) & mask) {
+        if (slot_tag == tag &&
+            has_key(atomic_load_explicit(&table->entries[i],
+                                         memory_order_relaxed),
+                    key, key_len))
             return i;
     }
 
-    return -1;
+    return table->nslots;
 }
 
 static int
-find_victim(Cache *cache)
+has_key(const CacheEntry *entry, const char *key, size_t key_len)
+{
+    return entry->key_len == key_len &&
+           !memcmp(entry->data + entry->len, key, key_len);
+}
+
+static CacheTable *
+new_table(size_t nslots)
+{
+    CacheTable *table = malloc(sizeof(CacheTable));
+
+    table->nslots = nslots;
+    table->tags = calloc(nslots, sizeof(*table->tags));
+    table->entries = calloc(nslots, sizeof(*table->entries));
+    return table;
+}
+
+/*
+ * insert_slot - Store the entry in its table. A table more than 3/4 full
+ *     is replaced with a twice larger one, published once it is complete.
+ */
+static void
+insert_slot(CacheShard *shard, CacheEntry *entry)
+{
+    CacheTable *table, *old;
+    CacheEntry *moved;
+
+    table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    if (4 * (shard->count + 1) > 3 * table->nslots) {
+        old = table;
+        table = new_table(2 * old->nslots);
+        for (size_t i = 0; i < old->nslots; i++) {
+            if ((moved = atomic_load_explicit(&old->entries[i],
+                                              memory_order_relaxed)))
+                place_entry(table, moved);
+        }
+        atomic_store_explicit(&shard->table, table, memory_order_release);
+        shard->hand = 0;
+        ebr_retire(old, destruct_table);
+    }
+
+    place_entry(table, entry);
+}
+
+/*
+ * place_entry - Store the entry in the first empty slot from its home
+ *     slot. The entry goes first, so a reader that sees the tag finds it.
+ */
+static void
+place_entry(CacheTable *table, CacheEntry *entry)
+{
+    size_t i, mask = table->nslots - 1;
+
+    for (i = entry->tag & mask;
+         atomic_load_explicit(&table->tags[i], memory_order_relaxed);
+         i = (i + 1) & mask)
+        ;
+    atomic_store_explicit(&table->entries[i], entry, memory_order_release);
+    atomic_store_explicit(&table->tags[i], entry->tag, memory_order_release);
+}
+
+/*
+ * remove_slot - Empty a slot, then shift back the following slots of the
+ *     probe run that could not live in it, so no tombstone is needed.
+ *     Readers probing meanwhile may miss an entry but never get a wrong
+ *     one, since they check the tag of the entry they find.
+ */
+static void
+remove_slot(CacheTable *table, size_t slot)
+{
+    unsigned long tag;
+    size_t j, home, mask = table->nslots - 1;
+
+    for (j = (slot + 1) & mask;
+         (tag = atomic_load_explicit(&table->tags[j], memory_order_relaxed));
+         j = (j + 1) & mask) {
+        home = tag & mask;
+        /* Entry j stays if its home is cyclically in (slot, j] */
+        if (slot <= j ? (slot < home && home <= j)
+                      : (slot < home || home <= j))
+            continue;
+        atomic_store_explicit(&table->entries[slot],
+                              atomic_load_explicit(&table->entries[j],
+                                                   memory_order_relaxed),
+                              memory_order_release);
+        atomic_store_explicit(&table->tags[slot], tag, memory_order_release);
+        slot = j;
+    }
+    atomic_store_explicit(&table->tags[slot], 0, memory_order_release);
+    atomic_store_explicit(&table->entries[slot], NULL, memory_order_release);
+}
+
+/*
+ * clock_victim - Sweep the clock hand over the table slots, giving every
+ *     entry hit since the last sweep another round, and take out the
+ *     first one that was not. The shard must not be empty.
+ */
+static CacheEntry *
+clock_victim(CacheShard *shard)
 {
-    int idx, least_recent_used;
+    size_t mask;
+    CacheTable *table;
+    CacheEntry *entry;
 
-    idx = 0;
-    least_recent_used = cache->cache_set[0].timestamp;
-    for (int i = 1; i < CACHE_LINES; i++) {
-        if (cache->cache_set[i].timestamp < least_recent_used) {
-            idx = i;
-            least_recent_used = cache->cache_set[i].timestamp;
+    table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    mask = table->nslots - 1;
+    while (1) {
+        entry = atomic_load_explicit(&table->entries[shard->hand],
+                                     memory_order_relaxed);
+        if (entry && !atomic_exchange_explicit(&entry->referenced, 0,
+                                               memory_order_relaxed)) {
+            /* The next entry of the run may shift into the hand's slot */
+            remove_slot(table, shard->hand);
+            return entry;
         }
+        shard->hand = (shard->hand + 1) & mask;
     }
+}
+
+/*
+ * new_entry - Serialize a response into a single slab chunk with its
+ *     framing, then its key, holding the reference of the table. The
+ *     entry is charged the whole chunk. A Vary entry only holds content.
+ *     Returns NULL if the slabs have no room for the bytes it needs.
+ */
+static CacheEntry *
+new_entry(SlabPool *slabs, size_t *bytes, unsigned long tag,
+          const char *key, size_t key_len, const char *response_line,
+          const char *response_hdrs, const struct iovec *content,
+          int content_cnt, size_t content_len, time_t date, time_t expires,
+          time_t stale_until, int vary)
+{
+    int status = 0;
+    char length_hdr[64];
+    size_t line_len, hdrs_len, length_len, keep_alive_len, len, off;
+    CacheEntry *entry;
+
+    /* These responses never have a body, nor a length */
+    sscanf(response_line, "HTTP/%*d.%*d %d", &status);
+    if (vary || status / 100 == 1 || status == 204 || status == 304)
+        length_hdr[0] = '\0';
+    else
+        sprintf(length_hdr, "Content-Length: %zu\r\n", content_len);
+
+    line_len = strlen(response_line);
+    hdrs_len = strlen(response_hdrs);
+    length_len = strlen(length_hdr);
+    keep_alive_len = vary ? 0 : strlen(keep_alive_hdr);
+
+    len = line_len + hdrs_len + length_len + keep_alive_len + content_len;
+    *bytes = sizeof(CacheEntry) + len + key_len;
+    if (!(entry = slab_alloc(slabs, *bytes)))
+        return NULL;
+    entry->tag = tag;
+    entry->key_len = key_len;
+    entry->vary = vary;
+    entry->prev = entry->next = NULL;
+    entry->segment = CACHE_WINDOW;
+    atomic_init(&entry->referenced, 0);
+    atomic_init(&entry->refs, 1);
+    entry->conn_off = line_len + hdrs_len + length_len;
+    entry->head_len = entry->conn_off + keep_alive_len;
+    entry->len = len;
+    entry->date = date;
+    entry->expires = expires;
+    entry->stale_until = stale_until;
+    atomic_init(&entry->ahead_hits, 0);
+    entry->size = slab_chunk_size(slabs, *bytes);
+
+    memcpy(entry->data, response_line, line_len);
+    memcpy(entry->data + line_len, response_hdrs, hdrs_len);
+    memcpy(entry->data + line_len + hdrs_len, length_hdr, length_len);
+    memcpy(entry->data + entry->conn_off, keep_alive_hdr, keep_alive_len);
+    off = entry->head_len;
+    for (int i = 0; i < content_cnt; i++) {
+        memcpy(entry->data + off, content[i].iov_base, content[i].iov_len);
+        off += content[i].iov_len;
+    }
+    memcpy(entry->data + len, key, key_len);
+    return entry;
+}
+
+/*
+ * copy_entry - Copy an entry image into a new slab chunk, holding the
+ *     reference of the table. Returns NULL if the slabs have no room.
+ */
+static CacheEntry *
+copy_entry(SlabPool *slabs, unsigned long tag, const CacheEntry *image)
+{
+    size_t bytes = sizeof(CacheEntry) + image->len + image->key_len;
+    CacheEntry *entry;
+
+    if (!(entry = slab_alloc(slabs, bytes)))
+        return NULL;
+    memcpy(entry, image, bytes);
+    entry->tag = tag;
+    entry->prev = entry->next = NULL;
+    entry->segment = CACHE_WINDOW;
+    atomic_init(&entry->referenced, 0);
+    atomic_init(&entry->refs, 1);
+    atomic_init(&entry->ahead_hits, 0);
+    entry->size = slab_chunk_size(slabs, bytes);
+    return entry;
+}
+
+/*
+ * evict_entry - Evict the next victim of the policy. The shard must not
+ *     be empty.
+ */
+static void
+evict_entry(Cache *cache, CacheShard *shard)
+{
+    CacheEntry *victim;
+
+    shard->evictions++;
+    if (cache->policy == CACHE_TINYLFU) {
+        if (!(victim = main_victim(shard)))
+            victim = shard->segments[CACHE_WINDOW].head;
+        discard_entry(shard, victim);
+        return;
+    }
+
+    victim = clock_victim(shard);
+    shard->count--;
+    shard->size -= victim->size;
+    disk_demote(victim);
+    ebr_retire(victim, unref_entry);
+}
 
-    return idx;
+/*
+ * make_room - Free memory for a bytes allocation in the slabs of a shard:
+ *     evict an entry of the class it takes a chunk of, or else the next
+ *     victim of the policy, until a whole slab of another class is freed.
+ *     The shard must not be empty.
+ */
+static void
+make_room(Cache *cache, CacheShard *shard, size_t bytes)
+{
+    if (!evict_class(cache, shard, slab_chunk_size(&shard->slabs, bytes)))
+        evict_entry(cache, shard);
+
+    /* The evicted entry is freed once the epoch moved twice */
+    ebr_reclaim();
+    ebr_reclaim();
 }
 
+/*
+ * evict_class - Evict the entry of chunk bytes the policy would
+ *     evict first: the oldest in probation, the window, then protected, or
+ *     the first from the CLOCK hand on, one not referenced if there is.
+ *     Returns 0 if the shard holds none.
+ */
 static int
-find_line(Cache *cache, unsigned int tag)
+evict_class(Cache *cache, CacheShard *shard, size_t chunk)
 {
-    for (int i = 0; i < CACHE_LINES; i++) {
-        if (cache->cache_set[i].valid && cache->cache_set[i].tag == tag)
-            return i;
+    static const int order[] = { CACHE_PROBATION, CACHE_WINDOW,
+                                 CACHE_PROTECTED };
+    size_t mask, slot, found;
+    CacheTable *table;
+    CacheEntry *entry;
+
+    if (cache->policy == CACHE_TINYLFU) {
+        for (int i = 0; i < 3; i++) {
+            for (entry = shard->segments[order[i]].head; entry;
+                 entry = entry->next) {
+                if (entry->size == chunk) {
+                    shard->evictions++;
+                    discard_entry(shard, entry);
+                    return 1;
+                }
+            }
+        }
+        return 0;
+    }
+
+    table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    mask = table->nslots - 1;
+    found = table->nslots;
+    for (size_t i = 0; i < table->nslots; i++) {
+        slot = (shard->hand + i) & mask;
+        entry = atomic_load_explicit(&table->entries[slot],
+                                     memory_order_relaxed);
+        if (!entry || entry->size != chunk)
+            continue;
+        if (found == table->nslots)
+            found = slot;
+        if (!atomic_load_explicit(&entry->referenced, memory_order_relaxed)) {
+            found = slot;
+            break;
+        }
+    }
+    if (found == table->nslots)
+        return 0;
+
+    entry = atomic_load_explicit(&table->entries[found], memory_order_relaxed);
+    remove_slot(table, found);
+    shard->evictions++;
+    shard->count--;
+    shard->size -= entry->size;
+    disk_demote(entry);
+    ebr_retire(entry, unref_entry);
+    return 1;
+}
+
+/*
+ * discard_entry - Take an entry of a TinyLFU shard out of its segment and
+ *     its table, handing it to the disk tier
+ */
+static void
+discard_entry(CacheShard *shard, CacheEntry *entry)
+{
+    CacheTable *table;
+
+    table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    remove_slot(table, find_slot(table, entry->tag, entry->data + entry->len,
+                                 entry->key_len));
+    unlink_entry(shard, entry);
+    shard->count--;
+    shard->size -= entry->size;
+    disk_demote(entry);
+    ebr_retire(entry, unref_entry);
+}
+
+/*
+ * admit_window - Move the oldest entries of a window over its share to
+ *     the probation segment. Once the main segments are full, the
+ *     candidate has to be requested more often lately than their victim
+ *     to take its place, or it is dropped instead. One-time requests,
+ *     like those of a crawler, thus never flush the main segments.
+ */
+static void
+admit_window(CacheShard *shard)
+{
+    size_t main_max;
+    CacheSegment *window, *probation, *protected;
+    CacheEntry *candidate, *victim;
+
+    window = &shard->segments[CACHE_WINDOW];
+    probation = &shard->segments[CACHE_PROBATION];
+    protected = &shard->segments[CACHE_PROTECTED];
+    main_max = probation->max_size;
+
+    while (window->size > window->max_size) {
+        candidate = window->head;
+        unlink_entry(shard, candidate);
+
+        while (candidate &&
+               probation->size + protected->size + candidate->size > main_max) {
+            victim = main_victim(shard);
+            if (victim && sketch_estimate(&shard->sketch, victim->tag)
+                          < sketch_estimate(&shard->sketch, candidate->tag)) {
+                discard_entry(shard, victim);
+                shard->evictions++;
+            } else {
+                /* Not linked, discard_entry leaves the segments alone */
+                discard_entry(shard, candidate);
+                shard->rejections++;
+                candidate = NULL;
+            }
+        }
+        if (candidate)
+            link_entry(shard, candidate, CACHE_PROBATION);
+    }
+}
+
+/*
+ * main_victim - The oldest probation entry not hit since it got there.
+ *     Hit ones are promoted to the protected segment, whose oldest
+ *     entries get another round there if they were hit too, or are
+ *     demoted back to probation. Readers keep setting the flags, so the
+ *     rounds are bounded. Returns NULL if the main segments are empty.
+ */
+static CacheEntry *
+main_victim(CacheShard *shard)
+{
+    CacheSegment *probation, *protected;
+    CacheEntry *entry;
+
+    probation = &shard->segments[CACHE_PROBATION];
+    protected = &shard->segments[CACHE_PROTECTED];
+
+    for (size_t round = 0; round <= 2 * shard->count; round++) {
+        if (protected->size > protected->max_size || !probation->head) {
+            if (!(entry = protected->head))
+                return NULL;
+            if (atomic_exchange_explicit(&entry->referenced, 0,
+                                         memory_order_relaxed))
+                link_entry(shard, entry, CACHE_PROTECTED);
+            else
+                link_entry(shard, entry, CACHE_PROBATION);
+            continue;
+        }
+
+        entry = probation->head;
+        if (!atomic_exchange_explicit(&entry->referenced, 0,
+                                      memory_order_relaxed))
+            return entry;
+        link_entry(shard, entry, CACHE_PROTECTED);
     }
 
-    return -1;
+    return probation->head ? probation->head : protected->head;
+}
+
+/*
+ * link_entry - Append an entry to a segment, taking it out of the one it
+ *     is in first
+ */
+static void
+link_entry(CacheShard *shard, CacheEntry *entry, int segment)
+{
+    CacheSegment *seg = &shard->segments[segment];
+
+    unlink_entry(shard, entry);
+    entry->segment = segment;
+    entry->prev = seg->tail;
+    entry->next = NULL;
+    if (seg->tail)
+        seg->tail->next = entry;
+    else
+        seg->head = entry;
+    seg->tail = entry;
+    seg->size += entry->size;
 }
 
+/*
+ * unlink_entry - Take an entry out of its segment, if it is in one
+ */
 static void
-destruct_line(Cache *cache, int idx)
+unlink_entry(CacheShard *shard, CacheEntry *entry)
 {
-    free(cache->cache_set[idx].response_line);
-    free(cache->cache_set[idx].response_hdrs);
-    free(cache->cache_set[idx].content);
+    CacheSegment *seg = &shard->segments[entry->segment];
+
+    if (!entry->prev && seg->head != entry)
+        return;
+
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        seg->head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        seg->tail = entry->prev;
+    entry->prev = entry->next = NULL;
+    seg->size -= entry->size;
+}
+
+/*
+ * my_stripe - Hit counters of the calling thread, so threads do not all
+ *     write the same cache line on every lookup
+ */
+static CacheStripe *
+my_stripe(Cache *cache)
+{
+    if (stripe < 0)
+        stripe = atomic_fetch_add(&next_stripe, 1) % CACHE_STRIPES;
+    return &cache->stripes[stripe];
+}
+
+/*
+ * unref_entry - Drop the reference of the table once no reader can find
+ *     the entry anymore
+ */
+static void
+unref_entry(void *entry)
+{
+    cache_release(entry);
+}
+
+static void
+destruct_table(void *table)
+{
+    free(((CacheTable *) table)->tags);
+    free(((CacheTable *) table)->entries);
+    free(table);
+}
+
+static void
+cache_report(FILE *out, void *arg)
+{
+    Cache *cache = arg;
+    CacheShard *shard;
+    size_t count = 0, size = 0;
+    unsigned long hits, misses, evictions = 0, rejections = 0, failures = 0;
+
+    for (int i = 0; i < cache->nshards; i++) {
+        shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->write_mutex);
+        count += shard->count;
+        size += shard->size;
+        evictions += shard->evictions;
+        rejections += shard->rejections;
+        failures += shard->failures;
+        pthread_mutex_unlock(&shard->write_mutex);
+    }
+    cache_counts(cache, &hits, &misses);
+
+    fprintf(out, " policy=%s shards=%d entries=%zu bytes=%zu max_bytes=%zu "
+            "hits=%lu misses=%lu hit_ratio=%.1f%% evictions=%lu rejected=%lu "
+            "failures=%lu revalidated=%lu not_modified=%lu saved_bytes=%lu",
+            policy_names[cache->policy], cache->nshards, count, size,
+            cache->max_size, hits, misses,
+            hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+            evictions, rejections, failures,
+            atomic_load(&cache->revalidations),
+            atomic_load(&cache->not_modified),
+            atomic_load(&cache->saved_bytes));
 }
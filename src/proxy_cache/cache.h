@@ -1,43 +1,158 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 
-#include <semaphore.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "../proxy_sketch/sketch.h"
+#include "../proxy_slab/slab.h"
 
 /* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE  1049000     /* 1MB total cache size */
-#define MAX_OBJECT_SIZE 102400      /* 1KB cache object size */
-#define CACHE_LINES (MAX_CACHE_SIZE / MAX_OBJECT_SIZE)
-
-typedef struct cache_line {
-    char *response_line, *response_hdrs;
-    void *content;
-    size_t content_len;
-    unsigned long long timestamp;
-    unsigned int tag;
-    unsigned char valid;
-} CacheLine;
+#define MAX_CACHE_SIZE  1049000     /* 1MB default total cache size */
+#define MAX_OBJECT_SIZE 102400      /* 100KB cache object size */
+#define CACHE_MIN_SLOTS 64          /* Initial size of a shard hash table */
+#define CACHE_SHARDS    16          /* Most shards a cache is split into */
+#define CACHE_STRIPES   32          /* Hit counters, spread over threads */
+#define CACHE_ALIGN     64          /* Cache line size */
+#define CACHE_FRAMING_SIZE 128      /* Room for the headers an entry adds */
+#define CACHE_KEY_SIZE  32768       /* Longest key, extended by Vary */
+#define CACHE_KEY_ROOM  1024        /* Key bytes beyond the largest object */
+#define CACHE_SLAB_SLACK_PCT 10     /* Slab bytes the policy leaves free */
+#define CACHE_WINDOW_PCT   1        /* TinyLFU admission window, % of shard */
+#define CACHE_PROTECTED_PCT 80      /* TinyLFU protected segment, % of main */
+#define CACHE_SKETCH_OBJECT 1024    /* Object size the sketch is sized for */
+#define CACHE_DEFAULT_TTL  60       /* Lifetime of a response without hints */
+#define CACHE_HEURISTIC_PCT 10      /* Lifetime, % of the Last-Modified age */
+#define CACHE_HEURISTIC_MAX 86400   /* Longest lifetime from Last-Modified */
+
+enum cache_policy {
+    CACHE_CLOCK,        /* CLOCK over the table slots, an approximate LRU */
+    CACHE_TINYLFU       /* Window, then frequency filtered segmented LRU */
+};
+
+/* TinyLFU segments of a shard */
+enum {
+    CACHE_WINDOW,
+    CACHE_PROBATION,
+    CACHE_PROTECTED,
+    CACHE_NSEGMENTS
+};
+
+/*
+ * An entry never changes once it is in a table. It holds the response as
+ * sent to a client that keeps its connection: the head, ending with a
+ * "Connection: keep-alive" line at conn_off, then the body, then its key.
+ * Readers take a reference and send it from here; the table holds one
+ * reference too. A Vary entry holds the names of the Vary header instead.
+ * A response is fresh until expires, then it may still be sent while it is
+ * refreshed until stale_until. Its age is counted from date.
+ */
+typedef struct cache_entry {
+    unsigned long tag;              /* Hash of the key */
+    size_t key_len;
+    int vary;
+    size_t size;                    /* Bytes charged to the shard */
+    atomic_uchar referenced;        /* Hit since the policy last looked */
+    atomic_uint refs;
+    size_t conn_off, head_len, len;
+    time_t date, expires, stale_until;
+    atomic_uint ahead_hits;         /* Hits shortly before it expires */
+    struct cache_entry *prev, *next; /* TinyLFU segment, writers only */
+    int segment;
+    char data[];
+} CacheEntry;
+
+/*
+ * Open addressing table with linear probing: tags[i] is the hash of the
+ * key in slot i (0 if empty) and entries[i] the entry it stores. Readers
+ * probe it without locks, so a table is replaced rather than resized.
+ */
+typedef struct cache_table {
+    size_t nslots;
+    atomic_ulong *tags;
+    _Atomic(CacheEntry *) *entries;
+} CacheTable;
+
+/* Entries oldest first, hits only set their referenced flag */
+typedef struct cache_segment {
+    CacheEntry *head, *tail;
+    size_t size, max_size;
+} CacheSegment;
+
+typedef struct cache_shard {
+    _Atomic(CacheTable *) table;
+    pthread_mutex_t write_mutex;    /* Serializes the writers */
+    size_t count, size, max_size;
+    size_t hand;                    /* CLOCK hand over the table slots */
+    CacheSegment segments[CACHE_NSEGMENTS];
+    Sketch sketch;                  /* Request frequencies for TinyLFU */
+    SlabPool slabs;                 /* Chunks of the entries */
+    unsigned long evictions, rejections;
+    unsigned long failures;         /* Writes dropped, the slabs full */
+} __attribute__((aligned(CACHE_ALIGN))) CacheShard;
+
+typedef struct cache_stripe {
+    atomic_ulong hits, misses;
+} __attribute__((aligned(CACHE_ALIGN))) CacheStripe;
+
+typedef void (*CacheVisit)(const CacheEntry *entry, void *arg);
 
 typedef struct cache {
-    CacheLine cache_set[CACHE_LINES];
-    sem_t write_mutex, readcnt_mutex, timestamp_mutex;
-    unsigned long long highest_timestamp;
-    unsigned long long readcnt;
+    CacheShard shards[CACHE_SHARDS];
+    int nshards;
+    size_t max_size, max_object;
+    enum cache_policy policy;
+    time_t default_ttl;             /* Lifetime if the response gives none */
+    time_t stale_window;            /* Time a stale response may be sent */
+    CacheStripe stripes[CACHE_STRIPES];
+    atomic_ulong revalidations, not_modified, saved_bytes;
 } Cache;
 
 void
-cache_init(Cache *cache);
+cache_init(Cache *cache, size_t max_size, size_t max_object,
+           enum cache_policy policy, time_t default_ttl,
+           time_t stale_window);
+
+void
+cache_write(Cache *cache, const char *key, size_t key_len,
+            const char *response_line, const char *response_hdrs,
+            const struct iovec *content, int content_cnt,
+            time_t date, time_t expires, time_t stale_until);
+
+void
+cache_write_vary(Cache *cache, const char *key, size_t key_len,
+                 const char *vary);
+
+CacheEntry *
+cache_fetch(Cache *cache, const char *key, size_t key_len);
+
+CacheEntry *
+cache_lookup(Cache *cache, const char *key, size_t key_len);
+
+CacheEntry *
+cache_restore(Cache *cache, const CacheEntry *image);
+
+CacheEntry *
+cache_retain(CacheEntry *entry);
+
+void
+cache_release(CacheEntry *entry);
+
+void
+cache_revalidated(Cache *cache, const CacheEntry *entry, int not_modified);
+
+unsigned long
+cache_hash(const char *key, size_t key_len);
+
+void
+cache_walk(Cache *cache, CacheVisit visit, void *arg);
 
 void
-cache_write(Cache *cache, const char *request_line, const char *request_hdrs,
-            const char *response_line, const char *response_hdrs, 
-            const void *content, const size_t content_len);
-
-int
-cache_fetch(Cache *cache, const char *request_line, const char *request_hdrs,
-            char **response_line, char **response_hdrs,
-            void **content, size_t *content_len);
+cache_counts(Cache *cache, unsigned long *hits, unsigned long *misses);
 
 #endif
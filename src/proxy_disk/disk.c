@@ -0,0 +1,555 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "../proxy_stats/stats.h"
+
+#define DISK_MAGIC 0x70787931       /* Starts every record */
+
+/* In front of every record, the entry follows as it was in the cache */
+typedef struct disk_header {
+    uint32_t dh_magic;
+    uint32_t dh_size;               /* Bytes of the entry, data and key */
+    unsigned long dh_tag;
+} DiskHeader;
+
+/* Where a saved entry is in the file */
+typedef struct disk_record {
+    unsigned long dr_tag;           /* 0 once out of the index */
+    size_t dr_off, dr_size;
+    time_t dr_date;                 /* Tell the saved entry from newer ones */
+    size_t dr_len;
+    struct disk_record *dr_next;    /* Next of its index bucket */
+    struct disk_record *dr_seg_next; /* Next of its segment */
+} DiskRecord;
+
+typedef struct disk_segment {
+    DiskRecord *ds_records;
+    atomic_int ds_readers;          /* Copying an entry out of it */
+} DiskSegment;
+
+/* A promotion for a client that does not wait for the disk itself */
+typedef struct disk_job {
+    char *dj_key;
+    size_t dj_key_len;
+    Flight *dj_flight;              /* Landed once it is done */
+    struct disk_job *dj_next;
+} DiskJob;
+
+static void *
+disk_thread(void *vargp);
+
+static void
+save_entry(CacheEntry *entry);
+
+static void
+next_segment(void);
+
+static DiskRecord *
+find_record(unsigned long tag);
+
+static void
+drop_record(DiskRecord *record);
+
+static CacheEntry *
+promote(size_t off, unsigned long tag, const char *key, size_t key_len);
+
+static int
+is_resident(size_t off, size_t size);
+
+static void
+disk_report(FILE *out, void *arg);
+
+static Cache *cache;
+static const char *disk_path;
+static int disk_fd = -1;
+static char *disk_map;              /* NULL without a disk tier */
+static size_t disk_size, segment_size, nsegments, nbuckets, page_size;
+
+/* The index, and the segment and offset the next record goes to */
+static DiskSegment *segments;
+static DiskRecord **buckets;
+static size_t nrecords, write_segment, write_off;
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t save_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int detached;
+
+/* Evicted entries waiting to be saved, and promotions to make first */
+static CacheEntry *demoting[DISK_QUEUE];
+static size_t demote_head, ndemoting;
+static DiskJob *jobs_head, *jobs_tail;
+static size_t njobs;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static __thread int nonblocking;
+
+static atomic_ulong demoted, dropped, saved, saved_bytes, unchanged, promoted,
+                    misses, cold, prefetched, recycled, overwritten, errors;
+
+/*
+ * disk_init - Preallocate the file at path, size bytes rounded down to
+ *     whole segments, map it and start the thread writing to it. Whatever
+ *     the file held is dropped. Returns -1 on error.
+ */
+int
+disk_init(Cache *proxy_cache, const char *path, size_t size)
+{
+    int rc;
+    size_t record_max;
+    pthread_t tid;
+
+    /* A segment holds the largest record the cache may evict */
+    record_max = sizeof(DiskHeader) + sizeof(CacheEntry)
+                 + proxy_cache->max_object + CACHE_FRAMING_SIZE
+                 + CACHE_KEY_SIZE;
+    segment_size = DISK_SEGMENT_SIZE;
+    while (segment_size < record_max)
+        segment_size *= 2;
+    nsegments = (size ? size : DISK_DEFAULT_SIZE) / segment_size;
+    if (nsegments < 2) {
+        fprintf(stderr, "Disk cache %s: needs at least %zu bytes\n", path,
+                2 * segment_size);
+        return -1;
+    }
+    disk_size = nsegments * segment_size;
+
+    if ((disk_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        perror(path);
+        return -1;
+    }
+    /* The blocks are taken now, so a full disk fails here and not on a
+     * write of the log */
+    rc = ftruncate(disk_fd, disk_size) < 0 ? errno
+                                            : posix_fallocate(disk_fd, 0,
+                                                              disk_size);
+    if (rc) {
+        fprintf(stderr, "Disk cache %s: %s\n", path, strerror(rc));
+        close(disk_fd);
+        return -1;
+    }
+    disk_map = mmap(NULL, disk_size, PROT_READ, MAP_SHARED, disk_fd, 0);
+    if (disk_map == MAP_FAILED) {
+        perror("mmap");
+        disk_map = NULL;
+        close(disk_fd);
+        return -1;
+    }
+
+    for (nbuckets = 1; nbuckets < disk_size / DISK_BUCKET_BYTES;
+         nbuckets *= 2)
+        ;
+    buckets = calloc(nbuckets, sizeof(*buckets));
+    segments = calloc(nsegments, sizeof(*segments));
+    for (size_t i = 0; i < nsegments; i++)
+        atomic_init(&segments[i].ds_readers, 0);
+
+    cache = proxy_cache;
+    disk_path = path;
+    page_size = sysconf(_SC_PAGESIZE);
+    pthread_create(&tid, NULL, disk_thread, NULL);
+    stats_register("disk", disk_report, NULL);
+    return 0;
+}
+
+/*
+ * disk_demote - Queue an entry the cache evicts to be saved. Called with
+ *     the write mutex of its shard held, so it never waits for the disk:
+ *     the entry is dropped if the queue is full.
+ */
+void
+disk_demote(CacheEntry *entry)
+{
+    if (!disk_map)
+        return;
+
+    pthread_mutex_lock(&queue_mutex);
+    if (ndemoting == DISK_QUEUE) {
+        pthread_mutex_unlock(&queue_mutex);
+        dropped++;
+        return;
+    }
+    demoting[(demote_head + ndemoting++) % DISK_QUEUE] = cache_retain(entry);
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    demoted++;
+}
+
+/*
+ * disk_fetch - Promote the entry saved under key back to the cache and
+ *     take a reference to it. Returns NULL if the disk does not have it,
+ *     or if the calling thread is nonblocking and reading it would have
+ *     to wait for the disk.
+ */
+CacheEntry *
+disk_fetch(const char *key, size_t key_len)
+{
+    unsigned long tag;
+    size_t off, size;
+    DiskRecord *record;
+    DiskSegment *seg;
+    CacheEntry *entry = NULL;
+
+    if (!disk_map)
+        return NULL;
+
+    tag = cache_hash(key, key_len);
+    pthread_mutex_lock(&index_mutex);
+    if (!(record = find_record(tag))) {
+        pthread_mutex_unlock(&index_mutex);
+        misses++;
+        return NULL;
+    }
+    off = record->dr_off;
+    size = record->dr_size;
+    /* The writer does not reuse a segment while it is read */
+    seg = &segments[off / segment_size];
+    atomic_fetch_add(&seg->ds_readers, 1);
+    pthread_mutex_unlock(&index_mutex);
+
+    /* Once detached, the file may be the next generation's already */
+    if (atomic_load(&detached))
+        entry = NULL;
+    else if (nonblocking && !is_resident(off, size))
+        cold++;
+    else if ((entry = promote(off, tag, key, key_len)))
+        promoted++;
+    atomic_fetch_sub(&seg->ds_readers, 1);
+    return entry;
+}
+
+/*
+ * disk_prefetch - Have the disk thread promote the entry saved under key,
+ *     for a client that can not wait for the disk. flight is landed once
+ *     it is done, the reference of its leader goes with it. Returns -1 if
+ *     the disk does not have the entry, or has too many promotions queued.
+ */
+int
+disk_prefetch(const char *key, size_t key_len, Flight *flight)
+{
+    int found;
+    DiskJob *job;
+
+    if (!disk_map)
+        return -1;
+
+    pthread_mutex_lock(&index_mutex);
+    found = find_record(cache_hash(key, key_len)) != NULL;
+    pthread_mutex_unlock(&index_mutex);
+    if (!found)
+        return -1;
+
+    pthread_mutex_lock(&queue_mutex);
+    if (njobs == DISK_QUEUE) {
+        pthread_mutex_unlock(&queue_mutex);
+        return -1;
+    }
+    job = malloc(sizeof(DiskJob));
+    job->dj_key = malloc(key_len + 1);
+    memcpy(job->dj_key, key, key_len);
+    job->dj_key[key_len] = '\0';
+    job->dj_key_len = key_len;
+    job->dj_flight = flight;
+    job->dj_next = NULL;
+    if (jobs_tail)
+        jobs_tail->dj_next = job;
+    else
+        jobs_head = job;
+    jobs_tail = job;
+    njobs++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    prefetched++;
+    return 0;
+}
+
+/*
+ * disk_nonblocking - Never let disk_fetch wait for the disk on the calling
+ *     thread, like an event loop
+ */
+void
+disk_nonblocking(void)
+{
+    nonblocking = 1;
+}
+
+/*
+ * disk_detach - Stop using the file, so the next generation of the proxy
+ *     can take it over. Returns once the write and the copies under way
+ *     are done, nothing is saved or promoted afterwards.
+ */
+void
+disk_detach(void)
+{
+    if (!disk_map)
+        return;
+
+    atomic_store(&detached, 1);
+    pthread_mutex_lock(&save_mutex);
+    pthread_mutex_unlock(&save_mutex);
+    for (size_t i = 0; i < nsegments; i++) {
+        while (atomic_load(&segments[i].ds_readers))
+            sched_yield();
+    }
+}
+
+/*
+ * disk_thread - Save the evicted entries, making the promotions clients
+ *     wait for first
+ */
+static void *
+disk_thread(void *vargp)
+{
+    DiskJob *job;
+    CacheEntry *entry;
+
+    pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&queue_mutex);
+        while (!jobs_head && !ndemoting)
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+
+        if ((job = jobs_head)) {
+            if (!(jobs_head = job->dj_next))
+                jobs_tail = NULL;
+            njobs--;
+            pthread_mutex_unlock(&queue_mutex);
+
+            if ((entry = disk_fetch(job->dj_key, job->dj_key_len)))
+                cache_release(entry);
+            flight_land(job->dj_flight);
+            free(job->dj_key);
+            free(job);
+            continue;
+        }
+
+        entry = demoting[demote_head];
+        demote_head = (demote_head + 1) % DISK_QUEUE;
+        ndemoting--;
+        pthread_mutex_unlock(&queue_mutex);
+
+        save_entry(entry);
+        cache_release(entry);
+    }
+    return NULL;
+}
+
+/*
+ * save_entry - Append the entry to the log as it is in the cache, with
+ *     its data and key, and index it. An entry that was promoted and is
+ *     evicted again unchanged is still in the log.
+ */
+static void
+save_entry(CacheEntry *entry)
+{
+    size_t bytes, size;
+    DiskHeader hdr;
+    DiskRecord *record;
+    struct iovec iov[2];
+
+    pthread_mutex_lock(&save_mutex);
+    if (atomic_load(&detached)) {
+        pthread_mutex_unlock(&save_mutex);
+        return;
+    }
+
+    pthread_mutex_lock(&index_mutex);
+    record = find_record(entry->tag);
+    if (record && record->dr_date == entry->date &&
+        record->dr_len == entry->len) {
+        pthread_mutex_unlock(&index_mutex);
+        pthread_mutex_unlock(&save_mutex);
+        unchanged++;
+        return;
+    }
+    pthread_mutex_unlock(&index_mutex);
+
+    bytes = sizeof(CacheEntry) + entry->len + entry->key_len;
+    size = (sizeof(hdr) + bytes + DISK_ALIGN - 1) & ~(DISK_ALIGN - 1);
+    if (write_off + size > segment_size)
+        next_segment();
+
+    hdr.dh_magic = DISK_MAGIC;
+    hdr.dh_size = bytes;
+    hdr.dh_tag = entry->tag;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = entry;
+    iov[1].iov_len = bytes;
+    if (pwritev(disk_fd, iov, 2, write_segment * segment_size + write_off)
+        != sizeof(hdr) + bytes) {
+        pthread_mutex_unlock(&save_mutex);
+        errors++;
+        return;
+    }
+
+    record = malloc(sizeof(DiskRecord));
+    record->dr_tag = entry->tag;
+    record->dr_off = write_segment * segment_size + write_off;
+    record->dr_size = sizeof(hdr) + bytes;
+    record->dr_date = entry->date;
+    record->dr_len = entry->len;
+
+    /* Readers find the record once it is written, an older one of the
+     * same key is not found anymore */
+    pthread_mutex_lock(&index_mutex);
+    drop_record(find_record(entry->tag));
+    record->dr_next = buckets[entry->tag & (nbuckets - 1)];
+    buckets[entry->tag & (nbuckets - 1)] = record;
+    record->dr_seg_next = segments[write_segment].ds_records;
+    segments[write_segment].ds_records = record;
+    nrecords++;
+    pthread_mutex_unlock(&index_mutex);
+
+    write_off += size;
+    pthread_mutex_unlock(&save_mutex);
+    saved++;
+    saved_bytes += size;
+}
+
+/*
+ * next_segment - Move the writer to the next segment, the oldest one once
+ *     the log wrapped around. Its records are taken out of the index
+ *     first, then the readers still copying out of it are waited for.
+ */
+static void
+next_segment(void)
+{
+    DiskSegment *seg;
+    DiskRecord *record, *next;
+
+    write_segment = (write_segment + 1) % nsegments;
+    write_off = 0;
+    seg = &segments[write_segment];
+
+    pthread_mutex_lock(&index_mutex);
+    if (seg->ds_records)
+        recycled++;
+    for (record = seg->ds_records; record; record = next) {
+        next = record->dr_seg_next;
+        if (record->dr_tag) {
+            drop_record(record);
+            overwritten++;
+        }
+        free(record);
+    }
+    seg->ds_records = NULL;
+    pthread_mutex_unlock(&index_mutex);
+
+    /* A copy takes as long as reading one record */
+    while (atomic_load(&seg->ds_readers))
+        sched_yield();
+}
+
+/*
+ * find_record - Record indexed under tag, NULL if there is none. Called
+ *     with index_mutex held.
+ */
+static DiskRecord *
+find_record(unsigned long tag)
+{
+    DiskRecord *record;
+
+    for (record = buckets[tag & (nbuckets - 1)]; record;
+         record = record->dr_next) {
+        if (record->dr_tag == tag)
+            return record;
+    }
+    return NULL;
+}
+
+/*
+ * drop_record - Take a record out of the index, it stays on the list of
+ *     its segment until that is reused. Called with index_mutex held.
+ */
+static void
+drop_record(DiskRecord *record)
+{
+    DiskRecord **link;
+
+    if (!record)
+        return;
+    for (link = &buckets[record->dr_tag & (nbuckets - 1)]; *link != record;
+         link = &(*link)->dr_next)
+        ;
+    *link = record->dr_next;
+    record->dr_tag = 0;
+    nrecords--;
+}
+
+/*
+ * promote - Cache again the entry saved at off, copying it straight out
+ *     of the mapping. Another key with the same tag is a miss.
+ */
+static CacheEntry *
+promote(size_t off, unsigned long tag, const char *key, size_t key_len)
+{
+    const DiskHeader *hdr = (const DiskHeader *) (disk_map + off);
+    const CacheEntry *image = (const CacheEntry *) (hdr + 1);
+
+    if (hdr->dh_magic != DISK_MAGIC || hdr->dh_tag != tag ||
+        image->key_len != key_len ||
+        hdr->dh_size != sizeof(CacheEntry) + image->len + key_len ||
+        memcmp(image->data + image->len, key, key_len))
+        return NULL;
+    return cache_restore(cache, image);
+}
+
+/*
+ * is_resident - Whether the size bytes at off are all in the page cache,
+ *     so copying them does not wait for the disk
+ */
+static int
+is_resident(size_t off, size_t size)
+{
+    unsigned char vec[64];
+    size_t start, end, len;
+
+    start = off & ~(page_size - 1);
+    end = off + size;
+    for (; start < end; start += len) {
+        len = end - start < sizeof(vec) * page_size ? end - start
+                                                    : sizeof(vec) * page_size;
+        if (mincore(disk_map + start, len, vec) < 0)
+            return 0;
+        for (size_t i = 0; i < (len + page_size - 1) / page_size; i++) {
+            if (!(vec[i] & 1))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static void
+disk_report(FILE *out, void *arg)
+{
+    size_t records, queued;
+
+    pthread_mutex_lock(&index_mutex);
+    records = nrecords;
+    pthread_mutex_unlock(&index_mutex);
+    pthread_mutex_lock(&queue_mutex);
+    queued = ndemoting;
+    pthread_mutex_unlock(&queue_mutex);
+
+    fprintf(out, " file=%s bytes=%zu segments=%zu records=%zu queued=%zu "
+            "demoted=%lu dropped=%lu saved=%lu saved_bytes=%lu "
+            "unchanged=%lu promoted=%lu misses=%lu cold=%lu prefetched=%lu "
+            "recycled=%lu overwritten=%lu errors=%lu", disk_path, disk_size,
+            nsegments, records, queued, atomic_load(&demoted),
+            atomic_load(&dropped), atomic_load(&saved),
+            atomic_load(&saved_bytes), atomic_load(&unchanged),
+            atomic_load(&promoted), atomic_load(&misses), atomic_load(&cold),
+            atomic_load(&prefetched), atomic_load(&recycled),
+            atomic_load(&overwritten), atomic_load(&errors));
+}
@@ -0,0 +1,40 @@
+#ifndef _DISK_H_
+#define _DISK_H_
+
+#include <stddef.h>
+
+#include "../proxy_cache/cache.h"
+#include "../proxy_flight/flight.h"
+
+#define DISK_DEFAULT_SIZE (256UL << 20) /* Bytes of the file by default */
+#define DISK_SEGMENT_SIZE (4UL << 20)   /* Log segment, reused oldest first */
+#define DISK_BUCKET_BYTES 8192          /* File bytes per index bucket */
+#define DISK_QUEUE      1024            /* Evicted entries waiting to be saved */
+#define DISK_ALIGN      64              /* Records start on a cache line */
+
+/*
+ * Second tier of the cache in a preallocated file, mapped in memory. The
+ * entries the cache evicts are appended to a log cut into segments, the
+ * oldest segment is reused once the log wraps around. An index in memory
+ * maps the keys to their records. A hit copies the entry back from the
+ * mapping into the cache, where the client is sent it from.
+ */
+int
+disk_init(Cache *cache, const char *path, size_t size);
+
+void
+disk_demote(CacheEntry *entry);
+
+CacheEntry *
+disk_fetch(const char *key, size_t key_len);
+
+int
+disk_prefetch(const char *key, size_t key_len, Flight *flight);
+
+void
+disk_nonblocking(void);
+
+void
+disk_detach(void);
+
+#endif
@@ -0,0 +1,414 @@
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "dns.h"
+#include "../proxy_notify/notify.h"
+#include "../proxy_stats/stats.h"
+
+enum dns_state {
+    DNS_PENDING,    /* Queued or being resolved */
+    DNS_RESOLVED,
+    DNS_FAILED
+};
+
+struct dns_name {
+    char *dn_host;
+    enum dns_state dn_state;
+    time_t dn_expires;              /* Resolved again after that */
+    DnsAddrs dn_addrs;              /* Ports left to the lookups */
+    int dn_refs;                    /* Lookups waiting for it */
+    NotifyWatcher *dn_watchers;     /* Lookups that can not block */
+    struct timespec dn_started;
+    struct dns_name *dn_next;
+    struct dns_name *dn_queued;
+};
+
+static void *
+resolver_thread(void *vargp);
+
+static void
+resolve(DnsName *name);
+
+static int
+parse_port(const char *port, in_port_t *nport);
+
+static int
+copy_addrs(const DnsName *name, const char *port, DnsAddrs *addrs);
+
+static void
+sweep(time_t now);
+
+static unsigned long
+name_hash(const char *host);
+
+static void
+free_name(DnsName *name);
+
+static void
+dns_report(FILE *out, void *arg);
+
+/* Names hashed by host, and the ones waiting for a resolver thread */
+static DnsName *buckets[DNS_BUCKETS];
+static DnsName *queue_head, *queue_tail;
+static pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t resolved_cond = PTHREAD_COND_INITIALIZER;
+static int dns_ttl = DEFAULT_DNS_TTL;
+static int nnames;
+static time_t last_sweep;
+
+static unsigned long hits, negative_hits, misses, coalesced;
+static unsigned long resolved, failed, swept;
+static unsigned long latency[DNS_LATENCY_BUCKETS];
+
+/*
+ * dns_init - Start the resolver threads, names are kept ttl seconds once
+ *     resolved
+ */
+void
+dns_init(int threads, int ttl)
+{
+    pthread_t tid;
+
+    if (threads < 1)
+        threads = DEFAULT_DNS_THREADS;
+    if (ttl >= 0)
+        dns_ttl = ttl;
+    last_sweep = time(NULL);
+    for (int i = 0; i < threads; i++)
+        pthread_create(&tid, NULL, resolver_thread, NULL);
+    stats_register("dns", dns_report, NULL);
+}
+
+/*
+ * dns_lookup - Look host up in the cache, with the addresses given port.
+ *     Returns 0 with addrs filled, -1 if the name can not be resolved, or
+ *     1 while it is: *pending is then to be waited for with dns_wait or
+ *     dns_watch.
+ */
+int
+dns_lookup(const char *host, const char *port, DnsAddrs *addrs,
+           DnsName **pending)
+{
+    int rc;
+    in_port_t nport;
+    time_t now = time(NULL);
+    DnsName **link, *name;
+
+    if (parse_port(port, &nport) < 0)
+        return -1;
+
+    pthread_mutex_lock(&dns_mutex);
+    if (now - last_sweep >= DNS_SWEEP)
+        sweep(now);
+
+    link = &buckets[name_hash(host) % DNS_BUCKETS];
+    while ((name = *link) && strcasecmp(name->dn_host, host))
+        link = &name->dn_next;
+
+    if (!name) {
+        /* A new name is an expired failure, resolved right below */
+        name = calloc(1, sizeof(DnsName));
+        name->dn_host = strdup(host);
+        name->dn_state = DNS_FAILED;
+        name->dn_next = *link;
+        *link = name;
+        nnames++;
+    }
+
+    if (name->dn_state != DNS_PENDING && now > name->dn_expires) {
+        resolve(name);
+        misses++;
+        rc = 1;
+    } else if (name->dn_state == DNS_PENDING) {
+        coalesced++;
+        rc = 1;
+    } else {
+        rc = copy_addrs(name, port, addrs);
+        if (rc == 0)
+            hits++;
+        else
+            negative_hits++;
+    }
+
+    if (rc == 1) {
+        name->dn_refs++;
+        *pending = name;
+    }
+    pthread_mutex_unlock(&dns_mutex);
+    return rc;
+}
+
+/*
+ * dns_resolve - Look host up, waiting for it to be resolved if needed.
+ *     Returns 0 with addrs filled, -1 if it can not be.
+ */
+int
+dns_resolve(const char *host, const char *port, DnsAddrs *addrs)
+{
+    int rc;
+    DnsName *name;
+
+    if ((rc = dns_lookup(host, port, addrs, &name)) == 1)
+        rc = dns_wait(name, port, addrs);
+    return rc;
+}
+
+/*
+ * dns_wait - Block until a pending name is resolved, or failed to be.
+ *     Returns 0 with addrs filled, -1 if it can not be resolved.
+ */
+int
+dns_wait(DnsName *name, const char *port, DnsAddrs *addrs)
+{
+    int rc;
+
+    pthread_mutex_lock(&dns_mutex);
+    while (name->dn_state == DNS_PENDING)
+        pthread_cond_wait(&resolved_cond, &dns_mutex);
+    rc = copy_addrs(name, port, addrs);
+    name->dn_refs--;
+    pthread_mutex_unlock(&dns_mutex);
+    return rc;
+}
+
+/*
+ * dns_watch - Get a non-blocking descriptor that becomes readable once the
+ *     pending name is resolved, for lookups that can not block. They stop
+ *     waiting with dns_unwatch. Returns -1 on error, having stopped.
+ */
+int
+dns_watch(DnsName *name)
+{
+    NotifyWatcher *nw;
+
+    if (!(nw = notify_open())) {
+        pthread_mutex_lock(&dns_mutex);
+        name->dn_refs--;
+        pthread_mutex_unlock(&dns_mutex);
+        return -1;
+    }
+
+    pthread_mutex_lock(&dns_mutex);
+    notify_add(&name->dn_watchers, nw, name->dn_state != DNS_PENDING);
+    pthread_mutex_unlock(&dns_mutex);
+
+    return nw->nw_fd;
+}
+
+/*
+ * dns_unwatch - Stop waiting for the name and close the descriptor of
+ *     dns_watch, whether it is resolved or the client is gone. Returns 0
+ *     with addrs filled, if given, once it is resolved, -1 otherwise.
+ */
+int
+dns_unwatch(DnsName *name, int fd, const char *port, DnsAddrs *addrs)
+{
+    int rc = -1;
+    NotifyWatcher *nw;
+
+    pthread_mutex_lock(&dns_mutex);
+    nw = notify_remove(&name->dn_watchers, fd);
+    if (addrs && name->dn_state != DNS_PENDING)
+        rc = copy_addrs(name, port, addrs);
+    name->dn_refs--;
+    pthread_mutex_unlock(&dns_mutex);
+
+    notify_close(nw);
+    return rc;
+}
+
+static void *
+resolver_thread(void *vargp)
+{
+    int rc, bucket;
+    double ms;
+    DnsName *name;
+    DnsAddr *addr;
+    struct addrinfo hints, *listp, *p;
+    struct timespec now;
+
+    pthread_detach(pthread_self());
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM; /* Open a connection */
+    hints.ai_flags = AI_ADDRCONFIG;  /* Recommended for connections */
+
+    while (1) {
+        pthread_mutex_lock(&dns_mutex);
+        while (!queue_head)
+            pthread_cond_wait(&queue_cond, &dns_mutex);
+        name = queue_head;
+        if (!(queue_head = name->dn_queued))
+            queue_tail = NULL;
+        pthread_mutex_unlock(&dns_mutex);
+
+        /* A pending name is never freed, nor its host changed */
+        if ((rc = getaddrinfo(name->dn_host, NULL, &hints, &listp)) != 0)
+            fprintf(stderr, "getaddrinfo failed (%s): %s\n", name->dn_host,
+                    gai_strerror(rc));
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = (now.tv_sec - name->dn_started.tv_sec) * 1e3
+             + (now.tv_nsec - name->dn_started.tv_nsec) / 1e6;
+        for (bucket = 0; bucket < DNS_LATENCY_BUCKETS - 1 &&
+             ms >= (1 << bucket); bucket++)
+            ;
+
+        pthread_mutex_lock(&dns_mutex);
+        name->dn_addrs.da_count = 0;
+        for (p = rc ? NULL : listp;
+             p && name->dn_addrs.da_count < DNS_MAX_ADDRS; p = p->ai_next) {
+            if (p->ai_family != AF_INET && p->ai_family != AF_INET6)
+                continue;
+            addr = &name->dn_addrs.da_list[name->dn_addrs.da_count++];
+            addr->da_family = p->ai_family;
+            addr->da_len = p->ai_addrlen;
+            memcpy(&addr->da_addr, p->ai_addr, p->ai_addrlen);
+        }
+        if (name->dn_addrs.da_count) {
+            name->dn_state = DNS_RESOLVED;
+            name->dn_expires = time(NULL) + dns_ttl;
+            resolved++;
+        } else {
+            name->dn_state = DNS_FAILED;
+            name->dn_expires = time(NULL) + DNS_NEGATIVE_TTL;
+            failed++;
+        }
+        latency[bucket]++;
+
+        pthread_cond_broadcast(&resolved_cond);
+        notify_all(name->dn_watchers);
+        pthread_mutex_unlock(&dns_mutex);
+
+        if (rc == 0)
+            freeaddrinfo(listp);
+    }
+    return NULL;
+}
+
+/*
+ * resolve - Queue the name for the resolver threads. Called with dns_mutex
+ *     held.
+ */
+static void
+resolve(DnsName *name)
+{
+    name->dn_state = DNS_PENDING;
+    clock_gettime(CLOCK_MONOTONIC, &name->dn_started);
+    name->dn_queued = NULL;
+    if (queue_tail)
+        queue_tail->dn_queued = name;
+    else
+        queue_head = name;
+    queue_tail = name;
+    pthread_cond_signal(&queue_cond);
+}
+
+/*
+ * parse_port - Convert the numeric port to network order. Returns -1 if
+ *     it is not one.
+ */
+static int
+parse_port(const char *port, in_port_t *nport)
+{
+    long n;
+    char *end;
+
+    n = strtol(port, &end, 10);
+    if (end == port || *end || n < 0 || n > 65535)
+        return -1;
+    *nport = htons(n);
+    return 0;
+}
+
+/*
+ * copy_addrs - Give the addresses of a resolved name, with port. Returns -1
+ *     if it failed to be resolved. Called with dns_mutex held.
+ */
+static int
+copy_addrs(const DnsName *name, const char *port, DnsAddrs *addrs)
+{
+    in_port_t nport;
+    DnsAddr *addr;
+
+    if (name->dn_state != DNS_RESOLVED || parse_port(port, &nport) < 0)
+        return -1;
+    *addrs = name->dn_addrs;
+    for (int i = 0; i < addrs->da_count; i++) {
+        addr = &addrs->da_list[i];
+        if (addr->da_family == AF_INET)
+            ((struct sockaddr_in *) &addr->da_addr)->sin_port = nport;
+        else
+            ((struct sockaddr_in6 *) &addr->da_addr)->sin6_port = nport;
+    }
+    return 0;
+}
+
+/*
+ * sweep - Drop the expired names nobody waits for, whether they are asked
+ *     for again or not. Called with dns_mutex held.
+ */
+static void
+sweep(time_t now)
+{
+    DnsName **link, *name;
+
+    for (int i = 0; i < DNS_BUCKETS; i++) {
+        link = &buckets[i];
+        while ((name = *link)) {
+            if (name->dn_state != DNS_PENDING && now > name->dn_expires &&
+                !name->dn_refs) {
+                *link = name->dn_next;
+                free_name(name);
+                nnames--;
+                swept++;
+            } else {
+                link = &name->dn_next;
+            }
+        }
+    }
+    last_sweep = now;
+}
+
+static unsigned long
+name_hash(const char *host)
+{
+    unsigned long hash = 5381;
+
+    while (*host)   /* Names are case insensitive */
+        hash = ((hash << 5) + hash) + (*host++ | 0x20); /* hash * 33 + c */
+    return hash;
+}
+
+static void
+free_name(DnsName *name)
+{
+    free(name->dn_host);
+    free(name);
+}
+
+static void
+dns_report(FILE *out, void *arg)
+{
+    unsigned long lookups;
+
+    pthread_mutex_lock(&dns_mutex);
+    lookups = hits + negative_hits + misses + coalesced;
+    fprintf(out, " names=%d hits=%lu negative_hits=%lu misses=%lu "
+            "coalesced=%lu hit_ratio=%.1f%% resolved=%lu failed=%lu "
+            "swept=%lu latency_ms=", nnames, hits, negative_hits, misses,
+            coalesced, lookups ? 100.0 * (hits + negative_hits) / lookups
+            : 0.0, resolved, failed, swept);
+    for (int i = 0; i < DNS_LATENCY_BUCKETS; i++) {
+        if (i < DNS_LATENCY_BUCKETS - 1)
+            fprintf(out, "%s<%d:%lu", i ? "," : "", 1 << i, latency[i]);
+        else
+            fprintf(out, ",inf:%lu", latency[i]);
+    }
+    pthread_mutex_unlock(&dns_mutex);
+}
@@ -0,0 +1,53 @@
+#ifndef _DNS_H_
+#define _DNS_H_
+
+#include <sys/socket.h>
+
+#define DNS_BUCKETS         256
+#define DNS_MAX_ADDRS       8       /* Addresses kept for a name */
+#define DNS_NEGATIVE_TTL    5       /* Seconds a failure is kept */
+#define DNS_SWEEP           5       /* Seconds between sweeps of the names */
+#define DNS_LATENCY_BUCKETS 12      /* Under 1, 2, 4 ... 1024ms and above */
+#define DEFAULT_DNS_THREADS 2       /* Threads resolving the names */
+#define DEFAULT_DNS_TTL     60      /* Seconds a resolved name is kept */
+
+typedef struct dns_addr {
+    int da_family;
+    socklen_t da_len;
+    struct sockaddr_storage da_addr;
+} DnsAddr;
+
+typedef struct dns_addrs {
+    int da_count;
+    DnsAddr da_list[DNS_MAX_ADDRS];
+} DnsAddrs;
+
+/*
+ * Cache of the server names resolved, positive and negative, each kept for
+ * its time to live. A name missing from it is resolved once by one of the
+ * resolver threads, however many clients ask for it meanwhile: they wait
+ * for it with dns_wait, or with a descriptor from dns_watch when they can
+ * not block, which give them its addresses.
+ */
+typedef struct dns_name DnsName;
+
+void
+dns_init(int threads, int ttl);
+
+int
+dns_lookup(const char *host, const char *port, DnsAddrs *addrs,
+           DnsName **pending);
+
+int
+dns_resolve(const char *host, const char *port, DnsAddrs *addrs);
+
+int
+dns_wait(DnsName *name, const char *port, DnsAddrs *addrs);
+
+int
+dns_watch(DnsName *name);
+
+int
+dns_unwatch(DnsName *name, int fd, const char *port, DnsAddrs *addrs);
+
+#endif
@@ -0,0 +1,237 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ebr.h"
+#include "../proxy_stats/stats.h"
+
+#define EBR_ACTIVE 1UL      /* Low bit of a record state */
+
+typedef struct ebr_retired {
+    void *rt_ptr;
+    EbrReclaim rt_reclaim;
+    unsigned long rt_epoch;         /* Global epoch when it was unlinked */
+    struct ebr_retired *rt_next;
+} EbrRetired;
+
+/*
+ * Epoch announced by one thread, and the objects it retired waiting in
+ * limbo until no reader can still see them. Records are reused after their
+ * thread exits, along with what is left in their limbo.
+ */
+typedef struct ebr_record {
+    atomic_ulong er_state;          /* Epoch << 1 | EBR_ACTIVE, or 0 */
+    atomic_int er_used;
+    pthread_mutex_t er_mutex;       /* Guards er_limbo */
+    EbrRetired *er_limbo;           /* Newest first */
+    unsigned int er_retires;        /* Since its last reclaim */
+    unsigned int er_exits;
+    struct ebr_record *er_next;
+} EbrRecord;
+
+static EbrRecord *
+get_record(void);
+
+static void
+release_record(void *rec);
+
+static void
+try_advance(void);
+
+static void
+reclaim_record(EbrRecord *rec, int wait);
+
+static void
+ebr_report(FILE *out, void *arg);
+
+static _Atomic(EbrRecord *) records;
+static atomic_ulong global_epoch = 2;
+static pthread_key_t record_key;
+static __thread EbrRecord *self;
+static atomic_ulong npending, nreclaimed;
+
+/*
+ * ebr_init - Prepare the per-thread records and register the report
+ */
+void
+ebr_init(void)
+{
+    pthread_key_create(&record_key, release_record);
+    stats_register("ebr", ebr_report, NULL);
+}
+
+/*
+ * ebr_enter - Start a read-side critical section: objects reachable from
+ *     now on are not reclaimed before the matching ebr_exit
+ */
+void
+ebr_enter(void)
+{
+    EbrRecord *rec = get_record();
+
+    atomic_store(&rec->er_state,
+                 atomic_load(&global_epoch) << 1 | EBR_ACTIVE);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/*
+ * ebr_exit - End a read-side critical section. Every EBR_POLL of them the
+ *     thread also reclaims what it can of every limbo, so the objects are
+ *     freed even once nothing is retired anymore.
+ */
+void
+ebr_exit(void)
+{
+    atomic_store_explicit(&self->er_state, 0, memory_order_release);
+    if (++self->er_exits < EBR_POLL)
+        return;
+
+    self->er_exits = 0;
+    try_advance();
+    for (EbrRecord *rec = atomic_load(&records); rec; rec = rec->er_next)
+        reclaim_record(rec, 0);
+}
+
+/*
+ * ebr_retire - Hand over an object that was just unlinked by a writer.
+ *     It is reclaimed once the global epoch moved twice past the epoch it
+ *     was retired in, as every reader that could have found it has left
+ *     its critical section by then. The limbo of the thread is looked at
+ *     every EBR_BATCH retires.
+ */
+void
+ebr_retire(void *ptr, EbrReclaim reclaim)
+{
+    EbrRecord *rec = get_record();
+    EbrRetired *rt;
+
+    rt = malloc(sizeof(EbrRetired));
+    rt->rt_ptr = ptr;
+    rt->rt_reclaim = reclaim;
+    rt->rt_epoch = atomic_load(&global_epoch);
+
+    pthread_mutex_lock(&rec->er_mutex);
+    rt->rt_next = rec->er_limbo;
+    rec->er_limbo = rt;
+    pthread_mutex_unlock(&rec->er_mutex);
+    atomic_fetch_add_explicit(&npending, 1, memory_order_relaxed);
+
+    if (++rec->er_retires < EBR_BATCH)
+        return;
+    rec->er_retires = 0;
+    try_advance();
+    reclaim_record(rec, 1);
+}
+
+/*
+ * ebr_reclaim - Free what can be of the limbo of the thread right away,
+ *     for a writer that needs the memory of the objects it just retired
+ */
+void
+ebr_reclaim(void)
+{
+    EbrRecord *rec = get_record();
+
+    rec->er_retires = 0;
+    try_advance();
+    reclaim_record(rec, 1);
+}
+
+/*
+ * reclaim_record - Free the objects of the limbo of rec that no reader can
+ *     see anymore. The limbo is in retire order, so they are all past the
+ *     first one found. Another thread busy with the limbo is not waited
+ *     for unless wait is set.
+ */
+static void
+reclaim_record(EbrRecord *rec, int wait)
+{
+    unsigned long epoch = atomic_load(&global_epoch), n = 0;
+    EbrRetired *rt, **link, *done;
+
+    if (wait)
+        pthread_mutex_lock(&rec->er_mutex);
+    else if (pthread_mutex_trylock(&rec->er_mutex))
+        return;
+
+    for (link = &rec->er_limbo; *link && (*link)->rt_epoch + 2 > epoch; )
+        link = &(*link)->rt_next;
+    done = *link;
+    *link = NULL;
+    pthread_mutex_unlock(&rec->er_mutex);
+
+    while ((rt = done)) {
+        done = rt->rt_next;
+        rt->rt_reclaim(rt->rt_ptr);
+        free(rt);
+        n++;
+    }
+    if (n) {
+        atomic_fetch_sub_explicit(&npending, n, memory_order_relaxed);
+        atomic_fetch_add_explicit(&nreclaimed, n, memory_order_relaxed);
+    }
+}
+
+static EbrRecord *
+get_record(void)
+{
+    int unused;
+    EbrRecord *rec;
+
+    if (self)
+        return self;
+
+    /* Take over the record of a thread that exited, or add one */
+    for (rec = atomic_load(&records); rec; rec = rec->er_next) {
+        unused = 0;
+        if (atomic_compare_exchange_strong(&rec->er_used, &unused, 1))
+            break;
+    }
+    if (!rec) {
+        rec = calloc(1, sizeof(EbrRecord));
+        pthread_mutex_init(&rec->er_mutex, NULL);
+        atomic_store(&rec->er_used, 1);
+        rec->er_next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &rec->er_next, rec))
+            ;
+    }
+
+    pthread_setspecific(record_key, rec);
+    self = rec;
+    return rec;
+}
+
+static void
+release_record(void *rec)
+{
+    atomic_store(&((EbrRecord *) rec)->er_state, 0);
+    atomic_store(&((EbrRecord *) rec)->er_used, 0);
+}
+
+/*
+ * try_advance - Move the global epoch forward if every active reader
+ *     has seen the current one. Of threads trying at once, one moves it.
+ */
+static void
+try_advance(void)
+{
+    unsigned long epoch, state;
+    EbrRecord *rec;
+
+    epoch = atomic_load(&global_epoch);
+    for (rec = atomic_load(&records); rec; rec = rec->er_next) {
+        state = atomic_load(&rec->er_state);
+        if (state & EBR_ACTIVE && state >> 1 != epoch)
+            return;
+    }
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+static void
+ebr_report(FILE *out, void *arg)
+{
+    fprintf(out, " epoch=%lu pending=%lu reclaimed=%lu",
+            atomic_load(&global_epoch), atomic_load(&npending),
+            atomic_load(&nreclaimed));
+}
@@ -0,0 +1,24 @@
+#ifndef _EBR_H_
+#define _EBR_H_
+
+#define EBR_BATCH   64      /* Retires of a thread between its reclaims */
+#define EBR_POLL    1024    /* Read sections of a thread between reclaims */
+
+typedef void (*EbrReclaim)(void *ptr);
+
+void
+ebr_init(void);
+
+void
+ebr_enter(void);
+
+void
+ebr_exit(void);
+
+void
+ebr_retire(void *ptr, EbrReclaim reclaim);
+
+void
+ebr_reclaim(void);
+
+#endif
@@ -0,0 +1,1130 @@
+#define _GNU_SOURCE         /* splice */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "../proxy_arena/arena.h"
+#include "../proxy_buf/buf.h"
+#include "../proxy_disk/disk.h"
+#include "../proxy_http/http.h"
+#include "../proxy_listen/listen.h"
+#include "../proxy_serve/serve.h"
+#include "../proxy_stats/stats.h"
+#include "../proxy_upstream/upstream.h"
+#include "../safe_io/sio.h"
+#include "../socket_interface/interface.h"
+
+#define MAX_EVENTS 256
+
+#define CLIENT 0
+#define SERVER 1
+#define WAKE   2    /* Landing of the flight, or resolution of the server
+                     * name, a connection waits for */
+#define TIMER  3    /* Deadline of the client or the server side passed */
+
+#define WAIT_SWEEP_MS 1000  /* Timeouts of waiting connections, checked */
+
+/* Connection states, a connection moves through them in order */
+enum conn_state {
+    READ_REQUEST,   /* Collect the request head from the client */
+    LOOKUP,         /* Build the server request and search the cache */
+    WAIT_FLIGHT,    /* Wait for another client's fetch, then look again */
+    RESOLVE,        /* Wait for the server name to be resolved */
+    CONNECT,        /* Wait for the connection with the server */
+    SEND_REQUEST,   /* Write the request to the server */
+    READ_RESPONSE,  /* Collect the response head from the server */
+    RELAY           /* Write the response to the client */
+};
+
+/* Outcome of running a state */
+enum step {
+    STEP_NEXT,      /* State changed, run the next one */
+    STEP_BLOCK,     /* Waiting for a descriptor to become ready */
+    STEP_DONE,      /* Client served */
+    STEP_FAIL       /* Give up on the connection */
+};
+
+typedef struct conn Conn;
+
+typedef struct loop {
+    int lp_epfd;
+    int lp_listener;                            /* Listener it accepts on */
+    Cache *lp_cache;
+    char *lp_key;                               /* Scratch buffer */
+    Conn *lp_closed;    /* Closed connections, freed after each batch */
+    Conn *lp_waiting;   /* Connections in WAIT_FLIGHT */
+    Conn *lp_timed;     /* Connections waiting, with a deadline */
+    pthread_t lp_tid;
+} Loop;
+
+typedef struct handle {
+    Conn *h_conn;
+    int h_side;
+} Handle;
+
+struct conn {
+    enum conn_state c_state;
+    int c_fd[2];                    /* Client and server descriptors */
+    unsigned int c_events[2];       /* Registered interest */
+    unsigned int c_want[2];         /* Interest wanted by the current state */
+    Handle c_handle[3];
+    Sio c_client_sio;
+    Request c_request;
+    Response c_response;            /* Owns the server descriptor */
+    Arena c_arena;                  /* Holds the strings of both */
+    struct iovec c_iov[RELAY_IOVS]; /* Pending output, in the arena, a */
+    int c_iovcnt;                   /* ... cached response or c_out_page */
+    BufPage *c_out_page;            /* Page of the body bytes pending */
+    char c_size_lines[RELAY_IOVS / 3][SIZE_LINE_LEN];
+    int c_nchunks;                  /* Size lines of the chunks pending */
+    int c_pipe[2];                  /* Body spliced from server to client, */
+    size_t c_piped;                 /* ... bytes of it in the pipe */
+    Flight *c_flight;               /* Flight waited for, */
+    int c_wake_fd;                  /* ... readable once it lands */
+    time_t c_wake_by;               /* ... or it is fetched at this time */
+    int c_solo;                     /* Fetch the response without a flight */
+    DnsName *c_name;                /* Server name resolved, c_wake_fd
+                                     * readable once it is */
+    Conn *c_wait_prev, *c_wait_next;
+    ConnectRace *c_race;            /* Connects to the server in progress, */
+    long c_race_at;                 /* ... the next one started at this ms, */
+    long c_connect_by;              /* ... given up on at this one, as is
+                                     * the name being resolved */
+    long c_request_by;              /* Whole request head read by this ms */
+    int c_timed;                    /* In lp_timed, until c_timer_at ms, */
+    long c_timer_at;
+    int c_timer_side;               /* ... for this side */
+    Conn *c_timer_prev, *c_timer_next;
+    int c_closed;
+    Conn *c_next_closed;
+    Loop *c_loop;
+};
+
+static void *
+loop_thread(void *vargp);
+
+static void
+accept_clients(Loop *loop);
+
+static void
+conn_step(Conn *c, int side, unsigned int events);
+
+static int
+read_request(Conn *c);
+
+static int
+lookup(Conn *c);
+
+static int
+await_flight(Conn *c, Flight *flight);
+
+static int
+wait_flight(Conn *c);
+
+static void
+leave_flight(Conn *c);
+
+static void
+expire_waiting(Loop *loop);
+
+static int
+connect_server(Conn *c, const DnsAddrs *addrs);
+
+static int
+await_name(Conn *c, DnsName *name);
+
+static int
+wait_name(Conn *c);
+
+static int
+race_attempt(Conn *c);
+
+static int
+finish_connect(Conn *c);
+
+static int
+send_request(Conn *c);
+
+static int
+read_response(Conn *c);
+
+static int
+relay(Conn *c);
+
+static int
+splice_in(Conn *c);
+
+static int
+next_request(Conn *c);
+
+static int
+flush_out(Conn *c, int side, int flags);
+
+static void
+set_out(Conn *c, const char *s1, size_t n1, const char *s2, size_t n2);
+
+static void
+watch(Conn *c, int side);
+
+static void
+set_timer(Conn *c);
+
+static void
+clear_timer(Conn *c);
+
+static int
+expire_timed(Loop *loop);
+
+static long
+now_ms(void);
+
+static void
+event_report(FILE *out, void *arg);
+
+static void
+conn_close(Conn *c);
+
+static void
+conn_free(Conn *c);
+
+static Loop *loops;
+static int nloops_run;
+static atomic_ulong client_timeouts, server_timeouts;
+
+/*
+ * event_run - Run nloops event loops, DEFAULT_LOOPS if 0, spread over the
+ *     listeners with at least one on each, and wait for them
+ */
+void
+event_run(Cache *proxy_cache, int nloops)
+{
+    int nlisteners = listen_count();
+    struct epoll_event ev;
+
+    if (nloops < 1)
+        nloops = DEFAULT_LOOPS > nlisteners ? DEFAULT_LOOPS : nlisteners;
+    if (nloops < nlisteners) {
+        fprintf(stderr, "-n is raised to %d, a loop per listener\n",
+                nlisteners);
+        nloops = nlisteners;
+    }
+    if (nloops > MAX_LOOPS)
+        nloops = MAX_LOOPS;
+
+    for (int i = 0; i < nlisteners; i++)
+        set_nonblocking(listen_fd(i));
+    loops = calloc(nloops, sizeof(Loop));
+    nloops_run = nloops;
+    stats_register("event", event_report, NULL);
+    for (int i = 0; i < nloops; i++) {
+        loops[i].lp_listener = i % nlisteners;
+        loops[i].lp_cache = proxy_cache;
+        loops[i].lp_key = malloc(CACHE_KEY_SIZE);
+        if ((loops[i].lp_epfd = epoll_create1(0)) < 0) {
+            perror("epoll_create1");
+            exit(1);
+        }
+
+        /* Every loop accepts, on a listener of its own or on one it shares
+         * with others, where EPOLLEXCLUSIVE wakes only one of them */
+        ev.events = EPOLLIN | (nloops > nlisteners ? EPOLLEXCLUSIVE : 0);
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loops[i].lp_epfd, EPOLL_CTL_ADD,
+                      listen_fd(loops[i].lp_listener), &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+        pthread_create(&loops[i].lp_tid, NULL, loop_thread, &loops[i]);
+    }
+
+    for (int i = 0; i < nloops; i++)
+        pthread_join(loops[i].lp_tid, NULL);
+}
+
+/*
+ * event_stop_accepting - Leave the clients to the next generation of the
+ *     proxy, the loops keep serving their connections
+ */
+void
+event_stop_accepting(void)
+{
+    listen_stop();
+    for (int i = 0; i < nloops_run; i++)
+        epoll_ctl(loops[i].lp_epfd, EPOLL_CTL_DEL,
+                  listen_fd(loops[i].lp_listener), NULL);
+}
+
+static void *
+loop_thread(void *vargp)
+{
+    int n, timeout = -1;
+    Loop *loop = vargp;
+    Handle *handle;
+    struct epoll_event events[MAX_EVENTS];
+
+    listen_pin(loop->lp_listener);
+    disk_nonblocking();
+    while (1) {
+        if (loop->lp_waiting && (timeout < 0 || timeout > WAIT_SWEEP_MS))
+            timeout = WAIT_SWEEP_MS;
+        n = epoll_wait(loop->lp_epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return NULL;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (!(handle = events[i].data.ptr)) {
+                accept_clients(loop);
+                continue;
+            }
+            conn_step(handle->h_conn, handle->h_side, events[i].events);
+        }
+        expire_waiting(loop);
+        timeout = expire_timed(loop);
+
+        /* Both descriptors of a connection may be in one batch, so the
+         * closed ones are freed only after the whole batch is handled */
+        while (loop->lp_closed) {
+            Conn *c = loop->lp_closed;
+            loop->lp_closed = c->c_next_closed;
+            conn_free(c);
+        }
+    }
+}
+
+static void
+accept_clients(Loop *loop)
+{
+    int connfd;
+    Conn *c;
+    struct epoll_event ev;
+
+    while (!listen_stopped() &&
+           (connfd = listen_accept(loop->lp_listener,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        c = calloc(1, sizeof(Conn));
+        c->c_loop = loop;
+        c->c_state = READ_REQUEST;
+        c->c_request_by = now_ms() + CLIENT_IDLE_TIMEOUT * 1000;
+        c->c_fd[CLIENT] = connfd;
+        c->c_fd[SERVER] = -1;
+        c->c_pipe[0] = c->c_pipe[1] = -1;
+        for (int side = CLIENT; side <= WAKE; side++) {
+            c->c_handle[side].h_conn = c;
+            c->c_handle[side].h_side = side;
+        }
+        sio_initbuf(&c->c_client_sio, connfd);
+        arena_start(&c->c_arena);
+        init_resources(&c->c_request, &c->c_response, &c->c_arena);
+
+        ev.events = c->c_events[CLIENT] = c->c_want[CLIENT] = EPOLLIN;
+        ev.data.ptr = &c->c_handle[CLIENT];
+        if (epoll_ctl(loop->lp_epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+            conn_close(c);
+        else
+            set_timer(c);   /* A client that never sends is dropped too */
+    }
+}
+
+/*
+ * conn_step - Run the state machine of the connection until it has to wait
+ *     for one of its descriptors, then register the interest it waits for.
+ */
+static void
+conn_step(Conn *c, int side, unsigned int events)
+{
+    int rc;
+
+    if (c->c_closed)
+        return;
+
+    /* A broken client can not be served, a broken server is noticed by
+     * the next read from it and a failed connect by finish_connect */
+    if ((events & EPOLLERR && c->c_state != CONNECT) ||
+        (side == CLIENT && events & EPOLLHUP)) {
+        conn_close(c);
+        return;
+    }
+
+    /* A client idle or not reading, or a server too slow, is given up on.
+     * Only connects go on with another address. */
+    if (side == TIMER && c->c_state != CONNECT) {
+        atomic_fetch_add(c->c_timer_side == CLIENT ? &client_timeouts
+                                                   : &server_timeouts, 1);
+        conn_close(c);
+        return;
+    }
+
+    do {
+        c->c_want[CLIENT] = c->c_want[SERVER] = 0;
+        switch (c->c_state) {
+        case READ_REQUEST:
+            rc = read_request(c);
+            break;
+        case LOOKUP:
+            rc = lookup(c);
+            break;
+        case WAIT_FLIGHT:
+            rc = wait_flight(c);
+            break;
+        case RESOLVE:
+            rc = wait_name(c);
+            break;
+        case CONNECT:
+            rc = finish_connect(c);
+            break;
+        case SEND_REQUEST:
+            rc = send_request(c);
+            break;
+        case READ_RESPONSE:
+            rc = read_response(c);
+            break;
+        case RELAY:
+            rc = relay(c);
+            break;
+        default:
+            rc = STEP_FAIL;
+        }
+    } while (rc == STEP_NEXT);
+
+    if (rc == STEP_BLOCK) {
+        watch(c, CLIENT);
+        watch(c, SERVER);
+        set_timer(c);
+    } else {
+        conn_close(c);
+    }
+}
+
+static int
+read_request(Conn *c)
+{
+    ssize_t n;
+
+    while (!http_head_end(c->c_client_sio.sio_bufptr,
+                          c->c_client_sio.sio_cnt)) {
+        if ((n = sio_fill(&c->c_client_sio)) > 0)
+            continue;
+        if (n < 0 && errno == EAGAIN) {
+            c->c_want[CLIENT] = EPOLLIN;
+            return STEP_BLOCK;
+        }
+        return STEP_FAIL;
+    }
+
+    /* The whole head is buffered, so parsing it never blocks */
+    if (parse_request(&c->c_client_sio, &c->c_request) < 0)
+        return STEP_FAIL;
+
+    c->c_state = LOOKUP;
+    return STEP_NEXT;
+}
+
+static int
+lookup(Conn *c)
+{
+    int leader;
+    size_t key_len;
+    char *request_line, *request_hdrs;
+    Flight *flight;
+    Loop *loop = c->c_loop;
+    Response *response = &c->c_response;
+
+    build_server_request(&c->c_request, &request_line, &request_hdrs);
+    key_len = build_cache_key(&c->c_request, loop->lp_key);
+    response->rs_entry = fetch_fresh(loop->lp_cache, &c->c_request,
+                                     request_hdrs, loop->lp_key,
+                                     key_len, &response->rs_stale);
+
+    /* Only one of the clients missing the same response fetches it, like
+     * in forward_client_request, the others come back here once it lands */
+    if (!response->rs_entry && !c->c_solo) {
+        c->c_solo = 1;
+        flight = flight_join(loop->lp_key, &leader);
+        if (!leader)
+            return await_flight(c, flight);
+
+        response->rs_flight = flight;
+        if ((response->rs_entry = fetch_fresh(loop->lp_cache, &c->c_request,
+                                              request_hdrs,
+                                              loop->lp_key, key_len,
+                                              &response->rs_stale)))
+            land_flight(response);
+        else if (disk_prefetch(loop->lp_key, key_len, flight) == 0) {
+            /* The loop must not wait for the disk, so the disk thread
+             * leads the flight instead and the client follows it */
+            response->rs_flight = NULL;
+            flight = flight_join(loop->lp_key, &leader);
+            if (!leader)
+                return await_flight(c, flight);
+            flight_land(flight);    /* Promoted already, look again */
+            return STEP_NEXT;
+        }
+    }
+
+    /* A cached response is written from the cache, without a copy */
+    if (response->rs_entry) {
+        c->c_iovcnt = build_cached_iov(&c->c_request, response, c->c_iov);
+        c->c_state = RELAY;
+        return STEP_NEXT;
+    }
+
+    if (response->rs_stale)
+        request_hdrs = add_validators(response->rs_stale, &c->c_arena,
+                                      request_hdrs);
+
+    /* Keep the key to cache the response under once it is relayed and
+     * the server to give the connection back to */
+    response->rs_request_line = request_line;
+    response->rs_request_hdrs = request_hdrs;
+    response->rs_key = arena_strndup(&c->c_arena, loop->lp_key, key_len);
+    response->rs_key_len = key_len;
+    response->rs_hostname = c->c_request.rq_hostname;
+    response->rs_port = c->c_request.rq_port;
+    return connect_server(c, NULL);
+}
+
+/*
+ * await_flight - Park the connection until the flight fetching its
+ *     response lands, at most FLIGHT_TIMEOUT seconds. Its client is not
+ *     read meanwhile.
+ */
+static int
+await_flight(Conn *c, Flight *flight)
+{
+    Loop *loop = c->c_loop;
+    struct epoll_event ev;
+
+    if ((c->c_wake_fd = flight_watch(flight)) < 0)
+        return STEP_NEXT;   /* Look again and fetch it */
+
+    c->c_flight = flight;
+    c->c_wake_by = time(NULL) + FLIGHT_TIMEOUT;
+    c->c_wait_prev = NULL;
+    c->c_wait_next = loop->lp_waiting;
+    if (loop->lp_waiting)
+        loop->lp_waiting->c_wait_prev = c;
+    loop->lp_waiting = c;
+
+    c->c_state = WAIT_FLIGHT;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &c->c_handle[WAKE];
+    if (epoll_ctl(loop->lp_epfd, EPOLL_CTL_ADD, c->c_wake_fd, &ev) < 0) {
+        leave_flight(c);
+        c->c_state = LOOKUP;
+        return STEP_NEXT;
+    }
+    return STEP_BLOCK;
+}
+
+static int
+wait_flight(Conn *c)
+{
+    uint64_t landed;
+
+    if (read(c->c_wake_fd, &landed, sizeof(landed)) < 0 &&
+        time(NULL) < c->c_wake_by)
+        return STEP_BLOCK;
+
+    leave_flight(c);
+    c->c_state = LOOKUP;
+    return STEP_NEXT;
+}
+
+/*
+ * leave_flight - Stop waiting for a flight, its descriptor is closed and
+ *     thus out of the epoll set
+ */
+static void
+leave_flight(Conn *c)
+{
+    if (c->c_wait_prev)
+        c->c_wait_prev->c_wait_next = c->c_wait_next;
+    else
+        c->c_loop->lp_waiting = c->c_wait_next;
+    if (c->c_wait_next)
+        c->c_wait_next->c_wait_prev = c->c_wait_prev;
+
+    flight_unwatch(c->c_flight, c->c_wake_fd);
+    c->c_flight = NULL;
+    c->c_wake_fd = -1;
+}
+
+/*
+ * expire_waiting - Step the waiting connections whose flight takes too
+ *     long, so they fetch the response themselves
+ */
+static void
+expire_waiting(Loop *loop)
+{
+    time_t now = time(NULL);
+    Conn *c, *next;
+
+    for (c = loop->lp_waiting; c; c = next) {
+        next = c->c_wait_next;
+        if (now >= c->c_wake_by)
+            conn_step(c, WAKE, 0);
+    }
+}
+
+/*
+ * connect_server - Take an idle server connection from the upstream pool,
+ *     or start connecting a new one, and queue the request for it. A new
+ *     one waits for the server name to be resolved first if it is not
+ *     cached, then races connects to the addrs given.
+ */
+static int
+connect_server(Conn *c, const DnsAddrs *addrs)
+{
+    int rc;
+    DnsAddrs resolved;
+    DnsName *name;
+    Response *response = &c->c_response;
+    struct epoll_event ev;
+
+    set_out(c, response->rs_request_line, strlen(response->rs_request_line),
+            response->rs_request_hdrs, strlen(response->rs_request_hdrs));
+
+    response->rs_reused = 1;
+    c->c_state = SEND_REQUEST;
+    c->c_fd[SERVER] = addrs ? -1 : upstream_checkout(response->rs_hostname,
+                                                     response->rs_port);
+    if (c->c_fd[SERVER] < 0) {
+        if (!addrs) {
+            rc = dns_lookup(response->rs_hostname, response->rs_port,
+                            &resolved, &name);
+            if (rc == 1)
+                return await_name(c, name);
+            if (rc < 0)
+                return STEP_FAIL;
+            addrs = &resolved;
+        }
+
+        response->rs_reused = 0;
+        c->c_state = CONNECT;
+        c->c_race = arena_alloc(&c->c_arena, sizeof(ConnectRace));
+        race_init(c->c_race, addrs);
+        c->c_connect_by = now_ms() + get_client_timeouts()->ct_connect_ms;
+        if (race_attempt(c) < 0)
+            return STEP_FAIL;
+        return STEP_NEXT;
+    }
+    set_nonblocking(c->c_fd[SERVER]);
+    response->rs_server_sio = arena_alloc(&c->c_arena, sizeof(Sio));
+    sio_initbuf(response->rs_server_sio, c->c_fd[SERVER]);
+
+    ev.events = c->c_events[SERVER] = EPOLLOUT;
+    ev.data.ptr = &c->c_handle[SERVER];
+    if (epoll_ctl(c->c_loop->lp_epfd, EPOLL_CTL_ADD, c->c_fd[SERVER], &ev) < 0)
+        return STEP_FAIL;
+
+    return STEP_NEXT;
+}
+
+/*
+ * await_name - Park the connection until its server name is resolved
+ */
+static int
+await_name(Conn *c, DnsName *name)
+{
+    struct epoll_event ev;
+
+    if ((c->c_wake_fd = dns_watch(name)) < 0)
+        return STEP_FAIL;
+
+    c->c_name = name;
+    c->c_state = RESOLVE;
+    c->c_connect_by = now_ms() + get_client_timeouts()->ct_connect_ms;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &c->c_handle[WAKE];
+    if (epoll_ctl(c->c_loop->lp_epfd, EPOLL_CTL_ADD, c->c_wake_fd, &ev) < 0)
+        return STEP_FAIL;
+    return STEP_BLOCK;
+}
+
+static int
+wait_name(Conn *c)
+{
+    int rc;
+    uint64_t resolved;
+    DnsAddrs addrs;
+    Response *response = &c->c_response;
+
+    if (read(c->c_wake_fd, &resolved, sizeof(resolved)) < 0)
+        return STEP_BLOCK;
+
+    rc = dns_unwatch(c->c_name, c->c_wake_fd, response->rs_port, &addrs);
+    c->c_name = NULL;
+    c->c_wake_fd = -1;
+    return rc < 0 ? STEP_FAIL : connect_server(c, &addrs);
+}
+
+/*
+ * race_attempt - Start connecting to the next address of the server, its
+ *     descriptor becomes writable for finish_connect to take a look
+ */
+static int
+race_attempt(Conn *c)
+{
+    int fd;
+    struct epoll_event ev;
+
+    if ((fd = race_next(c->c_race)) < 0)
+        return -1;
+
+    ev.events = EPOLLOUT;
+    ev.data.ptr = &c->c_handle[SERVER];
+    epoll_ctl(c->c_loop->lp_epfd, EPOLL_CTL_ADD, fd, &ev);
+    c->c_race_at = now_ms() + CONNECT_RACE_DELAY_MS;
+    return 0;
+}
+
+/*
+ * finish_connect - Take the first connection established to the server,
+ *     or start another one, or give up once the connect timeout passed
+ */
+static int
+finish_connect(Conn *c)
+{
+    int fd;
+    long now = now_ms();
+    Response *response = &c->c_response;
+
+    while ((fd = race_poll(c->c_race, 0)) < 0) {
+        if (now >= c->c_connect_by)
+            return STEP_FAIL;
+        /* The next address is tried once an attempt failed, or when the
+         * ones in progress had no answer for CONNECT_RACE_DELAY_MS */
+        if (errno == EINPROGRESS && now < c->c_race_at)
+            return STEP_BLOCK;
+        if (race_attempt(c) < 0) {
+            if (!c->c_race->cr_nfds)
+                return STEP_FAIL;   /* All connects failed */
+            c->c_race_at = c->c_connect_by;
+        }
+    }
+
+    /* The others are closed, and thus out of the epoll set */
+    c->c_race = NULL;
+    c->c_fd[SERVER] = fd;
+    c->c_events[SERVER] = EPOLLOUT;
+    response->rs_server_sio = arena_alloc(&c->c_arena, sizeof(Sio));
+    sio_initbuf(response->rs_server_sio, fd);
+
+    c->c_state = SEND_REQUEST;
+    return STEP_NEXT;
+}
+
+static int
+send_request(Conn *c)
+{
+    int rc;
+
+    if ((rc = flush_out(c, SERVER, 0)) != STEP_NEXT)
+        return rc;
+
+    c->c_state = READ_RESPONSE;
+    return STEP_NEXT;
+}
+
+static int
+read_response(Conn *c)
+{
+    ssize_t n;
+    char *head;
+    size_t head_len;
+    Response *response = &c->c_response;
+    Sio *sio = response->rs_server_sio;
+
+    while (!http_head_end(sio->sio_bufptr, sio->sio_cnt)) {
+        if ((n = sio_fill(sio)) > 0)
+            continue;
+        if (n < 0 && errno == EAGAIN) {
+            c->c_want[SERVER] = EPOLLIN;
+            return STEP_BLOCK;
+        }
+
+        /* The server may close an idle connection right when it is
+         * reused, then the request is sent again on a new connection */
+        if (!response->rs_reused || sio->sio_cnt > 0)
+            return STEP_FAIL;
+        sio_release(sio);
+        close(c->c_fd[SERVER]);
+        response->rs_server_sio = NULL;
+        return connect_server(c, NULL);
+    }
+
+    if (parse_response_head(sio, response) < 0)
+        return STEP_FAIL;
+
+    /* The stale response is still current, it is sent from the cache and
+     * relay gives the server connection back */
+    if (response->rs_stale && revalidate(response, c->c_loop->lp_cache)) {
+        c->c_iovcnt = build_cached_iov(&c->c_request, response, c->c_iov);
+        c->c_state = RELAY;
+        return STEP_NEXT;
+    }
+
+    /* Copy the body while relaying it to add the response to the cache */
+    tee_init(response, c->c_loop->lp_cache);
+
+    head = build_client_head(&c->c_request, response, &head_len);
+    set_out(c, head, head_len, NULL, 0);
+    c->c_state = RELAY;
+    return STEP_NEXT;
+}
+
+static int
+relay(Conn *c)
+{
+    int rc, more;
+    ssize_t n;
+    size_t len;
+    Response *response = &c->c_response;
+    Sio *sio = response->rs_server_sio;
+
+    while (1) {
+        if (c->c_piped) {
+            n = sio_splice(c->c_pipe[0], c->c_fd[CLIENT], c->c_piped,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+                           (response->rs_body_left ? SPLICE_F_MORE : 0));
+            if (n < 0) {
+                if (errno != EAGAIN)
+                    return STEP_FAIL;
+                c->c_want[CLIENT] = EPOLLOUT;
+                return STEP_BLOCK;
+            }
+            c->c_piped -= n;
+            continue;
+        }
+
+        /* The buffered body bytes join the pending output, the response
+         * head or the bytes before them, while it has room and they are
+         * in the page it holds */
+        rc = 0;
+        if (sio && response->rs_body_state != BODY_DONE &&
+            (rc = body_span(response, &len)) < 0)
+            return STEP_FAIL;
+        if (rc == 1 && c->c_iovcnt + 4 <= RELAY_IOVS &&
+            c->c_nchunks < RELAY_IOVS / 3 &&
+            (!c->c_out_page || c->c_out_page == sio->sio_page)) {
+            if (!c->c_out_page)
+                c->c_out_page = buf_page_ref(sio->sio_page);
+            c->c_iovcnt = gather_body(response, c->c_iov, c->c_iovcnt,
+                                      c->c_size_lines[c->c_nchunks], len);
+            c->c_nchunks += response->rs_chunk_out;
+            continue;
+        }
+        if (sio)
+            c->c_iovcnt = gather_end(response, c->c_iov, c->c_iovcnt);
+
+        /* The response head, or a whole cached response, goes first.
+         * The last packet waits for the body bytes that did not fit, or
+         * for the spliced ones. */
+        if (c->c_iovcnt > 0) {
+            more = rc == 1 || (rc == 0 && sio &&
+                               response->rs_body_state != BODY_DONE &&
+                               splice_ok(response));
+            if ((rc = flush_out(c, CLIENT, more ? MSG_MORE : 0))
+                != STEP_NEXT)
+                return rc;
+            continue;
+        }
+
+        if (!sio)
+            return next_request(c);
+        if (response->rs_body_state == BODY_DONE)
+            break;
+
+        /* Wait for more of the body. Once the buffered bytes are relayed,
+         * the rest of a body that is not cached goes through the kernel
+         * alone */
+        if (splice_ok(response)) {
+            if ((rc = splice_in(c)) != STEP_NEXT)
+                return rc;
+            continue;
+        }
+        if ((n = sio_fill(sio)) < 0) {
+            if (errno != EAGAIN)
+                return STEP_FAIL;
+            c->c_want[SERVER] = EPOLLIN;
+            return STEP_BLOCK;
+        }
+        if (n == 0 && body_eof(response) < 0)
+            return STEP_FAIL;   /* Truncated by the server */
+    }
+
+    tee_finish(response);
+
+    /* Pooled connections are left in blocking mode and out of the loop */
+    epoll_ctl(c->c_loop->lp_epfd, EPOLL_CTL_DEL, c->c_fd[SERVER], NULL);
+    set_blocking(c->c_fd[SERVER]);
+    release_server(response);
+    if (!response->rs_server_sio)
+        c->c_fd[SERVER] = -1;
+    return next_request(c);
+}
+
+/*
+ * splice_in - Move body bytes from the server into the pipe, relay sends
+ *     them on to the client
+ */
+static int
+splice_in(Conn *c)
+{
+    ssize_t n;
+    size_t want = SPLICE_SIZE;
+    Response *response = &c->c_response;
+
+    if (c->c_pipe[0] < 0 && pipe2(c->c_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        return STEP_FAIL;
+
+    if (response->rs_body_state == BODY_LENGTH &&
+        want > response->rs_body_left)
+        want = response->rs_body_left;
+    n = sio_splice(c->c_fd[SERVER], c->c_pipe[1], want,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+        if (errno != EAGAIN)
+            return STEP_FAIL;
+        c->c_want[SERVER] = EPOLLIN;
+        return STEP_BLOCK;
+    }
+    if (n == 0)
+        return body_eof(response) < 0 ? STEP_FAIL : STEP_NEXT;
+
+    c->c_piped = n;
+    if (response->rs_body_state == BODY_LENGTH)
+        response->rs_body_left -= n;
+    return STEP_NEXT;
+}
+
+/*
+ * next_request - Get ready for the next request of a persistent client
+ *     connection, which may already be buffered
+ */
+static int
+next_request(Conn *c)
+{
+    sio_response_sent();
+    if (c->c_response.rs_client_close)
+        return STEP_DONE;
+
+    /* A server connection not given back to the pool is closed here */
+    free_resources(&c->c_request, &c->c_response);
+    init_resources(&c->c_request, &c->c_response, &c->c_arena);
+    c->c_fd[SERVER] = -1;
+    c->c_events[SERVER] = 0;
+    c->c_solo = 0;
+
+    c->c_state = READ_REQUEST;
+    c->c_request_by = now_ms() + CLIENT_IDLE_TIMEOUT * 1000;
+    return STEP_NEXT;
+}
+
+/*
+ * flush_out - Write the pending output to one side of the connection, in
+ *     one sendmsg unless the socket is full. Returns STEP_NEXT once
+ *     everything is written.
+ */
+static int
+flush_out(Conn *c, int side, int flags)
+{
+    ssize_t n;
+
+    while (c->c_iovcnt > 0) {
+        if ((n = sio_send(c->c_fd[side], c->c_iov, c->c_iovcnt, flags)) < 0) {
+            if (errno != EAGAIN)
+                return STEP_FAIL;
+            c->c_want[side] = EPOLLOUT;
+            return STEP_BLOCK;
+        }
+        c->c_iovcnt = sio_iov_consume(c->c_iov, c->c_iovcnt, n);
+    }
+
+    c->c_nchunks = 0;
+    if (c->c_out_page) {
+        buf_page_put(c->c_out_page);
+        c->c_out_page = NULL;
+    }
+    return STEP_NEXT;
+}
+
+/*
+ * set_out - Make up to two buffers the pending output, without copying
+ *     them: they last until it is written
+ */
+static void
+set_out(Conn *c, const char *s1, size_t n1, const char *s2, size_t n2)
+{
+    const char *bufs[2] = { s1, s2 };
+    size_t lens[2] = { n1, n2 };
+
+    c->c_iovcnt = 0;
+    for (int i = 0; i < 2; i++) {
+        if (lens[i] == 0)
+            continue;
+        c->c_iov[c->c_iovcnt].iov_base = (void *) bufs[i];
+        c->c_iov[c->c_iovcnt++].iov_len = lens[i];
+    }
+}
+
+static void
+watch(Conn *c, int side)
+{
+    struct epoll_event ev;
+
+    if (c->c_fd[side] < 0 || c->c_events[side] == c->c_want[side])
+        return;
+
+    ev.events = c->c_events[side] = c->c_want[side];
+    ev.data.ptr = &c->c_handle[side];
+    epoll_ctl(c->c_loop->lp_epfd, EPOLL_CTL_MOD, c->c_fd[side], &ev);
+}
+
+/*
+ * set_timer - Give the connection a deadline for what it waits for: the
+ *     next connect or the connect timeout, the name for the connect timeout
+ *     too, the server for the read or the write timeout from now on, and
+ *     the client for the write timeout or, for a whole request head,
+ *     CLIENT_IDLE_TIMEOUT seconds since it was waited for. Reading the
+ *     head a few bytes at a time does not push that one back.
+ */
+static void
+set_timer(Conn *c)
+{
+    const ClientTimeouts *timeouts = get_client_timeouts();
+    Loop *loop = c->c_loop;
+
+    c->c_timer_side = SERVER;
+    if (c->c_state == CONNECT) {
+        c->c_timer_at = c->c_race_at < c->c_connect_by ? c->c_race_at
+                                                       : c->c_connect_by;
+    } else if (c->c_state == RESOLVE) {
+        c->c_timer_at = c->c_connect_by;
+    } else if (c->c_want[SERVER] & EPOLLOUT) {
+        c->c_timer_at = now_ms() + timeouts->ct_write_ms;
+    } else if (c->c_want[SERVER] & EPOLLIN) {
+        c->c_timer_at = now_ms() + timeouts->ct_read_ms;
+    } else if (c->c_want[CLIENT] & EPOLLOUT) {
+        c->c_timer_side = CLIENT;
+        c->c_timer_at = now_ms() + timeouts->ct_write_ms;
+    } else if (c->c_state == READ_REQUEST) {
+        c->c_timer_side = CLIENT;
+        c->c_timer_at = c->c_request_by;
+    } else {
+        clear_timer(c);
+        return;
+    }
+
+    if (c->c_timed)
+        return;
+    c->c_timed = 1;
+    c->c_timer_prev = NULL;
+    c->c_timer_next = loop->lp_timed;
+    if (loop->lp_timed)
+        loop->lp_timed->c_timer_prev = c;
+    loop->lp_timed = c;
+}
+
+static void
+clear_timer(Conn *c)
+{
+    if (!c->c_timed)
+        return;
+    if (c->c_timer_prev)
+        c->c_timer_prev->c_timer_next = c->c_timer_next;
+    else
+        c->c_loop->lp_timed = c->c_timer_next;
+    if (c->c_timer_next)
+        c->c_timer_next->c_timer_prev = c->c_timer_prev;
+    c->c_timed = 0;
+}
+
+/*
+ * expire_timed - Step the connections whose deadline passed. Returns the
+ *     ms until the next deadline, -1 if there is none.
+ */
+static int
+expire_timed(Loop *loop)
+{
+    long now = now_ms(), first = -1;
+    Conn *c, *next;
+
+    for (c = loop->lp_timed; c; c = next) {
+        next = c->c_timer_next;
+        if (now >= c->c_timer_at)
+            conn_step(c, TIMER, 0);
+        if (c->c_timed && (first < 0 || c->c_timer_at < first))
+            first = c->c_timer_at;
+    }
+    if (first < 0)
+        return -1;
+    return first > now ? first - now : 0;
+}
+
+static long
+now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void
+event_report(FILE *out, void *arg)
+{
+    fprintf(out, " client_timeouts=%lu server_timeouts=%lu",
+            atomic_load(&client_timeouts), atomic_load(&server_timeouts));
+}
+
+static void
+conn_close(Conn *c)
+{
+    /* Closing the descriptors removes them from the epoll set, the server
+     * one is closed with the response */
+    close(c->c_fd[CLIENT]);
+    if (c->c_pipe[0] >= 0) {
+        close(c->c_pipe[0]);
+        close(c->c_pipe[1]);
+    }
+    clear_timer(c);
+    if (c->c_race) {
+        race_abort(c->c_race);
+        c->c_race = NULL;
+    }
+    if (c->c_flight)
+        leave_flight(c);
+    if (c->c_name)
+        dns_unwatch(c->c_name, c->c_wake_fd, NULL, NULL);
+    free_resources(&c->c_request, &c->c_response);
+    sio_release(&c->c_client_sio);
+    if (c->c_out_page) {
+        buf_page_put(c->c_out_page);
+        c->c_out_page = NULL;
+    }
+
+    c->c_closed = 1;
+    c->c_next_closed = c->c_loop->lp_closed;
+    c->c_loop->lp_closed = c;
+}
+
+static void
+conn_free(Conn *c)
+{
+    arena_free(&c->c_arena);
+    free(c);
+}
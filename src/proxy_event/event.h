@@ -0,0 +1,15 @@
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+#include "../proxy_cache/cache.h"
+
+#define MAX_LOOPS     64    /* Upper bound of event loop threads */
+#define DEFAULT_LOOPS 2     /* Event loop threads unless told otherwise */
+
+void
+event_run(Cache *proxy_cache, int nloops);
+
+void
+event_stop_accepting(void);
+
+#endif
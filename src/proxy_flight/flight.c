@@ -0,0 +1,211 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flight.h"
+#include "../proxy_notify/notify.h"
+#include "../proxy_stats/stats.h"
+
+struct flight {
+    char *fl_key;                   /* Cache key of the response */
+    int fl_landed;
+    int fl_refs;                    /* Leader and followers not done yet */
+    pthread_cond_t fl_cond;
+    NotifyWatcher *fl_watchers;     /* Followers that can not block */
+    struct flight *fl_next;
+};
+
+static unsigned long
+key_hash(const char *key);
+
+static void
+unref_flight(Flight *flight);
+
+static void
+flight_report(FILE *out, void *arg);
+
+/* Flights not landed yet, hashed by key */
+static Flight *buckets[FLIGHT_BUCKETS];
+static pthread_mutex_t flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int nflights;
+static atomic_ulong leaders, coalesced, timeouts;
+
+void
+flight_init(void)
+{
+    stats_register("flight", flight_report, NULL);
+}
+
+/*
+ * flight_join - Join the flight fetching the response cached under key,
+ *     or start one. *leader tells whether the caller has to fetch it and
+ *     call flight_land, or has to wait for it with flight_wait or
+ *     flight_watch.
+ */
+Flight *
+flight_join(const char *key, int *leader)
+{
+    Flight **head, *flight;
+
+    pthread_mutex_lock(&flight_mutex);
+    head = &buckets[key_hash(key) % FLIGHT_BUCKETS];
+    for (flight = *head; flight; flight = flight->fl_next) {
+        if (!strcmp(flight->fl_key, key))
+            break;
+    }
+
+    if (flight) {
+        flight->fl_refs++;
+        *leader = 0;
+    } else {
+        flight = calloc(1, sizeof(Flight));
+        flight->fl_key = strdup(key);
+        flight->fl_refs = 1;
+        pthread_cond_init(&flight->fl_cond, NULL);
+        flight->fl_next = *head;
+        *head = flight;
+        nflights++;
+        *leader = 1;
+    }
+    pthread_mutex_unlock(&flight_mutex);
+
+    atomic_fetch_add(*leader ? &leaders : &coalesced, 1);
+    return flight;
+}
+
+/*
+ * flight_land - Wake the followers of the leader's flight, new requests
+ *     start another one from now on
+ */
+void
+flight_land(Flight *flight)
+{
+    Flight **link;
+
+    pthread_mutex_lock(&flight_mutex);
+    link = &buckets[key_hash(flight->fl_key) % FLIGHT_BUCKETS];
+    while (*link != flight)
+        link = &(*link)->fl_next;
+    *link = flight->fl_next;
+    nflights--;
+
+    flight->fl_landed = 1;
+    pthread_cond_broadcast(&flight->fl_cond);
+    notify_all(flight->fl_watchers);
+    unref_flight(flight);
+    pthread_mutex_unlock(&flight_mutex);
+}
+
+/*
+ * flight_wait - Block a follower until the flight lands, at most
+ *     FLIGHT_TIMEOUT seconds, and leave it. Returns -1 on a timeout.
+ */
+int
+flight_wait(Flight *flight)
+{
+    int rc = 0;
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += FLIGHT_TIMEOUT;
+
+    pthread_mutex_lock(&flight_mutex);
+    while (!flight->fl_landed && rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&flight->fl_cond, &flight_mutex,
+                                    &deadline);
+    rc = flight->fl_landed ? 0 : -1;
+    unref_flight(flight);
+    pthread_mutex_unlock(&flight_mutex);
+
+    if (rc < 0)
+        atomic_fetch_add(&timeouts, 1);
+    return rc;
+}
+
+/*
+ * flight_watch - Get a non-blocking descriptor that becomes readable once
+ *     the flight lands, for followers that can not block. They leave the
+ *     flight with flight_unwatch. Returns -1 on error, having left it.
+ */
+int
+flight_watch(Flight *flight)
+{
+    NotifyWatcher *nw;
+
+    if (!(nw = notify_open())) {
+        pthread_mutex_lock(&flight_mutex);
+        unref_flight(flight);
+        pthread_mutex_unlock(&flight_mutex);
+        return -1;
+    }
+
+    pthread_mutex_lock(&flight_mutex);
+    notify_add(&flight->fl_watchers, nw, flight->fl_landed);
+    pthread_mutex_unlock(&flight_mutex);
+
+    return nw->nw_fd;
+}
+
+/*
+ * flight_unwatch - Leave the flight and close the descriptor of
+ *     flight_watch, whether it landed, timed out or the follower is gone
+ */
+void
+flight_unwatch(Flight *flight, int fd)
+{
+    int landed;
+    NotifyWatcher *nw;
+
+    pthread_mutex_lock(&flight_mutex);
+    nw = notify_remove(&flight->fl_watchers, fd);
+    landed = flight->fl_landed;
+    unref_flight(flight);
+    pthread_mutex_unlock(&flight_mutex);
+
+    notify_close(nw);
+    if (!landed)
+        atomic_fetch_add(&timeouts, 1);
+}
+
+static unsigned long
+key_hash(const char *key)
+{
+    unsigned long hash = 5381;
+
+    while (*key)
+        hash = ((hash << 5) + hash) + *key++; /* hash * 33 + c */
+    return hash;
+}
+
+/*
+ * unref_flight - Drop a reference, the last one frees the landed flight.
+ *     Called with flight_mutex held.
+ */
+static void
+unref_flight(Flight *flight)
+{
+    if (--flight->fl_refs > 0)
+        return;
+
+    pthread_cond_destroy(&flight->fl_cond);
+    free(flight->fl_key);
+    free(flight);
+}
+
+static void
+flight_report(FILE *out, void *arg)
+{
+    int inflight;
+
+    pthread_mutex_lock(&flight_mutex);
+    inflight = nflights;
+    pthread_mutex_unlock(&flight_mutex);
+
+    fprintf(out, " inflight=%d leaders=%lu coalesced=%lu timeouts=%lu",
+            inflight, atomic_load(&leaders), atomic_load(&coalesced),
+            atomic_load(&timeouts));
+}
@@ -0,0 +1,33 @@
+#ifndef _FLIGHT_H_
+#define _FLIGHT_H_
+
+#define FLIGHT_BUCKETS  256
+#define FLIGHT_TIMEOUT  10      /* Seconds a follower waits for its leader */
+
+/*
+ * A fetch of a response from a server on behalf of every client missing
+ * it in the cache at the same time. The first one, the leader, fetches
+ * it and lands the flight once the response is in the cache or can not
+ * be; the followers wait for that and then look in the cache again.
+ */
+typedef struct flight Flight;
+
+void
+flight_init(void);
+
+Flight *
+flight_join(const char *key, int *leader);
+
+void
+flight_land(Flight *flight);
+
+int
+flight_wait(Flight *flight);
+
+int
+flight_watch(Flight *flight);
+
+void
+flight_unwatch(Flight *flight, int fd);
+
+#endif
@@ -0,0 +1,256 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "http.h"
+
+static const char *
+find_scalar(const char *p, const char *end, char a, char b);
+
+#ifdef __SSE2__
+static const char *
+find_sse2(const char *p, const char *end, char a, char b);
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+static const char *
+find_avx2(const char *p, const char *end, char a, char b)
+    __attribute__((target("avx2")));
+#endif
+
+static int
+lower_eq(const char *s, const char *lower, size_t n);
+
+/*
+ * Scanner for the first byte equal to a or b, the widest the processor has.
+ * It is picked once by http_init, the scalar one until then.
+ */
+static const char *(*find)(const char *p, const char *end, char a, char b) =
+    find_scalar;
+
+/*
+ * http_init - Pick the scanner for the processor the proxy runs on
+ */
+void
+http_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find = find_avx2;
+        return;
+    }
+#endif
+#ifdef __SSE2__
+    find = find_sse2;
+#endif
+}
+
+/*
+ * http_head_end - Return the length of the message head at the start of
+ *     the len bytes of buf, up to its empty line included, 0 if it is not
+ *     all there yet
+ */
+size_t
+http_head_end(const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len;
+
+    while ((p = find(p, end, '\n', '\n')) < end) {
+        p++;
+        if (p < end && *p == '\n')
+            return p + 1 - buf;
+        if (p + 1 < end && p[0] == '\r' && p[1] == '\n')
+            return p + 2 - buf;
+    }
+    return 0;
+}
+
+/*
+ * http_parse_head - Split the message head at the start of the len bytes
+ *     of buf into its first line and its headers, in place. Lines may end
+ *     with CRLF or LF alone. Returns 1 once the head is parsed, 0 if it is
+ *     not all there yet and -1 if it is malformed: an empty first line, a
+ *     header without a name or a colon, blanks before the colon, a folded
+ *     line or more than HTTP_MAX_HDRS headers.
+ */
+int
+http_parse_head(const char *buf, size_t len, HttpHead *head)
+{
+    const char *p = buf, *end = buf + len, *colon, *eol, *value, *value_end;
+    HttpHdr *hdr;
+
+    if ((eol = find(p, end, '\n', '\n')) == end)
+        return 0;
+    head->hd_line = p;
+    head->hd_line_size = eol + 1 - p;
+    head->hd_line_len = eol - p - (eol > p && eol[-1] == '\r');
+    if (head->hd_line_len == 0)
+        return -1;
+    p = eol + 1;
+
+    head->hd_nhdrs = 0;
+    while (1) {
+        if (p == end)
+            return 0;
+        if (*p == '\n') {
+            p++;
+            break;
+        }
+        if (*p == '\r') {
+            if (p + 1 == end)
+                return 0;
+            if (p[1] != '\n')
+                return -1;
+            p += 2;
+            break;
+        }
+        if (*p == ' ' || *p == '\t' || head->hd_nhdrs == HTTP_MAX_HDRS)
+            return -1;
+
+        /* A name never holds a colon, a value may */
+        if ((colon = find(p, end, ':', '\n')) == end)
+            return 0;
+        if (*colon == '\n' || colon == p || colon[-1] == ' ' ||
+            colon[-1] == '\t')
+            return -1;
+        if ((eol = find(colon + 1, end, '\n', '\n')) == end)
+            return 0;
+
+        value = colon + 1;
+        value_end = eol;
+        while (value < value_end && (*value == ' ' || *value == '\t'))
+            value++;
+        while (value < value_end && (value_end[-1] == ' ' ||
+               value_end[-1] == '\t' || value_end[-1] == '\r'))
+            value_end--;
+
+        hdr = &head->hd_hdrs[head->hd_nhdrs++];
+        hdr->hh_name = p;
+        hdr->hh_name_len = colon - p;
+        hdr->hh_value = value;
+        hdr->hh_value_len = value_end - value;
+        hdr->hh_size = eol + 1 - p;
+        p = eol + 1;
+    }
+
+    head->hd_len = p - buf;
+    return 1;
+}
+
+/*
+ * http_hdr_is - Return 1 if the header is called name, given in lower
+ *     case, whatever the case of the header
+ */
+int
+http_hdr_is(const HttpHdr *hdr, const char *name)
+{
+    size_t n = strlen(name);
+
+    return hdr->hh_name_len == n && lower_eq(hdr->hh_name, name, n);
+}
+
+/*
+ * http_has_token - Return 1 if the comma separated list of the len bytes
+ *     of value holds token, given in lower case, whatever its case
+ */
+int
+http_has_token(const char *value, size_t len, const char *token)
+{
+    size_t n = strlen(token), elem_len;
+    const char *end = value + len, *comma;
+
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t'))
+            value++;
+        if (!(comma = memchr(value, ',', end - value)))
+            comma = end;
+        elem_len = comma - value;
+        while (elem_len > 0 && (value[elem_len - 1] == ' ' ||
+               value[elem_len - 1] == '\t'))
+            elem_len--;
+        if (elem_len == n && lower_eq(value, token, n))
+            return 1;
+        value = comma + 1;
+    }
+    return 0;
+}
+
+/*
+ * lower_eq - Compare n bytes of s with lower, in lower case, setting the
+ *     case bit of the letters of s instead of converting them
+ */
+static int
+lower_eq(const char *s, const char *lower, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] != lower[i] &&
+            (lower[i] < 'a' || lower[i] > 'z' || (s[i] | 0x20) != lower[i]))
+            return 0;
+    }
+    return 1;
+}
+
+static const char *
+find_scalar(const char *p, const char *end, char a, char b)
+{
+    for (; p < end; p++) {
+        if (*p == a || *p == b)
+            break;
+    }
+    return p;
+}
+
+#ifdef __SSE2__
+/*
+ * find_sse2 - Compare 16 bytes at a time with a and b, the first match
+ *     being the lowest bit set in the mask of the comparisons
+ */
+static const char *
+find_sse2(const char *p, const char *end, char a, char b)
+{
+    int mask;
+    __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), v;
+
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+                                              _mm_cmpeq_epi8(v, vb)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return find_scalar(p, end, a, b);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * find_avx2 - Same as find_sse2, 32 bytes at a time, the last ones 16 at a
+ *     time
+ */
+static const char *
+find_avx2(const char *p, const char *end, char a, char b)
+{
+    unsigned int mask;
+    __m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b), v;
+
+    for (; end - p >= 32; p += 32) {
+        v = _mm256_loadu_si256((const __m256i *) p);
+        mask = _mm256_movemask_epi8(_mm256_or_si256(
+                   _mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    /* Not left to the compiler on a tail call: the SSE code would run with
+     * the upper halves dirty, slowed down on every instruction */
+    _mm256_zeroupper();
+#ifdef __SSE2__
+    return find_sse2(p, end, a, b);
+#else
+    return find_scalar(p, end, a, b);
+#endif
+}
+#endif
@@ -0,0 +1,44 @@
+#ifndef _HTTP_H_
+#define _HTTP_H_
+
+#include <stddef.h>
+
+#define HTTP_MAX_HDRS 100           /* Headers a message head may have */
+
+/*
+ * Header of a message head, its slices point into the buffer it was
+ * parsed from: nothing is copied or changed.
+ */
+typedef struct http_hdr {
+    const char *hh_name;        /* Start of the header line too */
+    size_t hh_name_len;
+    const char *hh_value;       /* Without the blanks around it */
+    size_t hh_value_len;
+    size_t hh_size;             /* Bytes of the line with its end */
+} HttpHdr;
+
+typedef struct http_head {
+    const char *hd_line;        /* Request or status line */
+    size_t hd_line_len;         /* Without its end of line */
+    size_t hd_line_size;        /* With its end of line */
+    int hd_nhdrs;
+    HttpHdr hd_hdrs[HTTP_MAX_HDRS];
+    size_t hd_len;              /* Bytes up to the empty line, included */
+} HttpHead;
+
+void
+http_init(void);
+
+size_t
+http_head_end(const char *buf, size_t len);
+
+int
+http_parse_head(const char *buf, size_t len, HttpHead *head);
+
+int
+http_hdr_is(const HttpHdr *hdr, const char *name);
+
+int
+http_has_token(const char *value, size_t len, const char *token);
+
+#endif
@@ -0,0 +1,179 @@
+#define _GNU_SOURCE         /* accept4, CPU affinity */
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "listen.h"
+#include "../proxy_stats/stats.h"
+#include "../socket_interface/interface.h"
+
+static void
+listen_report(FILE *out, void *arg);
+
+static Listener listeners[MAX_LISTENERS];
+static int nlisteners = 1;
+static int defer_secs;
+
+/* Readable once the acceptors have to stop, for good */
+static int stop_fd = -1;
+static atomic_int stopped;
+
+/*
+ * listen_init - Set up n listeners on port: listenfd is the first one and
+ *     the others are opened with SO_REUSEPORT, which listenfd must have been
+ *     opened with too. With more than one, listener i is pinned to the i-th
+ *     CPU the process may run on, wrapping around. Connections wait in the
+ *     kernel until their first bytes arrive, or for defer seconds, if defer
+ *     is positive. Returns the number of listeners, -1 on error.
+ */
+int
+listen_init(int listenfd, char *port, int n, int defer)
+{
+    int cpus[CPU_SETSIZE], ncpus = 0;
+    cpu_set_t set;
+
+    if (n < 1)
+        n = 1;
+    if (n > MAX_LISTENERS)
+        n = MAX_LISTENERS;
+
+    if (n > 1 && sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &set))
+                cpus[ncpus++] = cpu;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (i > 0 && (listenfd = open_listenfd(port, 1)) < 0) {
+            fprintf(stderr, "Can not open listener %d on port %s\n", i, port);
+            return -1;
+        }
+        if (defer > 0 && setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                                    &defer, sizeof(defer)) < 0)
+            perror("TCP_DEFER_ACCEPT");
+        listeners[i].ls_fd = listenfd;
+        listeners[i].ls_cpu = ncpus ? cpus[i % ncpus] : -1;
+        atomic_init(&listeners[i].ls_accepted, 0);
+    }
+    nlisteners = n;
+    defer_secs = defer > 0 ? defer : 0;
+    if ((stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    stats_register("listen", listen_report, NULL);
+    return n;
+}
+
+int
+listen_count(void)
+{
+    return nlisteners;
+}
+
+int
+listen_fd(int i)
+{
+    return listeners[i].ls_fd;
+}
+
+/*
+ * listen_pin - Pin the calling thread to the CPU of listener i. The threads
+ *     it creates afterwards inherit the CPU.
+ */
+void
+listen_pin(int i)
+{
+    cpu_set_t set;
+
+    if (listeners[i].ls_cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(listeners[i].ls_cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/*
+ * listen_wait - Wait until a client may be accepted on listener i, which
+ *     has to be non-blocking: another acceptor, maybe of another process,
+ *     may take the client first. Returns -1 once the acceptors are stopped.
+ */
+int
+listen_wait(int i)
+{
+    struct pollfd fds[2] = {
+        { .fd = listeners[i].ls_fd, .events = POLLIN },
+        { .fd = stop_fd, .events = POLLIN }
+    };
+
+    while (!atomic_load(&stopped)) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            return -1;
+        if (fds[1].revents)
+            return -1;
+        if (fds[0].revents)
+            return 0;
+    }
+    return -1;
+}
+
+/*
+ * listen_accept - Accept a client on listener i, the flags of accept4 are
+ *     set on its descriptor without another call
+ */
+int
+listen_accept(int i, int flags)
+{
+    int connfd;
+
+    if ((connfd = accept4(listeners[i].ls_fd, NULL, NULL, flags)) >= 0)
+        atomic_fetch_add_explicit(&listeners[i].ls_accepted, 1,
+                                  memory_order_relaxed);
+    return connfd;
+}
+
+/*
+ * listen_stop - Stop the acceptors, the ones waiting in listen_wait too:
+ *     the listeners are left to the next generation of the proxy
+ */
+void
+listen_stop(void)
+{
+    uint64_t one = 1;
+
+    atomic_store(&stopped, 1);
+    if (write(stop_fd, &one, sizeof(one)) < 0)
+        perror("listen_stop");
+}
+
+int
+listen_stopped(void)
+{
+    return atomic_load(&stopped);
+}
+
+static void
+listen_report(FILE *out, void *arg)
+{
+    fprintf(out, " listeners=%d defer_accept=%d accepted=", nlisteners,
+            defer_secs);
+    for (int i = 0; i < nlisteners; i++)
+        fprintf(out, "%s%lu", i ? "," : "",
+                atomic_load(&listeners[i].ls_accepted));
+    fprintf(out, " cpus=");
+    for (int i = 0; i < nlisteners; i++) {
+        if (listeners[i].ls_cpu < 0)
+            fprintf(out, "%s-", i ? "," : "");
+        else
+            fprintf(out, "%s%d", i ? "," : "", listeners[i].ls_cpu);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef _LISTEN_H_
+#define _LISTEN_H_
+
+#include <stdatomic.h>
+
+#define MAX_LISTENERS 64    /* Upper bound of listening sockets */
+
+/*
+ * Listening socket of its own for an acceptor. With several of them the
+ * kernel spreads the connections over the sockets bound with SO_REUSEPORT,
+ * so the acceptors share no accept queue, and each is pinned to a CPU of
+ * its own along with the threads serving its clients.
+ */
+typedef struct listener {
+    int ls_fd;
+    int ls_cpu;                     /* -1 if not pinned */
+    atomic_ulong ls_accepted;
+} Listener;
+
+int
+listen_init(int listenfd, char *port, int n, int defer);
+
+int
+listen_count(void);
+
+int
+listen_fd(int i);
+
+void
+listen_pin(int i);
+
+int
+listen_wait(int i);
+
+int
+listen_accept(int i, int flags);
+
+void
+listen_stop(void);
+
+int
+listen_stopped(void);
+
+#endif
@@ -0,0 +1,76 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "notify.h"
+
+/*
+ * notify_open - Get a watcher with a new descriptor. Returns NULL on
+ *     error.
+ */
+NotifyWatcher *
+notify_open(void)
+{
+    NotifyWatcher *nw;
+
+    nw = malloc(sizeof(NotifyWatcher));
+    if ((nw->nw_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        free(nw);
+        return NULL;
+    }
+    return nw;
+}
+
+/*
+ * notify_add - Put the watcher on the list, written to right away if what
+ *     it waits for is already done
+ */
+void
+notify_add(NotifyWatcher **list, NotifyWatcher *nw, int done)
+{
+    uint64_t one = 1;
+
+    if (done)
+        write(nw->nw_fd, &one, sizeof(one));
+    nw->nw_next = *list;
+    *list = nw;
+}
+
+/*
+ * notify_remove - Take the watcher of the descriptor fd off the list and
+ *     return it, to be closed with notify_close
+ */
+NotifyWatcher *
+notify_remove(NotifyWatcher **list, int fd)
+{
+    NotifyWatcher **link, *nw;
+
+    for (link = list; (nw = *link)->nw_fd != fd; )
+        link = &nw->nw_next;
+    *link = nw->nw_next;
+    return nw;
+}
+
+/*
+ * notify_all - Write to the descriptor of every watcher on the list
+ */
+void
+notify_all(NotifyWatcher *list)
+{
+    uint64_t one = 1;
+
+    for (NotifyWatcher *nw = list; nw; nw = nw->nw_next)
+        write(nw->nw_fd, &one, sizeof(one));
+}
+
+/*
+ * notify_close - Close the descriptor of a watcher taken off its list,
+ *     and only then, so notify_all never writes to a reused number
+ */
+void
+notify_close(NotifyWatcher *nw)
+{
+    close(nw->nw_fd);
+    free(nw);
+}
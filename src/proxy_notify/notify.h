@@ -0,0 +1,30 @@
+#ifndef _NOTIFY_H_
+#define _NOTIFY_H_
+
+/*
+ * Non-blocking descriptor written to once something a waiter can not block
+ * for is done, such as a flight landing or a name being resolved. The
+ * module waited on keeps a list of them under its own lock, which every
+ * function but notify_open and notify_close is called with.
+ */
+typedef struct notify_watcher {
+    int nw_fd;
+    struct notify_watcher *nw_next;
+} NotifyWatcher;
+
+NotifyWatcher *
+notify_open(void);
+
+void
+notify_add(NotifyWatcher **list, NotifyWatcher *nw, int done);
+
+NotifyWatcher *
+notify_remove(NotifyWatcher **list, int fd);
+
+void
+notify_all(NotifyWatcher *list);
+
+void
+notify_close(NotifyWatcher *nw);
+
+#endif
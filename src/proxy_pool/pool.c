@@ -0,0 +1,242 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "../proxy_listen/listen.h"
+#include "../proxy_stats/stats.h"
+
+typedef struct worker_arg {
+    Pool *pool;
+    int id;
+} WorkerArg;
+
+static void *
+worker_thread(void *vargp);
+
+static int
+deque_push(Deque *dq, size_t depth, int clientfd);
+
+static int
+deque_pop_front(Deque *dq, size_t depth);
+
+static int
+deque_pop_back(Deque *dq, size_t depth);
+
+static void
+pool_report(FILE *out, void *arg);
+
+/*
+ * pool_init - Start nworkers threads (one per online core if nworkers is
+ *     not positive), each owning a deque of up to depth queued clients.
+ */
+void
+pool_init(Pool *pool, int nworkers, size_t depth, PoolServe serve, void *arg)
+{
+    pthread_t tid;
+    WorkerArg *warg;
+
+    if (nworkers <= 0)
+        nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers <= 0)
+        nworkers = 1;
+    if (depth == 0)
+        depth = DEFAULT_QUEUE_DEPTH;
+
+    pool->p_nworkers = nworkers;
+    pool->p_depth = depth;
+    pool->p_serve = serve;
+    pool->p_arg = arg;
+    atomic_init(&pool->p_next, 0);
+    atomic_init(&pool->p_idle, 0);
+    atomic_init(&pool->p_stopped, 0);
+    atomic_init(&pool->p_queued, 0);
+    atomic_init(&pool->p_stolen, 0);
+    atomic_init(&pool->p_served, 0);
+    sem_init(&pool->p_slots, 0, nworkers * depth);
+    sem_init(&pool->p_tasks, 0, 0);
+
+    pool->p_deques = calloc(nworkers, sizeof(Deque));
+    for (int i = 0; i < nworkers; i++) {
+        pool->p_deques[i].dq_fds = malloc(depth * sizeof(int));
+        pthread_mutex_init(&pool->p_deques[i].dq_mutex, NULL);
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        warg = malloc(sizeof(WorkerArg));
+        warg->pool = pool;
+        warg->id = i;
+        pthread_create(&tid, NULL, worker_thread, warg);
+    }
+
+    stats_register("pool", pool_report, pool);
+}
+
+/*
+ * pool_wait_slot - Block until a client can be queued. Called before
+ *     accept() so a saturated pool leaves clients in the listen backlog.
+ *     Returns -1 once the pool is stopped.
+ */
+int
+pool_wait_slot(Pool *pool)
+{
+    while (sem_wait(&pool->p_slots) < 0)
+        ;   /* Interrupted by a signal */
+
+    /* The wake of pool_stop is passed on to the next acceptor waiting */
+    if (atomic_load(&pool->p_stopped)) {
+        sem_post(&pool->p_slots);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * pool_release_slot - Give back a slot taken by pool_wait_slot() that
+ *     was not used, e.g. because accept() failed.
+ */
+void
+pool_release_slot(Pool *pool)
+{
+    sem_post(&pool->p_slots);
+}
+
+/*
+ * pool_submit - Queue a client on the next deque with room, a slot must
+ *     have been taken with pool_wait_slot() first. The deques of the
+ *     workers pinned along with listener near are tried first.
+ */
+void
+pool_submit(Pool *pool, int near, int clientfd)
+{
+    int idx = -1, stride = listen_count(), ngroup;
+    unsigned int start;
+
+    /* Several acceptors may submit at once */
+    start = atomic_fetch_add_explicit(&pool->p_next, 1, memory_order_relaxed);
+
+    /* Workers near, near + stride, ... share the CPU of listener near */
+    if (near >= 0 && near < pool->p_nworkers) {
+        ngroup = (pool->p_nworkers - near + stride - 1) / stride;
+        for (int i = 0; i < ngroup && idx < 0; i++) {
+            idx = near + (start + i) % ngroup * stride;
+            if (deque_push(&pool->p_deques[idx], pool->p_depth, clientfd) < 0)
+                idx = -1;
+        }
+    }
+
+    /* The slot guarantees that some deque has room */
+    for (unsigned int i = 0; idx < 0; i++) {
+        idx = (start + i) % pool->p_nworkers;
+        if (deque_push(&pool->p_deques[idx], pool->p_depth, clientfd) < 0)
+            idx = -1;
+    }
+
+    atomic_fetch_add(&pool->p_queued, 1);
+    sem_post(&pool->p_tasks);
+}
+
+/*
+ * pool_stop - Get the acceptors out of pool_wait_slot for good, the
+ *     clients queued are still served
+ */
+void
+pool_stop(Pool *pool)
+{
+    atomic_store(&pool->p_stopped, 1);
+    sem_post(&pool->p_slots);
+}
+
+static void *
+worker_thread(void *vargp)
+{
+    int id, clientfd, victim;
+    Pool *pool;
+
+    pool = ((WorkerArg *) vargp)->pool;
+    id = ((WorkerArg *) vargp)->id;
+    free(vargp);
+    pthread_detach(pthread_self());
+    listen_pin(id % listen_count());
+
+    while (1) {
+        atomic_fetch_add(&pool->p_idle, 1);
+        while (sem_wait(&pool->p_tasks) < 0)
+            ;
+        atomic_fetch_sub(&pool->p_idle, 1);
+
+        /* A queued client is waiting somewhere: take the oldest one of
+         * our own deque, else steal the newest one of another worker */
+        clientfd = deque_pop_front(&pool->p_deques[id], pool->p_depth);
+        for (int i = 1; clientfd < 0; i++) {
+            victim = (id + i) % pool->p_nworkers;
+            clientfd = deque_pop_back(&pool->p_deques[victim], pool->p_depth);
+            if (clientfd >= 0 && victim != id)
+                atomic_fetch_add(&pool->p_stolen, 1);
+        }
+
+        atomic_fetch_sub(&pool->p_queued, 1);
+        sem_post(&pool->p_slots);
+
+        pool->p_serve(clientfd, pool->p_arg);
+        atomic_fetch_add(&pool->p_served, 1);
+    }
+    return NULL;
+}
+
+static int
+deque_push(Deque *dq, size_t depth, int clientfd)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&dq->dq_mutex);
+    if (dq->dq_cnt < depth) {
+        dq->dq_fds[(dq->dq_head + dq->dq_cnt) % depth] = clientfd;
+        dq->dq_cnt++;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&dq->dq_mutex);
+    return rc;
+}
+
+static int
+deque_pop_front(Deque *dq, size_t depth)
+{
+    int clientfd = -1;
+
+    pthread_mutex_lock(&dq->dq_mutex);
+    if (dq->dq_cnt > 0) {
+        clientfd = dq->dq_fds[dq->dq_head];
+        dq->dq_head = (dq->dq_head + 1) % depth;
+        dq->dq_cnt--;
+    }
+    pthread_mutex_unlock(&dq->dq_mutex);
+    return clientfd;
+}
+
+static int
+deque_pop_back(Deque *dq, size_t depth)
+{
+    int clientfd = -1;
+
+    pthread_mutex_lock(&dq->dq_mutex);
+    if (dq->dq_cnt > 0) {
+        dq->dq_cnt--;
+        clientfd = dq->dq_fds[(dq->dq_head + dq->dq_cnt) % depth];
+    }
+    pthread_mutex_unlock(&dq->dq_mutex);
+    return clientfd;
+}
+
+static void
+pool_report(FILE *out, void *arg)
+{
+    Pool *pool = arg;
+
+    fprintf(out, " workers=%d depth=%zu idle=%d queued=%lu stolen=%lu served=%lu",
+            pool->p_nworkers, pool->p_depth, atomic_load(&pool->p_idle),
+            atomic_load(&pool->p_queued), atomic_load(&pool->p_stolen),
+            atomic_load(&pool->p_served));
+}
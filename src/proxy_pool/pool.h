@@ -0,0 +1,48 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define DEFAULT_QUEUE_DEPTH 64  /* Queued clients per worker */
+
+typedef void (*PoolServe)(int clientfd, void *arg);
+
+typedef struct deque {
+    int *dq_fds;                /* Ring of client descriptors */
+    size_t dq_head, dq_cnt;
+    pthread_mutex_t dq_mutex;
+} Deque;
+
+typedef struct pool {
+    int p_nworkers;
+    size_t p_depth;
+    Deque *p_deques;            /* One deque per worker */
+    sem_t p_slots;              /* Free queue slots, for backpressure */
+    sem_t p_tasks;              /* Queued clients over all deques */
+    PoolServe p_serve;
+    void *p_arg;
+    atomic_uint p_next;         /* Next deque to submit to */
+    atomic_int p_idle;
+    atomic_int p_stopped;       /* No more clients are submitted */
+    atomic_ulong p_queued, p_stolen, p_served;
+} Pool;
+
+void
+pool_init(Pool *pool, int nworkers, size_t depth, PoolServe serve, void *arg);
+
+int
+pool_wait_slot(Pool *pool);
+
+void
+pool_release_slot(Pool *pool);
+
+void
+pool_submit(Pool *pool, int near, int clientfd);
+
+void
+pool_stop(Pool *pool);
+
+#endif
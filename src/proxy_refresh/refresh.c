@@ -0,0 +1,281 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "refresh.h"
+#include "../proxy_serve/serve.h"
+#include "../proxy_stats/stats.h"
+
+typedef struct refresh_job {
+    CacheEntry *rj_entry;           /* Response refreshed, referenced */
+    char *rj_hostname, *rj_port;
+    char *rj_request_line, *rj_request_hdrs;
+    char *rj_key;
+    size_t rj_key_len;
+    unsigned long rj_tag;           /* Hash of the key */
+    struct refresh_job *rj_next;
+} RefreshJob;
+
+/* Token bucket of a server, refilled at the refresh rate */
+typedef struct refresh_origin {
+    char *ro_hostname, *ro_port;
+    double ro_tokens;
+    double ro_last;                 /* Last refill, 0 if the slot is free */
+} RefreshOrigin;
+
+static void *
+refresh_thread(void *vargp);
+
+static int
+is_scheduled(unsigned long tag, const char *key, size_t key_len);
+
+static int
+same_key(const RefreshJob *job, unsigned long tag, const char *key,
+         size_t key_len);
+
+static int
+take_token(const char *hostname, const char *port);
+
+static double
+now_seconds(void);
+
+static void
+free_job(RefreshJob *job);
+
+static void
+refresh_report(FILE *out, void *arg);
+
+static Cache *cache;
+static double refresh_rate;
+
+/* Jobs waiting, oldest first, and the ones being run */
+static RefreshJob *queue_head, *queue_tail;
+static int nqueued;
+static RefreshJob *running[REFRESH_WORKERS];
+static RefreshOrigin origins[REFRESH_ORIGINS];
+static pthread_mutex_t refresh_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long stale_hits, scheduled, ahead_scheduled, deduped,
+                     throttled, dropped, done, failed;
+
+/*
+ * refresh_init - Start the refresher threads, refreshing the responses
+ *     of each server at most rate times a second
+ */
+void
+refresh_init(Cache *proxy_cache, int rate)
+{
+    pthread_t tid;
+
+    cache = proxy_cache;
+    refresh_rate = rate > 0 ? rate : DEFAULT_REFRESH_RATE;
+    for (long i = 0; i < REFRESH_WORKERS; i++)
+        pthread_create(&tid, NULL, refresh_thread, (void *) i);
+    stats_register("refresh", refresh_report, NULL);
+}
+
+/*
+ * refresh_schedule - Queue a refresh of the cached response in entry,
+ *     fetched with the request a client sent for it. ahead tells a fresh
+ *     hot response from a stale one sent to the client. Returns -1 if the
+ *     refresh is not queued: already queued, queue full or server over
+ *     its rate.
+ */
+int
+refresh_schedule(CacheEntry *entry, const char *hostname, const char *port,
+                 const char *request_line, const char *request_hdrs,
+                 const char *key, size_t key_len, int ahead)
+{
+    unsigned long tag;
+    RefreshJob *job;
+
+    if (!cache)
+        return -1;
+
+    /* Jobs are told apart by key: the entry of a job may be freed, and its
+     * memory reused for another, before the job is done with */
+    tag = cache_hash(key, key_len);
+    pthread_mutex_lock(&refresh_mutex);
+    if (!ahead)
+        stale_hits++;
+
+    /* The clients sent a stale response meanwhile all ask for it */
+    if (is_scheduled(tag, key, key_len)) {
+        deduped++;
+        pthread_mutex_unlock(&refresh_mutex);
+        return -1;
+    }
+    if (nqueued == REFRESH_QUEUE) {
+        dropped++;
+        pthread_mutex_unlock(&refresh_mutex);
+        return -1;
+    }
+    if (take_token(hostname, port) < 0) {
+        throttled++;
+        pthread_mutex_unlock(&refresh_mutex);
+        return -1;
+    }
+
+    job = malloc(sizeof(RefreshJob));
+    job->rj_entry = cache_retain(entry);
+    job->rj_hostname = strdup(hostname);
+    job->rj_port = strdup(port);
+    job->rj_request_line = strdup(request_line);
+    job->rj_request_hdrs = strdup(request_hdrs);
+    job->rj_key = malloc(key_len + 1);
+    memcpy(job->rj_key, key, key_len);
+    job->rj_key[key_len] = '\0';
+    job->rj_key_len = key_len;
+    job->rj_tag = tag;
+    job->rj_next = NULL;
+
+    if (queue_tail)
+        queue_tail->rj_next = job;
+    else
+        queue_head = job;
+    queue_tail = job;
+    nqueued++;
+    scheduled++;
+    if (ahead)
+        ahead_scheduled++;
+    pthread_cond_signal(&refresh_cond);
+    pthread_mutex_unlock(&refresh_mutex);
+    return 0;
+}
+
+static void *
+refresh_thread(void *vargp)
+{
+    int slot = (long) vargp, rc;
+    RefreshJob *job;
+
+    pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&refresh_mutex);
+        while (!queue_head)
+            pthread_cond_wait(&refresh_cond, &refresh_mutex);
+        job = queue_head;
+        if (!(queue_head = job->rj_next))
+            queue_tail = NULL;
+        nqueued--;
+        running[slot] = job;
+        pthread_mutex_unlock(&refresh_mutex);
+
+        /* The reference to the entry goes with it */
+        rc = refresh_cached(cache, job->rj_entry, job->rj_hostname,
+                            job->rj_port, job->rj_request_line,
+                            job->rj_request_hdrs, job->rj_key,
+                            job->rj_key_len);
+
+        pthread_mutex_lock(&refresh_mutex);
+        running[slot] = NULL;
+        if (rc < 0)
+            failed++;
+        else
+            done++;
+        pthread_mutex_unlock(&refresh_mutex);
+        free_job(job);
+    }
+    return NULL;
+}
+
+/*
+ * is_scheduled - Whether the response cached under key is queued or being
+ *     refreshed. Called with refresh_mutex held.
+ */
+static int
+is_scheduled(unsigned long tag, const char *key, size_t key_len)
+{
+    for (RefreshJob *job = queue_head; job; job = job->rj_next) {
+        if (same_key(job, tag, key, key_len))
+            return 1;
+    }
+    for (int i = 0; i < REFRESH_WORKERS; i++) {
+        if (running[i] && same_key(running[i], tag, key, key_len))
+            return 1;
+    }
+    return 0;
+}
+
+static int
+same_key(const RefreshJob *job, unsigned long tag, const char *key,
+         size_t key_len)
+{
+    return job->rj_tag == tag && job->rj_key_len == key_len &&
+           !memcmp(job->rj_key, key, key_len);
+}
+
+/*
+ * take_token - Take a token from the bucket of the server, starting a
+ *     full one in the slot used longest ago if it has none. Returns -1 if
+ *     the bucket is empty. Called with refresh_mutex held.
+ */
+static int
+take_token(const char *hostname, const char *port)
+{
+    int oldest = 0;
+    double now = now_seconds();
+    RefreshOrigin *origin = NULL;
+
+    for (int i = 0; i < REFRESH_ORIGINS; i++) {
+        if (origins[i].ro_last && !strcmp(origins[i].ro_hostname, hostname)
+            && !strcmp(origins[i].ro_port, port)) {
+            origin = &origins[i];
+            break;
+        }
+        if (origins[i].ro_last < origins[oldest].ro_last)
+            oldest = i;
+    }
+
+    if (!origin) {
+        origin = &origins[oldest];
+        free(origin->ro_hostname);
+        free(origin->ro_port);
+        origin->ro_hostname = strdup(hostname);
+        origin->ro_port = strdup(port);
+        origin->ro_tokens = refresh_rate;
+    } else {
+        origin->ro_tokens += (now - origin->ro_last) * refresh_rate;
+        if (origin->ro_tokens > refresh_rate)
+            origin->ro_tokens = refresh_rate;
+    }
+    origin->ro_last = now;
+
+    if (origin->ro_tokens < 1)
+        return -1;
+    origin->ro_tokens--;
+    return 0;
+}
+
+static double
+now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+free_job(RefreshJob *job)
+{
+    free(job->rj_hostname);
+    free(job->rj_port);
+    free(job->rj_request_line);
+    free(job->rj_request_hdrs);
+    free(job->rj_key);
+    free(job);
+}
+
+static void
+refresh_report(FILE *out, void *arg)
+{
+    pthread_mutex_lock(&refresh_mutex);
+    fprintf(out, " queued=%d stale_hits=%lu scheduled=%lu ahead=%lu "
+            "deduped=%lu throttled=%lu dropped=%lu done=%lu failed=%lu",
+            nqueued, stale_hits, scheduled, ahead_scheduled, deduped,
+            throttled, dropped, done, failed);
+    pthread_mutex_unlock(&refresh_mutex);
+}
@@ -0,0 +1,30 @@
+#ifndef _REFRESH_H_
+#define _REFRESH_H_
+
+#include "../proxy_cache/cache.h"
+
+#define REFRESH_QUEUE           256     /* Most refreshes waiting */
+#define REFRESH_WORKERS         2       /* Threads fetching them */
+#define REFRESH_ORIGINS         64      /* Servers whose refreshes are limited */
+#define DEFAULT_REFRESH_RATE    10      /* Refreshes a second per server */
+#define REFRESH_AHEAD_PCT       10      /* Hot responses are refreshed in the
+                                         * last 10% of their lifetime, */
+#define REFRESH_HOT_HITS        3       /* ... once hit this often in it */
+#define REFRESH_AHEAD_QUEUED    0x80000000U /* Set in the hits of an
+                                             * entry once it is queued */
+
+/*
+ * The refresher fetches cached responses again in the background: stale
+ * ones sent to clients meanwhile, and hot ones about to expire. Its queue
+ * holds a response once, and each server gets at most rate refreshes a
+ * second.
+ */
+void
+refresh_init(Cache *proxy_cache, int rate);
+
+int
+refresh_schedule(CacheEntry *entry, const char *hostname, const char *port,
+                 const char *request_line, const char *request_hdrs,
+                 const char *key, size_t key_len, int ahead);
+
+#endif
@@ -0,0 +1,421 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "restart.h"
+#include "../proxy_disk/disk.h"
+#include "../proxy_stats/stats.h"
+
+#define RESTART_MAGIC 0x70787932    /* Starts the hello and the region */
+#define RESTART_ALIGN 64            /* Entries start on a cache line */
+
+/* Sent along with the listening socket to the next generation */
+typedef struct restart_hello {
+    uint32_t rh_magic;
+    uint32_t rh_generation;         /* Of the next generation */
+    char rh_name[64];               /* Shared memory region of the cache */
+} RestartHello;
+
+/* Start of the region, every offset is from here */
+typedef struct restart_image {
+    uint32_t ri_magic;
+    size_t ri_count;                /* Entries */
+    size_t ri_index;                /* Offset of the offsets of the entries */
+    size_t ri_used;
+} RestartImage;
+
+/* The region the entries are copied to while the cache is walked */
+typedef struct restart_copy {
+    char *rc_base;
+    size_t rc_size, rc_used;
+    size_t *rc_offsets;
+    size_t rc_count, rc_max;
+} RestartCopy;
+
+static void *
+restart_thread(void *vargp);
+
+static void *
+early_thread(void *vargp);
+
+static int
+hand_off(int fd);
+
+static int
+export_cache(const char *name);
+
+static void
+export_entry(const CacheEntry *entry, void *arg);
+
+static void
+restore_cache(const char *name);
+
+static int
+open_control(const char *path, struct sockaddr_un *addr);
+
+static double
+elapsed_ms(const struct timespec *since);
+
+static void
+restart_report(FILE *out, void *arg);
+
+static Cache *cache;
+static int listen_fd, control_fd = -1;
+static RestartStop stop;
+static unsigned int generation = 1;
+static struct timespec started;
+static double startup_ms, export_ms, restore_ms;
+static size_t restored, restored_bytes, skipped;
+static atomic_int handed_off, early_done;
+static unsigned long early_hits, early_misses;
+
+/*
+ * restart_takeover - Take over the listening socket and the cache of the
+ *     generation of the proxy answering at path. Returns the listening
+ *     socket, or -1 if there is no generation to take over.
+ */
+int
+restart_takeover(const char *path, Cache *proxy_cache)
+{
+    int fd, listenfd;
+    char ack = 0, control[CMSG_SPACE(sizeof(int))];
+    RestartHello hello;
+    struct sockaddr_un addr;
+    struct iovec iov = { &hello, sizeof(hello) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    cache = proxy_cache;
+    if ((fd = open_control(path, &addr)) < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello) ||
+        hello.rh_magic != RESTART_MAGIC ||
+        !(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "Restart: bad hello from %s\n", path);
+        close(fd);
+        return -1;
+    }
+    memcpy(&listenfd, CMSG_DATA(cmsg), sizeof(int));
+    hello.rh_name[sizeof(hello.rh_name) - 1] = '\0';
+    generation = hello.rh_generation;
+
+    restore_cache(hello.rh_name);
+    shm_unlink(hello.rh_name);
+
+    /* The old generation lets go of its disk file before answering */
+    if (write(fd, &ack, 1) != 1 || read(fd, &ack, 1) != 1)
+        fprintf(stderr, "Restart: %s did not confirm\n", path);
+    close(fd);
+    return listenfd;
+}
+
+/*
+ * restart_serve - Answer the next generation at path, which stops this
+ *     one accepting with stop_accepting. Reports the time it took to get
+ *     here since restart_takeover, and the hit ratio of the first
+ *     RESTART_EARLY seconds from here.
+ */
+void
+restart_serve(const char *path, Cache *proxy_cache, int listenfd,
+              RestartStop stop_accepting)
+{
+    pthread_t tid;
+    struct sockaddr_un addr;
+
+    startup_ms = elapsed_ms(&started);
+    cache = proxy_cache;
+    listen_fd = listenfd;
+    stop = stop_accepting;
+    stats_register("restart", restart_report, NULL);
+    pthread_create(&tid, NULL, early_thread, NULL);
+
+    if ((control_fd = open_control(path, &addr)) < 0)
+        return;
+    unlink(path);
+    if (bind(control_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(control_fd, 1) < 0) {
+        perror(path);
+        close(control_fd);
+        return;
+    }
+    pthread_create(&tid, NULL, restart_thread, NULL);
+}
+
+static void *
+restart_thread(void *vargp)
+{
+    int fd;
+
+    pthread_detach(pthread_self());
+    while (1) {
+        if ((fd = accept(control_fd, NULL, NULL)) < 0)
+            continue;
+        if (hand_off(fd) == 0)
+            break;
+        close(fd);
+    }
+    close(fd);
+    close(control_fd);
+
+    /* Clients accepted so far are served, then the process is done */
+    atomic_store(&handed_off, 1);
+    stop();
+    sleep(RESTART_DRAIN);
+    exit(0);
+}
+
+/*
+ * early_thread - Keep the hits and the misses of the first RESTART_EARLY
+ *     seconds of serving, to tell a restored cache from a cold one
+ */
+static void *
+early_thread(void *vargp)
+{
+    pthread_detach(pthread_self());
+    sleep(RESTART_EARLY);
+    cache_counts(cache, &early_hits, &early_misses);
+    atomic_store(&early_done, 1);
+    return NULL;
+}
+
+/*
+ * hand_off - Copy the cache to a shared memory region and send its name
+ *     with the listening socket. The next generation acknowledges once it
+ *     restored the cache. Returns -1 if it did not.
+ */
+static int
+hand_off(int fd)
+{
+    int rc;
+    char ack, control[CMSG_SPACE(sizeof(int))];
+    struct timespec start;
+    RestartHello hello;
+    struct iovec iov = { &hello, sizeof(hello) };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+
+    memset(&hello, 0, sizeof(hello));
+    hello.rh_magic = RESTART_MAGIC;
+    hello.rh_generation = generation + 1;
+    snprintf(hello.rh_name, sizeof(hello.rh_name), "/proxy-%d-%u",
+             (int) getpid(), generation);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (export_cache(hello.rh_name) < 0)
+        return -1;
+    export_ms = elapsed_ms(&start);
+
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+    rc = sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(hello) &&
+         read(fd, &ack, 1) == 1 ? 0 : -1;
+    /* Already gone if the next generation got that far */
+    shm_unlink(hello.rh_name);
+    if (rc < 0)
+        return -1;
+
+    disk_detach();
+    write(fd, &ack, 1);
+    return 0;
+}
+
+/*
+ * export_cache - Copy every entry of the cache, with its data and key, to
+ *     a new shared memory region, followed by the offsets of the entries.
+ *     The region is sized for three times the cache, its pages are only
+ *     taken as they are written.
+ */
+static int
+export_cache(const char *name)
+{
+    int fd;
+    RestartCopy copy;
+    RestartImage *image;
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        perror(name);
+        return -1;
+    }
+    memset(&copy, 0, sizeof(copy));
+    copy.rc_size = RESTART_ALIGN + 3 * cache->max_size;
+    if (ftruncate(fd, copy.rc_size) < 0 ||
+        (copy.rc_base = mmap(NULL, copy.rc_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror(name);
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    close(fd);
+
+    copy.rc_used = RESTART_ALIGN;
+    cache_walk(cache, export_entry, &copy);
+
+    image = (RestartImage *) copy.rc_base;
+    image->ri_magic = RESTART_MAGIC;
+    image->ri_count = 0;
+    image->ri_index = copy.rc_used;
+    if (copy.rc_used + copy.rc_count * sizeof(size_t) <= copy.rc_size) {
+        memcpy(copy.rc_base + copy.rc_used, copy.rc_offsets,
+               copy.rc_count * sizeof(size_t));
+        image->ri_count = copy.rc_count;
+    }
+    image->ri_used = copy.rc_used + image->ri_count * sizeof(size_t);
+
+    free(copy.rc_offsets);
+    munmap(copy.rc_base, copy.rc_size);
+    return 0;
+}
+
+static void
+export_entry(const CacheEntry *entry, void *arg)
+{
+    RestartCopy *copy = arg;
+    size_t bytes = sizeof(CacheEntry) + entry->len + entry->key_len;
+
+    if (copy->rc_used + bytes > copy->rc_size)
+        return;
+    if (copy->rc_count == copy->rc_max) {
+        copy->rc_max = copy->rc_max ? 2 * copy->rc_max : 1024;
+        copy->rc_offsets = realloc(copy->rc_offsets,
+                                   copy->rc_max * sizeof(size_t));
+    }
+    memcpy(copy->rc_base + copy->rc_used, entry, bytes);
+    copy->rc_offsets[copy->rc_count++] = copy->rc_used;
+    copy->rc_used = (copy->rc_used + bytes + RESTART_ALIGN - 1)
+                    & ~(RESTART_ALIGN - 1);
+}
+
+/*
+ * restore_cache - Cache every entry of the region exported by the old
+ *     generation, checking the offsets stay within it
+ */
+static void
+restore_cache(const char *name)
+{
+    int fd;
+    char *base;
+    size_t size, off, *offsets;
+    struct stat st;
+    struct timespec start;
+    const RestartImage *image;
+    const CacheEntry *saved;
+    CacheEntry *entry;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+        perror(name);
+        return;
+    }
+    if (fstat(fd, &st) < 0 || (size = st.st_size) < sizeof(RestartImage) ||
+        (base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0))
+        == MAP_FAILED) {
+        perror(name);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    image = (const RestartImage *) base;
+    if (image->ri_magic != RESTART_MAGIC || image->ri_index > size ||
+        image->ri_count > (size - image->ri_index) / sizeof(size_t)) {
+        fprintf(stderr, "Restart: bad cache image %s\n", name);
+        munmap(base, size);
+        return;
+    }
+
+    offsets = (size_t *) (base + image->ri_index);
+    for (size_t i = 0; i < image->ri_count; i++) {
+        off = offsets[i];
+        saved = (const CacheEntry *) (base + off);
+        if (off < RESTART_ALIGN || off + sizeof(CacheEntry) > size ||
+            saved->len > size || saved->key_len > size ||
+            off + sizeof(CacheEntry) + saved->len + saved->key_len > size) {
+            skipped++;
+            continue;
+        }
+        if ((entry = cache_restore(cache, saved))) {
+            restored++;
+            restored_bytes += entry->size;
+            cache_release(entry);
+        } else {
+            skipped++;
+        }
+    }
+
+    munmap(base, size);
+    restore_ms = elapsed_ms(&start);
+}
+
+static int
+open_control(const char *path, struct sockaddr_un *addr)
+{
+    int fd;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Restart: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        perror("socket");
+    return fd;
+}
+
+static double
+elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3
+           + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+static void
+restart_report(FILE *out, void *arg)
+{
+    unsigned long hits = early_hits, misses = early_misses;
+
+    /* Counted so far while the first seconds are not over */
+    if (!atomic_load(&early_done))
+        cache_counts(cache, &hits, &misses);
+    fprintf(out, " generation=%u startup_ms=%.1f restored=%zu "
+            "restored_bytes=%zu skipped=%zu restore_ms=%.1f export_ms=%.1f "
+            "early_hits=%lu early_misses=%lu early_hit_ratio=%.1f%% "
+            "handed_off=%d", generation, startup_ms, restored, restored_bytes,
+            skipped, restore_ms, export_ms, hits, misses,
+            hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+            atomic_load(&handed_off));
+}
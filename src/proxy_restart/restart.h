@@ -0,0 +1,29 @@
+#ifndef _RESTART_H_
+#define _RESTART_H_
+
+#include "../proxy_cache/cache.h"
+
+#define RESTART_DRAIN   10      /* Seconds the old generation serves on */
+#define RESTART_EARLY   10      /* Seconds the early hit ratio covers */
+
+typedef void (*RestartStop)(void);
+
+/*
+ * Hot restart: a new generation of the proxy asks the running one, over a
+ * unix socket, for its listening socket and a copy of its cache. The cache
+ * is laid out in a named shared memory region, with offsets rather than
+ * pointers, and restored from there. The old generation then stops
+ * accepting and exits once its clients had the time to be served.
+ *
+ * The region is a snapshot taken at the handoff, not a cache both
+ * generations share: what the old generation writes while it drains is
+ * lost, and the handoff takes longer as the cache grows.
+ */
+int
+restart_takeover(const char *path, Cache *cache);
+
+void
+restart_serve(const char *path, Cache *cache, int listenfd,
+              RestartStop stop_accepting);
+
+#endif
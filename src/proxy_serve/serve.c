@@ -1,71 +1,187 @@
+#define _GNU_SOURCE         /* strptime */
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "serve.h"
+#include "../proxy_arena/arena.h"
+#include "../proxy_disk/disk.h"
+#include "../proxy_http/http.h"
+#include "../proxy_refresh/refresh.h"
+#include "../proxy_upstream/upstream.h"
 #include "../safe_io/sio.h"
 #include "../socket_interface/interface.h"
 
-#define USED_HDRS_SIZE 130
+/* Cache-Control directives of a request or a response */
+typedef struct cache_control {
+    int cc_present;             /* There is a Cache-Control header */
+    int cc_no_store, cc_no_cache, cc_private, cc_public, cc_must_revalidate;
+    long cc_max_age, cc_s_maxage, cc_min_fresh;     /* -1 if not given */
+    long cc_stale_while_revalidate;
+} CacheControl;
+
+/* What a cached response is good for, to a request */
+enum entry_state {
+    ENTRY_FRESH,        /* Sent as it is */
+    ENTRY_REFRESH,      /* Stale, sent while it is refreshed */
+    ENTRY_STALE         /* Revalidated or fetched again first */
+};
 
 static int
-parse_request_line(Sio *sio, char *method, char *url);
+read_head(Sio *sio, HttpHead *head);
 
-static void
-parse_url(const char *url, char *hostname, char *port, char *path);
+static int
+parse_request_line(int clientfd, const HttpHead *head, char *method,
+                   char *url, char *version);
 
 static int
-parse_request_hdrs(Sio *sio, char *request_hdrs, char *hostname);
+parse_url(const char *url, char *hostname, char *port, char *path);
 
 static void
-build_request_line(const Request *request, char *request_line);
+split_host(const char *authority, size_t n, char *hostname, char *port);
+
+static char *
+parse_request_hdrs(const HttpHead *head, Arena *arena, char *hostname,
+                   char *port, int *keep_alive);
+
+static size_t
+normalize_path(const char *path, char *out);
+
+static size_t
+remove_dot_segments(char *path, size_t n);
+
+static int
+find_hdr(const char *hdrs, const char *name, char *value);
+
+static int
+get_vary(const char *response_hdrs, char *vary);
 
 static void
-build_request_hdrs(const Request *request, char *request_hdrs);
+parse_cache_control(const char *hdrs, CacheControl *cc);
+
+static time_t
+parse_http_date(const char *value);
+
+static int
+response_freshness(const char *request_hdrs, const char *response_line,
+                   const char *response_hdrs, time_t now,
+                   const Cache *proxy_cache, time_t *date, time_t *expires,
+                   time_t *stale_until);
+
+static enum entry_state
+entry_state(const CacheEntry *entry, const char *request_hdrs, time_t now);
+
+static int
+schedule_refresh(CacheEntry *entry, const Request *client_request,
+                 const char *request_hdrs, const char *key, size_t key_len,
+                 int ahead);
+
+static char *
+entry_head(const CacheEntry *entry);
+
+static int
+has_validators(const CacheEntry *entry);
+
+static size_t
+filter_hdrs(const char *hdrs, const char *skip, char *out, size_t len);
+
+static size_t
+vary_key(char *key, size_t key_len, const char *vary,
+         const char *request_hdrs);
+
+static char *
+build_request_line(const Request *request);
+
+static char *
+build_request_hdrs(const Request *request);
+
+static int
+is_hop_by_hop(const char *hdr_line);
+
+static int
+fetch_response(Response *response);
+
+static int
+relay_content(int clientfd, Response *response, char *head, size_t head_len);
+
+static int
+splice_content(int clientfd, Response *response);
 
 static int
-parse_response(int connfd, Response *response);
+read_content(Response *response);
 
-static ssize_t
-parse_response_hdrs(Sio *sio, char *response_hdrs);
+static char *
+parse_response_hdrs(const HttpHead *head, Arena *arena, Response *response);
 
 static void
 client_error(int clientfd, char *cause, char *errnum,
              char *short_msg, char *long_msg);
 
-static void
-strtolwr(char *str);
+static int splice_enabled = 1;
+static int zerocopy_enabled;
 
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:98.0) Gecko/20100101 Firefox/98.0\r\n";
-static const char *proxy_conn_hdr = "Proxy-Connection: close\r\n";
-static const char *conn_hdr = "Connection: close\r\n";
+static const char *conn_hdr = "Connection: keep-alive\r\n";
+static const char *close_hdr = "Connection: close\r\n\r\n";
+
+/* Headers that only concern a single connection, never forwarded */
+static const char *hop_by_hop_hdrs[] = {
+    "Connection:", "Proxy-Connection:", "Keep-Alive:", "TE:", "Trailer:",
+    "Transfer-Encoding:", "Upgrade:", NULL
+};
 
 int
-parse_request(int clientfd, Request *client_request)
+parse_request(Sio *sio, Request *client_request)
 {
-    Sio sio;
-    char method[METHOD_LEN], url[MAX_LINE],
-    hostname[MAX_LINE], port[PORT_LEN], path[MAX_LINE], request_hdrs[MAX_BUF];
-
-    /* Initialize safe read buffer associated with the clinetfd */
-    sio_initbuf(&sio, clientfd);
-
-    if (parse_request_line(&sio, method, url) < 0)
+    int keep_alive;
+    char method[METHOD_LEN], url[MAX_LINE], version[VERSION_LEN],
+    hostname[MAX_LINE], port[PORT_LEN], path[MAX_LINE], *request_hdrs;
+    HttpHead head;
+
+    if (read_head(sio, &head) < 0) {
+        if (errno == EBADMSG || errno == ENOBUFS)
+            client_error(sio->sio_fd, "", "400", "Bad request",
+                         "Request head could not be parsed");
+        return -1;
+    }
+    if (parse_request_line(sio->sio_fd, &head, method, url, version) < 0)
         return -1;
 
-    parse_url(url, hostname, port, path);
+    if (parse_url(url, hostname, port, path) < 0) {
+        client_error(sio->sio_fd, url, "400", "Bad request",
+                     "Proxy could not parse the URL");
+        return -1;
+    }
 
-    if (parse_request_hdrs(&sio, request_hdrs, hostname) < 0)
+    /* HTTP/1.1 connections persist unless the client asks to close them,
+     * HTTP/1.0 ones only if it asks to keep them */
+    keep_alive = !strcmp(version, "HTTP/1.1");
+    request_hdrs = parse_request_hdrs(&head, client_request->rq_arena,
+                                      hostname, port, &keep_alive);
+    if (!hostname[0]) {
+        client_error(sio->sio_fd, url, "400", "Bad request",
+                     "Request does not name a host");
         return -1;
+    }
+
+    /* The head was parsed in the buffer, what follows it is left there */
+    sio_consume(sio, head.hd_len);
 
     /* Build the client request struct */
-    client_request->rq_method = strdup(method);
-    client_request->rq_hostname = strdup(hostname);
-    client_request->rq_port = strdup(port);
-    client_request->rq_path = strdup(path);
-    client_request->rq_hdrs = strdup(request_hdrs);
+    client_request->rq_method = arena_strdup(client_request->rq_arena, method);
+    client_request->rq_hostname = arena_strdup(client_request->rq_arena,
+                                               hostname);
+    client_request->rq_port = arena_strdup(client_request->rq_arena, port);
+    client_request->rq_path = arena_strdup(client_request->rq_arena, path);
+    client_request->rq_hdrs = request_hdrs;
+    client_request->rq_http11 = !strcmp(version, "HTTP/1.1");
+    client_request->rq_keep_alive = keep_alive;
 
     return 0;
 }
@@ -74,89 +190,917 @@ int
 forward_client_request(const Request *client_request, Cache *proxy_cache,
                        Response *server_response)
 {
-    int connfd, is_cached;
-    char request_line[MAX_LINE], request_hdrs[MAX_BUF];
+    int leader;
+    Flight *flight;
+    size_t key_len;
+    char *request_line, *request_hdrs, key[CACHE_KEY_SIZE];
+
+    build_server_request(client_request, &request_line, &request_hdrs);
+    key_len = build_cache_key(client_request, key);
+
+    server_response->rs_entry = fetch_fresh(proxy_cache, client_request,
+                                            request_hdrs, key, key_len,
+                                            &server_response->rs_stale);
+
+    /* Of the clients missing the same response only one fetches it, the
+     * others wait for it to reach the cache. They fetch it themselves if
+     * it does not, or takes too long. */
+    if (!server_response->rs_entry) {
+        flight = flight_join(key, &leader);
+        if (leader) {
+            server_response->rs_flight = flight;
+            /* The last flight may have landed right before this one */
+            if ((server_response->rs_entry =
+                 fetch_fresh(proxy_cache, client_request, request_hdrs,
+                             key, key_len, &server_response->rs_stale)))
+                land_flight(server_response);
+        } else if (flight_wait(flight) == 0) {
+            server_response->rs_entry =
+                fetch_fresh(proxy_cache, client_request, request_hdrs,
+                            key, key_len, &server_response->rs_stale);
+        }
+    }
+
+    if (!server_response->rs_entry) {
+        /* A stale response is sent again only if the server has no newer
+         * one */
+        if (server_response->rs_stale)
+            request_hdrs = add_validators(server_response->rs_stale,
+                                          client_request->rq_arena,
+                                          request_hdrs);
+
+        /* Keep the key to cache the response under and the server to give
+         * the connection back to */
+        server_response->rs_request_line = request_line;
+        server_response->rs_request_hdrs = request_hdrs;
+        server_response->rs_key = arena_strndup(server_response->rs_arena,
+                                                key, key_len);
+        server_response->rs_key_len = key_len;
+        server_response->rs_hostname = client_request->rq_hostname;
+        server_response->rs_port = client_request->rq_port;
+
+        /* Send the request, the body of the response is relayed later */
+        if (fetch_response(server_response) < 0)
+            return -1;
+        if (server_response->rs_stale &&
+            revalidate(server_response, proxy_cache)) {
+            release_server(server_response);
+            return 0;
+        }
 
+        /* Copy the response while relaying it to add it to the cache */
+        tee_init(server_response, proxy_cache);
+    } 
+
+    return 0;
+}
+
+int
+forward_server_response(int clientfd, const Request *client_request,
+                        Response *server_response)
+{
+    int iovcnt;
+    ssize_t rc;
+    char *head;
+    size_t head_len;
+    struct iovec iov[CACHED_IOVS];
+    CacheEntry *entry = server_response->rs_entry;
+
+    /* A cached response goes out in one go, straight from the cache */
+    if (entry) {
+        iovcnt = build_cached_iov(client_request, server_response, iov);
+        if (zerocopy_enabled && entry->len - entry->head_len >=
+                                SIO_ZEROCOPY_MIN)
+            rc = sio_sendzc(clientfd, iov, iovcnt,
+                            get_client_timeouts()->ct_write_ms);
+        else
+            rc = sio_sendv(clientfd, iov, iovcnt, 0);
+    } else {
+        /* Stream the body from the server, after the head */
+        head = build_client_head(client_request, server_response, &head_len);
+        rc = relay_content(clientfd, server_response, head, head_len);
+    }
+    if (rc < 0)
+        return -1;
+
+    sio_response_sent();
+    return 0;
+}
+
+/*
+ * build_server_request - Build the request line and headers sent to the
+ *     server, in the arena of the request
+ */
+void
+build_server_request(const Request *client_request, char **request_line,
+                     char **request_hdrs)
+{
     /* Build the HTTP request line to be sent to the server */
-    build_request_line(client_request, request_line);
+    *request_line = build_request_line(client_request);
     /* Build the HTTP request headers to be sent to the server */
-    build_request_hdrs(client_request, request_hdrs);
-
-    is_cached = cache_fetch(proxy_cache, request_line, request_hdrs, 
-                            &server_response->rs_line, &server_response->rs_hdrs, 
-                            &server_response->rs_content, 
-                            &server_response->rs_content_length);
-
-    if (!is_cached) {
-        /* Establish TCP connection with the server */
-        connfd = open_clientfd(client_request->rq_hostname, 
-                               client_request->rq_port);
-        if (connfd < 0)
-            return -1;
+    *request_hdrs = build_request_hdrs(client_request);
+}
 
-        /* Send the http request to the server */
-        if (sio_writen(connfd, request_line, strlen(request_line)) < 0)
-            return -1;
-        if (sio_writen(connfd, request_hdrs, strlen(request_hdrs)) < 0)
-            return -1;
+/*
+ * build_cache_key - Build the key a response to the request is cached
+ *     under: its method and URL, with the host in lower case, the port
+ *     always given and the path normalized. The request headers only take
+ *     part through Vary, see fetch_cached. Returns the key length.
+ */
+size_t
+build_cache_key(const Request *client_request, char *key)
+{
+    size_t len;
+
+    len = sprintf(key, "%s http://", client_request->rq_method);
+    for (const char *p = client_request->rq_hostname; *p; p++)
+        key[len++] = tolower((unsigned char) *p);
+    if (key[len - 1] == '.')    /* Fully qualified name */
+        len--;
+    len += sprintf(key + len, ":%s", client_request->rq_port);
+    len += normalize_path(client_request->rq_path, key + len);
+    key[len] = '\0';
+    return len;
+}
 
-        /* Parse the server's response */
-        if (parse_response(connfd, server_response) < 0)
-            return -1;
+/*
+ * fetch_cached - Find the response cached under key, in memory or else on
+ *     disk. If it varies, the entry there names the request headers whose
+ *     values extend the key it is really cached under.
+ */
+CacheEntry *
+fetch_cached(Cache *proxy_cache, const char *key, size_t key_len,
+             const char *request_hdrs)
+{
+    size_t vary_len;
+    char vary[MAX_LINE], vkey[CACHE_KEY_SIZE];
+    CacheEntry *entry;
+
+    if (!(entry = cache_fetch(proxy_cache, key, key_len)))
+        entry = disk_fetch(key, key_len);
+    if (!entry || !entry->vary)
+        return entry;
+
+    vary_len = entry->len < MAX_LINE ? entry->len : MAX_LINE - 1;
+    memcpy(vary, entry->data, vary_len);
+    vary[vary_len] = '\0';
+    cache_release(entry);
+
+    memcpy(vkey, key, key_len);
+    if (!(key_len = vary_key(vkey, key_len, vary, request_hdrs)))
+        return NULL;
+    if (!(entry = cache_fetch(proxy_cache, vkey, key_len)))
+        entry = disk_fetch(vkey, key_len);
+    return entry;
+}
 
-        /* Add the response to the cache */
-        cache_write(proxy_cache, request_line, request_hdrs,
-                            server_response->rs_line, server_response->rs_hdrs, 
-                            server_response->rs_content, 
-                            server_response->rs_content_length);
+/*
+ * fetch_fresh - Find the response cached under key if it can answer the
+ *     request as it is. A stale one within its stale window is sent too,
+ *     while the refresher fetches it again; a hot one close to its expiry
+ *     is refreshed ahead of time. Any other stale one that the server can
+ *     tell is still current is kept in stale instead, replacing the one
+ *     there.
+ */
+CacheEntry *
+fetch_fresh(Cache *proxy_cache, const Request *client_request,
+            const char *request_hdrs, const char *key, size_t key_len,
+            CacheEntry **stale)
+{
+    time_t now = time(NULL), ahead;
+    unsigned int hits;
+    CacheEntry *entry;
+
+    if (*stale)
+        cache_release(*stale);
+    *stale = NULL;
+
+    if (!(entry = fetch_cached(proxy_cache, key, key_len, request_hdrs)))
+        return NULL;
+
+    switch (entry_state(entry, request_hdrs, now)) {
+    case ENTRY_FRESH:
+        ahead = (entry->expires - entry->date) * REFRESH_AHEAD_PCT / 100;
+        if (entry->expires - now > (ahead > 0 ? ahead : 1))
+            return entry;
+
+        /* Tried again on the next hits while the server is over its rate
+         * or the queue is full, until the refresh is queued */
+        hits = atomic_fetch_add_explicit(&entry->ahead_hits, 1,
+                                         memory_order_relaxed) + 1;
+        if (hits >= REFRESH_HOT_HITS && !(hits & REFRESH_AHEAD_QUEUED) &&
+            schedule_refresh(entry, client_request, request_hdrs, key,
+                             key_len, 1) == 0)
+            atomic_fetch_or_explicit(&entry->ahead_hits, REFRESH_AHEAD_QUEUED,
+                                     memory_order_relaxed);
+        return entry;
+    case ENTRY_REFRESH:
+        schedule_refresh(entry, client_request, request_hdrs, key, key_len,
+                         0);
+        return entry;
+    default:
+        if (has_validators(entry))
+            *stale = entry;
+        else
+            cache_release(entry);
+        return NULL;
+    }
+}
 
-        /* Close the connection with the server after parsing the response */
-        close(connfd);
-    } 
+/*
+ * add_validators - Make the request conditional on the validators of the
+ *     stale response, if there is one. The conditions of the client are
+ *     about its own copy, they are dropped so the server sends a newer
+ *     response whole. Returns the new headers, allocated from arena.
+ */
+char *
+add_validators(const CacheEntry *stale, Arena *arena,
+               const char *request_hdrs)
+{
+    int etag = -1, modified = -1;
+    size_t len = 0, line_len;
+    const char *line;
+    char *head, *hdrs, etag_value[MAX_LINE], modified_value[MAX_LINE];
+
+    if (stale) {
+        head = entry_head(stale);
+        etag = find_hdr(head, "ETag", etag_value);
+        modified = find_hdr(head, "Last-Modified", modified_value);
+        free(head);
+    }
+    hdrs = arena_alloc(arena, strlen(request_hdrs) + 48 +
+                       (etag == 0 ? strlen(etag_value) : 0) +
+                       (modified == 0 ? strlen(modified_value) : 0));
+
+    /* The blank line ending the headers is written again after them */
+    for (line = request_hdrs; *line; line += line_len) {
+        line_len = strcspn(line, "\n");
+        line_len += line[line_len] == '\n';
+        if (!strncasecmp(line, "If-None-Match:", 14) ||
+            !strncasecmp(line, "If-Modified-Since:", 18) ||
+            !strcmp(line, "\r\n"))
+            continue;
+        memcpy(hdrs + len, line, line_len);
+        len += line_len;
+    }
 
-    return 0;
+    if (etag == 0)
+        len += sprintf(hdrs + len, "If-None-Match: %s\r\n", etag_value);
+    if (modified == 0)
+        len += sprintf(hdrs + len, "If-Modified-Since: %s\r\n",
+                       modified_value);
+    strcpy(hdrs + len, "\r\n");
+    return hdrs;
 }
 
+/*
+ * revalidate - Handle the response to a request add_validators made
+ *     conditional. A 304 means the stale response is current: it is cached
+ *     again with the headers of the 304 and becomes the response, the
+ *     server connection is done then and 1 is returned. Returns 0 if the
+ *     server sent a new response to relay.
+ */
 int
-forward_server_response(int clientfd, const Response *server_response)
+revalidate(Response *response, Cache *proxy_cache)
 {
-    if (sio_writen(clientfd, server_response->rs_line,
-                   strlen(server_response->rs_line)) < 0)
-        return -1;
+    int status = response->rs_status;
+    time_t date, expires, stale_until;
+    char *head, *line_end, *hdrs;
+    struct iovec body;
+    CacheEntry *stale = response->rs_stale;
+
+    response->rs_stale = NULL;
+    cache_revalidated(proxy_cache, stale, status == 304);
+    if (status != 304) {
+        cache_release(stale);
+        return 0;
+    }
+    response->rs_body_state = BODY_DONE;
+
+    /* The stored headers are updated with the ones of the 304 */
+    head = entry_head(stale);
+    line_end = head + strcspn(head, "\n");
+    line_end += *line_end == '\n';
+    hdrs = arena_alloc(response->rs_arena,
+                       strlen(line_end) + strlen(response->rs_hdrs) + 1);
+    filter_hdrs(response->rs_hdrs, "", hdrs,
+                filter_hdrs(line_end, response->rs_hdrs, hdrs, 0));
+    *line_end = '\0';
+
+    if (response_freshness(response->rs_request_hdrs, head, hdrs, time(NULL),
+                           proxy_cache, &date, &expires, &stale_until) == 0) {
+        body.iov_base = stale->data + stale->head_len;
+        body.iov_len = stale->len - stale->head_len;
+        cache_write(proxy_cache, stale->data + stale->len, stale->key_len,
+                    head, hdrs, &body, 1, date, expires, stale_until);
+        response->rs_entry = cache_lookup(proxy_cache,
+                                          stale->data + stale->len,
+                                          stale->key_len);
+    }
+    free(head);
+
+    /* The stale response is still right, if not cached again */
+    if (response->rs_entry)
+        cache_release(stale);
+    else
+        response->rs_entry = stale;
+    land_flight(response);
+    return 1;
+}
 
-    if (sio_writen(clientfd, server_response->rs_hdrs,
-                   strlen(server_response->rs_hdrs)) < 0)
+/*
+ * refresh_cached - Fetch the response cached in entry again for the
+ *     refresher, with no client waiting for it: it is revalidated if it
+ *     has validators, else a new one is read whole and cached. Takes over
+ *     the reference to entry. Returns -1 if the server failed.
+ */
+int
+refresh_cached(Cache *proxy_cache, CacheEntry *entry, const char *hostname,
+               const char *port, const char *request_line,
+               const char *request_hdrs, const char *key, size_t key_len)
+{
+    int rc = 0;
+    Request request;
+    Response response;
+    Arena arena;
+
+    arena_start(&arena);
+    init_resources(&request, &response, &arena);
+    if (has_validators(entry))
+        response.rs_stale = entry;
+    else
+        cache_release(entry);
+
+    response.rs_request_line = arena_strdup(&arena, request_line);
+    response.rs_request_hdrs = add_validators(response.rs_stale, &arena,
+                                              request_hdrs);
+    response.rs_key = arena_strndup(&arena, key, key_len);
+    response.rs_key_len = key_len;
+    response.rs_hostname = hostname;
+    response.rs_port = port;
+
+    if (fetch_response(&response) < 0) {
+        rc = -1;
+    } else if (!response.rs_stale || !revalidate(&response, proxy_cache)) {
+        tee_init(&response, proxy_cache);
+        rc = read_content(&response);
+    }
+    release_server(&response);
+    free_resources(&request, &response);
+    arena_free(&arena);
+    return rc;
+}
+
+/*
+ * build_client_head - Build the response line and headers sent to the
+ *     client, framing the body so the client connection can be kept open
+ *     when the client wants it. Returns a head of len bytes, allocated from
+ *     the arena of the response.
+ */
+char *
+build_client_head(const Request *client_request, Response *server_response,
+                  size_t *len)
+{
+    int status = server_response->rs_status;
+    char *head, linebuf[MAX_LINE];
+
+    server_response->rs_client_close = !client_request->rq_keep_alive;
+    server_response->rs_chunk_out = 0;
+
+    if (status / 100 == 1 || status == 204 || status == 304) {
+        /* These responses never have a body */
+        linebuf[0] = '\0';
+    } else if (server_response->rs_body_state == BODY_LENGTH) {
+        sprintf(linebuf, "Content-Length: %zu\r\n",
+                server_response->rs_body_left);
+    } else if (client_request->rq_http11) {
+        /* The length is unknown until the server is done */
+        strcpy(linebuf, "Transfer-Encoding: chunked\r\n");
+        server_response->rs_chunk_out = 1;
+    } else {
+        /* Only closing the connection ends the body */
+        linebuf[0] = '\0';
+        server_response->rs_client_close = 1;
+    }
+    strcat(linebuf, server_response->rs_client_close ?
+                    "Connection: close\r\n\r\n" :
+                    "Connection: keep-alive\r\n\r\n");
+
+    *len = strlen(server_response->rs_line) + strlen(server_response->rs_hdrs)
+           + strlen(linebuf);
+    head = arena_alloc(server_response->rs_arena, *len + 1);
+    strcpy(head, server_response->rs_line);
+    strcat(head, server_response->rs_hdrs);
+    strcat(head, linebuf);
+    return head;
+}
+
+/*
+ * build_cached_iov - Point iov at the cached response of server_response
+ *     as it goes to the client, with its current Age added. The entry is
+ *     framed for a client keeping its connection; for the others its
+ *     Connection header is swapped. Returns the number of buffers, at
+ *     most CACHED_IOVS.
+ */
+int
+build_cached_iov(const Request *client_request, Response *server_response,
+                 struct iovec *iov)
+{
+    long age;
+    CacheEntry *entry = server_response->rs_entry;
+
+    age = time(NULL) - entry->date;
+    sprintf(server_response->rs_age_hdr, "Age: %ld\r\n", age > 0 ? age : 0);
+    iov[0].iov_base = entry->data;
+    iov[0].iov_len = entry->conn_off;
+    iov[1].iov_base = server_response->rs_age_hdr;
+    iov[1].iov_len = strlen(server_response->rs_age_hdr);
+
+    server_response->rs_client_close = !client_request->rq_keep_alive;
+    if (!server_response->rs_client_close) {
+        iov[2].iov_base = entry->data + entry->conn_off;
+        iov[2].iov_len = entry->len - entry->conn_off;
+        return 3;
+    }
+
+    iov[2].iov_base = (void *) close_hdr;
+    iov[2].iov_len = strlen(close_hdr);
+    iov[3].iov_base = entry->data + entry->head_len;
+    iov[3].iov_len = entry->len - entry->head_len;
+    return 4;
+}
+
+int
+parse_response_head(Sio *sio, Response *response)
+{
+    int status;
+    const char *line;
+    HttpHead head;
+
+    if (read_head(sio, &head) < 0)
         return -1;
 
-    if (sio_writen(clientfd, server_response->rs_content,
-                   server_response->rs_content_length) < 0)
+    /* Parse response line, "HTTP/x.y nnn reason" */
+    line = head.hd_line;
+    if (head.hd_line_len < 12 || strncmp(line, "HTTP/", 5) ||
+        !isdigit((unsigned char) line[5]) || line[6] != '.' ||
+        !isdigit((unsigned char) line[7]) || line[8] != ' ' ||
+        !isdigit((unsigned char) line[9]) ||
+        !isdigit((unsigned char) line[10]) ||
+        !isdigit((unsigned char) line[11]))
         return -1;
+    status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + line[11] - '0';
+    response->rs_line = arena_strndup(response->rs_arena, line,
+                                      head.hd_line_size);
+    response->rs_status = status;
+
+    /* HTTP/1.0 servers close the connection unless asked to keep it */
+    response->rs_server_close = !strncmp(line, "HTTP/1.0", 8);
+
+    /* Parse response headrs and the framing of the body */
+    response->rs_hdrs = parse_response_hdrs(&head, response->rs_arena,
+                                            response);
+    sio_consume(sio, head.hd_len);
+
+    /* These responses never have a body */
+    if (status / 100 == 1 || status == 204 || status == 304) {
+        response->rs_body_state = BODY_LENGTH;
+        response->rs_body_left = 0;
+    }
+    if (response->rs_body_state == BODY_EOF)
+        response->rs_server_close = 1;
+
+    return 0;
+}
 
+/*
+ * body_span - Find the next body bytes in the unread part of the server
+ *     buffer, going through the chunk framing. Returns 1 with their length
+ *     in len, 0 if more input is needed or the body is done (rs_body_state
+ *     is BODY_DONE), -1 on malformed framing.
+ */
+int
+body_span(Response *response, size_t *len)
+{
+    char *eol, *end;
+    size_t line_len;
+    Sio *sio = response->rs_server_sio;
+
+    while (1) {
+        switch (response->rs_body_state) {
+        case BODY_LENGTH:
+        case BODY_CHUNK_DATA:
+            if (response->rs_body_left == 0) {
+                response->rs_body_state =
+                    response->rs_body_state == BODY_LENGTH ? BODY_DONE
+                                                           : BODY_CHUNK_END;
+                continue;
+            }
+            if (sio->sio_cnt <= 0)
+                return 0;
+            *len = sio->sio_cnt;
+            if (*len > response->rs_body_left)
+                *len = response->rs_body_left;
+            return 1;
+
+        case BODY_EOF:
+            if (sio->sio_cnt <= 0)
+                return 0;
+            *len = sio->sio_cnt;
+            return 1;
+
+        case BODY_DONE:
+            return 0;
+
+        default:    /* A framing line of a chunked body */
+            if (sio->sio_cnt <= 0)
+                return 0;
+            if (!(eol = memchr(sio->sio_bufptr, '\n', sio->sio_cnt)))
+                return sio->sio_cnt < BUF_PAGE_SIZE ? 0 : -1;
+            line_len = eol - sio->sio_bufptr + 1;
+
+            if (response->rs_body_state == BODY_CHUNK_SIZE) {
+                response->rs_body_left = strtoul(sio->sio_bufptr, &end, 16);
+                if (end == sio->sio_bufptr)
+                    return -1;
+                response->rs_body_state = response->rs_body_left ?
+                                          BODY_CHUNK_DATA : BODY_TRAILER;
+            } else if (line_len > 2 ||
+                       (line_len == 2 && *sio->sio_bufptr != '\r')) {
+                /* Trailer fields are dropped, a chunk must end with CRLF */
+                if (response->rs_body_state == BODY_CHUNK_END)
+                    return -1;
+            } else {
+                response->rs_body_state =
+                    response->rs_body_state == BODY_CHUNK_END ? BODY_CHUNK_SIZE
+                                                              : BODY_DONE;
+            }
+            sio_consume(sio, line_len);
+        }
+    }
+}
+
+/*
+ * body_consume - Drop len body bytes relayed from the server buffer
+ */
+void
+body_consume(Response *response, size_t len)
+{
+    sio_consume(response->rs_server_sio, len);
+    if (response->rs_body_state != BODY_EOF)
+        response->rs_body_left -= len;
+}
+
+/*
+ * body_eof - The server closed the connection, which only ends a body
+ *     that is delimited by EOF. Returns -1 if the body was truncated.
+ */
+int
+body_eof(Response *response)
+{
+    if (response->rs_body_state != BODY_EOF)
+        return -1;
+    response->rs_body_state = BODY_DONE;
     return 0;
 }
 
+/*
+ * gather_body - Add the next len body bytes of the server buffer to the
+ *     iovcnt buffers of iov, framed as a chunk with size_line if the body
+ *     is chunked for the client, and drop them from the buffer: they stay
+ *     in its page until written. Returns the number of buffers, at most 3
+ *     more.
+ */
+int
+gather_body(Response *response, struct iovec *iov, int iovcnt,
+            char *size_line, size_t len)
+{
+    Sio *sio = response->rs_server_sio;
+
+    if (response->rs_chunk_out) {
+        iov[iovcnt].iov_base = size_line;
+        iov[iovcnt++].iov_len = sprintf(size_line, "%zx\r\n", len);
+    }
+    iov[iovcnt].iov_base = sio->sio_bufptr;
+    iov[iovcnt++].iov_len = len;
+    if (response->rs_chunk_out) {
+        iov[iovcnt].iov_base = "\r\n";
+        iov[iovcnt++].iov_len = 2;
+    }
+
+    tee_content(response, len);
+    body_consume(response, len);
+    return iovcnt;
+}
+
+/*
+ * gather_end - Add the last chunk to iov once a body chunked for the
+ *     client is done. Returns the number of buffers.
+ */
+int
+gather_end(Response *response, struct iovec *iov, int iovcnt)
+{
+    if (response->rs_body_state != BODY_DONE || !response->rs_chunk_out)
+        return iovcnt;
+
+    response->rs_chunk_out = 0;
+    iov[iovcnt].iov_base = "0\r\n\r\n";
+    iov[iovcnt++].iov_len = 5;
+    return iovcnt;
+}
+
+/*
+ * release_server - Give the server connection back to the upstream pool
+ *     if its response was read completely and the server keeps it open
+ */
+void
+release_server(Response *response)
+{
+    Sio *sio = response->rs_server_sio;
+
+    if (!sio || response->rs_body_state != BODY_DONE ||
+        response->rs_server_close || sio->sio_cnt > 0)
+        return;
+
+    if (response->rs_reused)
+        upstream_reused();
+    sio_release(sio);
+    upstream_checkin(response->rs_hostname, response->rs_port, sio->sio_fd);
+    response->rs_server_sio = NULL;
+}
+
+/*
+ * init_resources - Clear a request and its response before serving it,
+ *     their strings and buffers are allocated from arena
+ */
+void
+init_resources(Request *request, Response *response, Arena *arena)
+{
+    memset(request, 0, sizeof(*request));
+    memset(response, 0, sizeof(*response));
+    request->rq_arena = arena;
+    response->rs_arena = arena;
+}
+
+/*
+ * free_resources - Release what a request and its response hold outside
+ *     of their arena, then reset it for the next request
+ */
+void
+free_resources(Request *request, Response *response)
+{
+    buf_chain_release(&response->rs_content);
+
+    if (response->rs_server_sio) {
+        sio_release(response->rs_server_sio);
+        close(response->rs_server_sio->sio_fd);
+    }
+
+    if (response->rs_entry)
+        cache_release(response->rs_entry);
+
+    if (response->rs_stale)
+        cache_release(response->rs_stale);
+
+    land_flight(response);
+    arena_reset(request->rq_arena);
+}
+
+/*
+ * tee_init - Prepare to keep the body that is about to be relayed, so
+ *     the response can be cached once relayed completely. Responses that
+ *     can not fit in a cache object, or must not be cached, are not
+ *     kept.
+ */
+void
+tee_init(Response *response, Cache *proxy_cache)
+{
+    size_t head_len;
+    char vary[MAX_LINE];
+
+    /* The clients waiting for a response that is not cached fetch it */
+    head_len = strlen(response->rs_line) + strlen(response->rs_hdrs);
+    if (head_len > proxy_cache->max_object ||
+        get_vary(response->rs_hdrs, vary) < 0 ||
+        response_freshness(response->rs_request_hdrs, response->rs_line,
+                           response->rs_hdrs, time(NULL), proxy_cache,
+                           &response->rs_date, &response->rs_expires,
+                           &response->rs_stale_until) < 0) {
+        land_flight(response);
+        return;
+    }
+    if (response->rs_body_state == BODY_LENGTH &&
+        response->rs_body_left > proxy_cache->max_object - head_len) {
+        land_flight(response);
+        return;
+    }
+    response->rs_cache = proxy_cache;
+}
+
+/*
+ * set_splice - Turn splicing the bodies that are not cached on or off
+ */
+void
+set_splice(int enabled)
+{
+    splice_enabled = enabled;
+}
+
+/*
+ * set_zerocopy - Turn sending large cached bodies from the cache, without
+ *     copying them to the socket, on or off
+ */
+void
+set_zerocopy(int enabled)
+{
+    zerocopy_enabled = enabled;
+}
+
+/*
+ * zerocopy_client - Let the kernel send from the cache to the client, if
+ *     zerocopy is on. It is turned off if the kernel does not support it.
+ */
+void
+zerocopy_client(int clientfd)
+{
+    int on = 1;
+
+    if (zerocopy_enabled &&
+        setsockopt(clientfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0)
+        zerocopy_enabled = 0;
+}
+
+/*
+ * splice_ok - Whether the rest of the body can be spliced from the server
+ *     to the client as it is: it is large or of unknown length, not cached
+ *     nor chunked, and none of it is buffered
+ */
+int
+splice_ok(const Response *response)
+{
+    if (!splice_enabled || response->rs_cache || response->rs_chunk_out ||
+        response->rs_server_sio->sio_cnt > 0)
+        return 0;
+    return response->rs_body_state == BODY_EOF ||
+           (response->rs_body_state == BODY_LENGTH &&
+            response->rs_body_left >= SPLICE_MIN);
+}
+
+/*
+ * tee_content - Keep the next n body bytes of the server buffer, about to
+ *     be relayed, in the page they were read into. They are dropped if the
+ *     response outgrows a cache object.
+ */
+void
+tee_content(Response *response, size_t n)
+{
+    size_t object_size;
+    Sio *sio = response->rs_server_sio;
+
+    if (!response->rs_cache)
+        return;
+
+    object_size = strlen(response->rs_line) + strlen(response->rs_hdrs)
+                  + response->rs_content.bc_len + n;
+    if (object_size > response->rs_cache->max_object) {
+        buf_chain_release(&response->rs_content);
+        response->rs_cache = NULL;
+        land_flight(response);
+        return;
+    }
+
+    buf_chain_append(&response->rs_content, response->rs_arena,
+                     sio->sio_page, sio->sio_bufptr, n);
+}
+
+/*
+ * tee_finish - Add the completely relayed response to the cache, its body
+ *     copied once from the pages it was kept in. One with a Vary header
+ *     goes under its key extended with the values of the headers it names,
+ *     which are noted under the plain key.
+ */
+void
+tee_finish(Response *response)
+{
+    size_t key_len;
+    char *hdrs, vary[MAX_LINE], key[CACHE_KEY_SIZE];
+    struct iovec *content;
+
+    if (!response->rs_cache)
+        return;
+    content = buf_chain_iov(&response->rs_content, response->rs_arena);
+
+    /* The Age of the response is added when it is sent from the cache */
+    hdrs = arena_alloc(response->rs_arena, strlen(response->rs_hdrs) + 1);
+    filter_hdrs(response->rs_hdrs, "", hdrs, 0);
+
+    if (get_vary(hdrs, vary) > 0) {
+        memcpy(key, response->rs_key, response->rs_key_len);
+        if ((key_len = vary_key(key, response->rs_key_len, vary,
+                                response->rs_request_hdrs))) {
+            cache_write_vary(response->rs_cache, response->rs_key,
+                             response->rs_key_len, vary);
+            cache_write(response->rs_cache, key, key_len, response->rs_line,
+                        hdrs, content, response->rs_content.bc_nslices,
+                        response->rs_date, response->rs_expires,
+                        response->rs_stale_until);
+        }
+    } else {
+        cache_write(response->rs_cache, response->rs_key,
+                    response->rs_key_len, response->rs_line, hdrs, content,
+                    response->rs_content.bc_nslices, response->rs_date,
+                    response->rs_expires, response->rs_stale_until);
+    }
+    buf_chain_release(&response->rs_content);
+    response->rs_cache = NULL;
+    land_flight(response);
+}
+
+/*
+ * land_flight - Let the clients waiting for the response look for it in
+ *     the cache, if this one fetches it for them
+ */
+void
+land_flight(Response *response)
+{
+    if (!response->rs_flight)
+        return;
+
+    flight_land(response->rs_flight);
+    response->rs_flight = NULL;
+}
+
+/*
+ * read_head - Read from sio until its buffer holds a whole message head and
+ *     split it into slices of the buffer. Returns -1 on EOF or error, with
+ *     errno set to EBADMSG if the head is malformed and to ENOBUFS if it
+ *     does not fit in the buffer.
+ */
 static int
-parse_request_line(Sio *sio, char *method, char *url)
+read_head(Sio *sio, HttpHead *head)
 {
-    char version[VERSION_LEN], request_line[MAX_LINE];
+    ssize_t n;
 
-    if (sio_read_line(sio, request_line, MAX_LINE) < 0)
+    while (!http_head_end(sio->sio_bufptr, sio->sio_cnt)) {
+        if ((n = sio_fill(sio)) <= 0) {
+            if (n == 0)
+                errno = 0;
+            return -1;
+        }
+    }
+    if (http_parse_head(sio->sio_bufptr, sio->sio_cnt, head) <= 0) {
+        errno = EBADMSG;
         return -1;
+    }
+    return 0;
+}
 
-    if (sscanf(request_line, "%s %s %s", method, url, version) != 3) {
-        client_error(sio->sio_fd, request_line, "400", "Bad request",
+/*
+ * parse_request_line - Split the request line, "method url version", each
+ *     copied out of the buffer
+ */
+static int
+parse_request_line(int clientfd, const HttpHead *head, char *method,
+                   char *url, char *version)
+{
+    size_t method_len, url_len, version_len;
+    const char *line = head->hd_line, *end = line + head->hd_line_len,
+          *url_start, *version_start;
+    char request_line[MAX_LINE];
+
+    method_len = version_len = url_len = 0;
+    if ((url_start = memchr(line, ' ', end - line))) {
+        method_len = url_start++ - line;
+        if ((version_start = memchr(url_start, ' ', end - url_start))) {
+            url_len = version_start++ - url_start;
+            version_len = end - version_start;
+        }
+    }
+
+    if (method_len == 0 || method_len >= METHOD_LEN || url_len == 0 ||
+        url_len >= MAX_LINE || version_len == 0 ||
+        version_len >= VERSION_LEN) {
+        snprintf(request_line, sizeof(request_line), "%.*s",
+                 (int) head->hd_line_len, line);
+        client_error(clientfd, request_line, "400", "Bad request",
                      "Request could not be understood by the proxy server");
         return -1;
     }
+    memcpy(method, line, method_len);
+    method[method_len] = '\0';
+    memcpy(url, url_start, url_len);
+    url[url_len] = '\0';
+    memcpy(version, version_start, version_len);
+    version[version_len] = '\0';
 
     if (strcmp(method, "GET")) {
-        client_error(sio->sio_fd, method, "501", "Not implemented",
+        client_error(clientfd, method, "501", "Not implemented",
                      "Server does not support the request method");
         return -1;
     }
 
     if (strcmp(version, "HTTP/1.0") && strcmp(version, "HTTP/1.1")) {
-        client_error(sio->sio_fd, method, "505", "HTTP version not supported",
+        client_error(clientfd, method, "505", "HTTP version not supported",
                      "Server does not support version in request");
         return -1;
     }
@@ -164,187 +1108,871 @@ parse_request_line(Sio *sio, char *method, char *url)
     return 0;
 }
 
-static void
+/*
+ * parse_url - Split an absolute URL into hostname, port and path, which
+ *     keeps the query. A path alone, as sent to an origin server, leaves
+ *     the hostname to the Host header. Returns -1 if it is neither.
+ */
+static int
 parse_url(const char *url, char *hostname, char *port, char *path)
 {
-    char *url_copy, *url_token;
-
-    url_copy = strdup(url);
-    url_token = url_copy;
-
-    /* Skip the "http://" part of the url */
-    url_token = strstr(url, "://");
-    url_token += 3;
-
-    if (strstr(url_token, ":")) {     /* Port is contained in the url */
-        /* Url token points to the hostname */
-        url_token = strtok(url_token, ":");
-        strcpy(hostname, url_token);
-        
-        /* Move url token to the port and path token */
-        url_token = strtok(NULL, ":");
-
-        if (strstr(url_token, "/")) {   /* Path is contained in the url */
-            /* Parse the port from url_token */
-            url_token = strtok(url_token, "/");  
-            strcpy(port, url_token);
-
-            /* Parse the path from url_token */
-            url_token = strtok(NULL, "/");
-            strcpy(path, url_token);
-        } else {                        /* Path is not contained in the url */
-            strcpy(port, url_token);
-            strcpy(path, "/");  /* Set path to default */
+    size_t n;
+    const char *authority;
+
+    hostname[0] = '\0';
+    strcpy(port, "80");
+    if (url[0] == '/') {
+        strcpy(path, url);
+        return 0;
+    }
+
+    if (strncasecmp(url, "http://", 7))
+        return -1;
+    authority = url + 7;
+    n = strcspn(authority, "/?#");
+    split_host(authority, n, hostname, port);
+
+    if (authority[n] == '/')
+        strcpy(path, authority + n);
+    else                        /* Path is set to default */
+        sprintf(path, "/%s", authority + n);
+    return hostname[0] ? 0 : -1;
+}
+
+/*
+ * split_host - Split the n bytes of an authority, "host" or "host:port"
+ *     with any "user@" in front dropped, into hostname and port
+ */
+static void
+split_host(const char *authority, size_t n, char *hostname, char *port)
+{
+    const char *at, *colon;
+    size_t host_len;
+
+    if ((at = memchr(authority, '@', n))) {
+        n -= at + 1 - authority;
+        authority = at + 1;
+    }
+    colon = memchr(authority, ':', n);
+    host_len = colon ? colon - authority : n;
+    if (host_len >= MAX_LINE)
+        host_len = MAX_LINE - 1;
+    memcpy(hostname, authority, host_len);
+    hostname[host_len] = '\0';
+
+    /* Port is set to default if it is not in the authority */
+    if (colon && n - host_len > 1 && n - host_len - 1 < PORT_LEN) {
+        memcpy(port, colon + 1, n - host_len - 1);
+        port[n - host_len - 1] = '\0';
+    } else {
+        strcpy(port, "80");
+    }
+}
+
+/*
+ * parse_request_hdrs - Copy the header lines of the request, ending with
+ *     an empty line, to a string allocated from arena. The Host header
+ *     names the server only if the URL did not.
+ */
+static char *
+parse_request_hdrs(const HttpHead *head, Arena *arena, char *hostname,
+                   char *port, int *keep_alive)
+{
+    size_t len = 0;
+    char *request_hdrs;
+    const HttpHdr *hdr;
+
+    request_hdrs = arena_alloc(arena, head->hd_len + 3);
+    for (int i = 0; i < head->hd_nhdrs; i++) {
+        hdr = &head->hd_hdrs[i];
+        if (http_hdr_is(hdr, "host") && !hostname[0])
+            split_host(hdr->hh_value, hdr->hh_value_len, hostname, port);
+        if (http_hdr_is(hdr, "connection") ||
+            http_hdr_is(hdr, "proxy-connection")) {
+            if (http_has_token(hdr->hh_value, hdr->hh_value_len, "close"))
+                *keep_alive = 0;
+            else if (http_has_token(hdr->hh_value, hdr->hh_value_len,
+                                    "keep-alive"))
+                *keep_alive = 1;
         }
 
-    } else {    /* Port is not contained in the url */
-        strcpy(port, "80");     /* Set port to default */
+        /* A request body is not read, so the next request can not be
+         * found after it */
+        if (http_hdr_is(hdr, "content-length") ||
+            http_hdr_is(hdr, "transfer-encoding"))
+            *keep_alive = 0;
+        memcpy(request_hdrs + len, hdr->hh_name, hdr->hh_size);
+        len += hdr->hh_size;
+    }
+    memcpy(request_hdrs + len, "\r\n", 3);
 
-        url_token = strtok(url_token, "/");
-        strcpy(hostname, url_token);
+    return request_hdrs;
+}
 
-        url_token = strtok(NULL, "/");
+static char *
+build_request_line(const Request *request)
+{
+    char *request_line;
+
+    request_line = arena_alloc(request->rq_arena, strlen(request->rq_method)
+                               + strlen(request->rq_path) + 12);
+    sprintf(request_line, "%s %s HTTP/1.1\r\n", request->rq_method,
+            request->rq_path);
+    return request_line;
+}
 
-        if (url_token)          /* Path is contained in the url */
-            strcpy(path, url_token);
-        else                    /* Path is not contained in the url */
-         strcpy(path, "/");     /* Path is set to default */
+static char *
+build_request_hdrs(const Request *request)
+{
+    char *request_hdrs;
+    const char *line, *next;
+    size_t len = 0;
+
+    request_hdrs = arena_alloc(request->rq_arena, strlen(request->rq_hdrs)
+                               + strlen(request->rq_hostname) + 9
+                               + strlen(user_agent_hdr) + strlen(conn_hdr));
+
+    /* Append Host header if it does not exist in request headers */
+    if (!strstr(request->rq_hdrs, "Host: "))
+        len = sprintf(request_hdrs, "Host: %s\r\n", request->rq_hostname);
+    len += sprintf(request_hdrs + len, "%s%s", user_agent_hdr, conn_hdr);
+
+    /* Append the client headers except the ones about its connection */
+    for (line = request->rq_hdrs; *line; line = next) {
+        next = strchr(line, '\n');
+        next = next ? next + 1 : line + strlen(line);
+        if (is_hop_by_hop(line))
+            continue;
+        memcpy(request_hdrs + len, line, next - line);
+        len += next - line;
     }
-    free(url_copy);
+    request_hdrs[len] = '\0';
+    return request_hdrs;
 }
 
 static int
-parse_request_hdrs(Sio *sio, char *request_hdrs, char *hostname)
+is_hop_by_hop(const char *hdr_line)
 {
-    ssize_t nread = MAX_BUF - USED_HDRS_SIZE;
-    char hdr_linebuf[MAX_LINE], hostnamebuf[MAX_LINE];
+    for (int i = 0; hop_by_hop_hdrs[i]; i++) {
+        if (!strncasecmp(hdr_line, hop_by_hop_hdrs[i],
+                         strlen(hop_by_hop_hdrs[i])))
+            return 1;
+    }
+    return 0;
+}
 
-    /* Initialize request_hdrs to be ready for appending (concatination) */
-    request_hdrs[0] = '\0';
-    do {
-        if (sio_read_line(sio, hdr_linebuf, MAX_LINE) < 0)
+/*
+ * fetch_response - Send the request to the server, on an idle connection
+ *     of the upstream pool if there is one, and parse the response head.
+ *     The body is left in the server buffer to be relayed.
+ */
+static int
+fetch_response(Response *response)
+{
+    int connfd;
+    struct iovec iov[2];
+
+    while (1) {
+        response->rs_reused = 1;
+        connfd = upstream_checkout(response->rs_hostname, response->rs_port);
+        if (connfd < 0) {
+            /* Establish TCP connection with the server */
+            response->rs_reused = 0;
+            connfd = open_clientfd((char *) response->rs_hostname,
+                                   (char *) response->rs_port);
+            if (connfd < 0)
+                return -1;
+        }
+
+        /* The server buffer owns connfd from now on */
+        response->rs_server_sio = arena_alloc(response->rs_arena,
+                                              sizeof(Sio));
+        sio_initbuf(response->rs_server_sio, connfd);
+
+        iov[0].iov_base = response->rs_request_line;
+        iov[0].iov_len = strlen(response->rs_request_line);
+        iov[1].iov_base = response->rs_request_hdrs;
+        iov[1].iov_len = strlen(response->rs_request_hdrs);
+        if (sio_sendv(connfd, iov, 2, 0) >= 0 &&
+            parse_response_head(response->rs_server_sio, response) >= 0)
+            return 0;
+
+        /* The server may close an idle connection right when it is
+         * reused, then the request is sent again on a new connection */
+        if (!response->rs_reused || response->rs_line)
+            return -1;
+        sio_release(response->rs_server_sio);
+        close(connfd);
+        response->rs_server_sio = NULL;
+    }
+}
+
+/*
+ * relay_content - Stream the body from the server to the client through
+ *     the server read buffer, so memory use does not depend on body size.
+ *     The head goes out with the body bytes read along with it, and the
+ *     chunks buffered at once with one another.
+ */
+static int
+relay_content(int clientfd, Response *response, char *head, size_t head_len)
+{
+    int rc, iovcnt = 1, nchunks = 0;
+    ssize_t n;
+    size_t len;
+    char size_lines[RELAY_IOVS / 3][SIZE_LINE_LEN];
+    struct iovec iov[RELAY_IOVS];
+    Sio *sio = response->rs_server_sio;
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = head_len;
+
+    while (1) {
+        if ((rc = body_span(response, &len)) < 0)
+            return -1;
+        if (rc == 1 && iovcnt + 4 <= RELAY_IOVS) {
+            iovcnt = gather_body(response, iov, iovcnt, size_lines[nchunks],
+                                 len);
+            nchunks += response->rs_chunk_out;
+            continue;
+        }
+        iovcnt = gather_end(response, iov, iovcnt);
+
+        if (iovcnt > 0) {
+            /* Written before the buffer is read over. The last packet
+             * waits for the body bytes that did not fit, or for the
+             * spliced ones. */
+            if (sio_sendv(clientfd, iov, iovcnt, rc == 1 ||
+                          (rc == 0 && response->rs_body_state != BODY_DONE &&
+                           splice_ok(response)) ? MSG_MORE : 0) < 0)
+                return -1;
+            iovcnt = nchunks = 0;
+            continue;
+        }
+        if (response->rs_body_state == BODY_DONE)
+            break;
+
+        /* Wait for more of the body. Once the buffered bytes are relayed,
+         * the rest of a body that is not cached goes through the kernel
+         * alone */
+        if (splice_ok(response)) {
+            if (splice_content(clientfd, response) < 0)
+                return -1;
+            continue;
+        }
+        if ((n = sio_fill(sio)) < 0)
             return -1;
-        if (sscanf(hdr_linebuf, "Host: %s", hostnamebuf) == 1)
-            strcpy(hostname, hostnamebuf);
-        strncat(request_hdrs, hdr_linebuf, nread);
-        nread -= strlen(hdr_linebuf);
-    } while (strcmp(hdr_linebuf, "\r\n") && nread > 0);
+        if (n == 0 && body_eof(response) < 0)
+            return -1;      /* Truncated by the server */
+    }
 
+    tee_finish(response);
+    release_server(response);
     return 0;
 }
 
-static void
-build_request_line(const Request *request, char *request_line)
+/*
+ * splice_content - Move the rest of the body from the server to the client
+ *     through a pipe, until the server closes the connection or the length
+ *     of the body is reached
+ */
+static int
+splice_content(int clientfd, Response *response)
+{
+    int rc = 0, pipefd[2];
+    ssize_t n;
+    size_t want;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+        return -1;
+
+    while (response->rs_body_state == BODY_EOF || response->rs_body_left) {
+        want = SPLICE_SIZE;
+        if (response->rs_body_state == BODY_LENGTH &&
+            want > response->rs_body_left)
+            want = response->rs_body_left;
+        if ((n = sio_splice(response->rs_server_sio->sio_fd, pipefd[1], want,
+                            SPLICE_F_MOVE)) <= 0) {
+            rc = n < 0 ? -1 : body_eof(response);
+            break;
+        }
+        /* The last bytes of the body are not held for more */
+        if (sio_splicen(pipefd[0], clientfd, n, SPLICE_F_MOVE |
+                        (response->rs_body_state == BODY_LENGTH &&
+                         response->rs_body_left == (size_t) n ?
+                         0 : SPLICE_F_MORE)) < 0) {
+            rc = -1;
+            break;
+        }
+        if (response->rs_body_state == BODY_LENGTH)
+            response->rs_body_left -= n;
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return rc;
+}
+
+/*
+ * read_content - Read the body from the server into the cache copy alone,
+ *     giving up once the copy is dropped
+ */
+static int
+read_content(Response *response)
 {
-    request_line[0] = '\0';
-    strcat(request_line, request->rq_method);
-    strcat(request_line, " ");
+    int rc;
+    ssize_t n;
+    size_t len;
+    Sio *sio = response->rs_server_sio;
 
-    strcat(request_line, request->rq_path);
-    strcat(request_line, " ");
+    while (response->rs_cache) {
+        if ((rc = body_span(response, &len)) < 0)
+            return -1;
+        if (response->rs_body_state == BODY_DONE)
+            break;
+
+        if (rc == 0) {          /* Wait for more of the body */
+            if ((n = sio_fill(sio)) < 0)
+                return -1;
+            if (n == 0 && body_eof(response) < 0)
+                return -1;      /* Truncated by the server */
+            continue;
+        }
+        tee_content(response, len);
+        body_consume(response, len);
+    }
 
-    strcat(request_line, "HTTP/1.0\r\n");
+    tee_finish(response);
+    return 0;
 }
 
-static void
-build_request_hdrs(const Request *request, char *request_hdrs)
+/*
+ * parse_response_hdrs - Copy the header lines of the response to a string
+ *     allocated from arena, except the ones about the connection and the
+ *     framing of the body, which set it up
+ */
+static char *
+parse_response_hdrs(const HttpHead *head, Arena *arena, Response *response)
 {
-    char linebuf[MAX_LINE];
+    int chunked = 0, digits;
+    ssize_t content_len = -1, n;
+    size_t len = 0;
+    char *response_hdrs;
+    const HttpHdr *hdr;
+
+    response_hdrs = arena_alloc(arena, head->hd_len + 1);
+    for (int i = 0; i < head->hd_nhdrs; i++) {
+        hdr = &head->hd_hdrs[i];
+
+        /* Content-Length is written for the client with its framing */
+        if (http_hdr_is(hdr, "content-length")) {
+            for (n = digits = 0; digits < hdr->hh_value_len &&
+                 isdigit((unsigned char) hdr->hh_value[digits]); digits++)
+                n = n * 10 + hdr->hh_value[digits] - '0';
+            if (digits > 0 && digits < 19) {
+                content_len = n;
+                continue;
+            }
+        }
 
-    request_hdrs[0] = '\0';
+        /* Hop-by-hop headers describe the connection with the proxy */
+        if (is_hop_by_hop(hdr->hh_name)) {
+            if (http_hdr_is(hdr, "transfer-encoding"))
+                chunked = http_has_token(hdr->hh_value, hdr->hh_value_len,
+                                         "chunked");
+            if (http_hdr_is(hdr, "connection")) {
+                if (http_has_token(hdr->hh_value, hdr->hh_value_len,
+                                   "close"))
+                    response->rs_server_close = 1;
+                else if (http_has_token(hdr->hh_value, hdr->hh_value_len,
+                                        "keep-alive"))
+                    response->rs_server_close = 0;
+            }
+            continue;
+        }
+        memcpy(response_hdrs + len, hdr->hh_name, hdr->hh_size);
+        len += hdr->hh_size;
+    }
+    response_hdrs[len] = '\0';
+
+    /* The body is relayed without its chunk framing, the headers end
+     * with the framing of build_client_head */
+    if (chunked) {
+        response->rs_body_state = BODY_CHUNK_SIZE;
+    } else if (content_len >= 0) {
+        response->rs_body_state = BODY_LENGTH;
+        response->rs_body_left = content_len;
+    } else {
+        response->rs_body_state = BODY_EOF;
+    }
 
-    /* Append Host header if it does not exist in request headers */
-    if (!strstr(request->rq_hdrs, "Host: ")) {
-        sprintf(linebuf, "Host: %s\r\n", request->rq_hostname);
-        strcat(request_hdrs, linebuf);
+    return response_hdrs;
+}
+
+/*
+ * normalize_path - Write the path of a URL in canonical form to out:
+ *     percent-encoded unreserved characters decoded, the other escapes in
+ *     upper case and the dot segments removed. The query is kept as it
+ *     is, the fragment dropped. Returns the length written.
+ */
+static size_t
+normalize_path(const char *path, char *out)
+{
+    int c;
+    size_t n = 0, query_len;
+    const char *p, *end;
+
+    end = path + strcspn(path, "?#");
+    for (p = path; p < end; p++) {
+        if (*p != '%' || !isxdigit((unsigned char) p[1]) ||
+            !isxdigit((unsigned char) p[2])) {
+            out[n++] = *p;
+            continue;
+        }
+        sscanf(p + 1, "%2x", &c);
+        if (isalnum(c) || (c && strchr("-._~", c))) {
+            out[n++] = c;
+        } else {
+            out[n++] = '%';
+            out[n++] = toupper((unsigned char) p[1]);
+            out[n++] = toupper((unsigned char) p[2]);
+        }
+        p += 2;
     }
-    strcat(request_hdrs, user_agent_hdr);
-    strcat(request_hdrs, conn_hdr);
-    strcat(request_hdrs, proxy_conn_hdr);
-    strcat(request_hdrs, request->rq_hdrs);
+    n = remove_dot_segments(out, n);
+
+    if (*end == '?') {
+        query_len = strcspn(end, "#");
+        memcpy(out + n, end, query_len);
+        n += query_len;
+    }
+    return n;
 }
 
+/*
+ * remove_dot_segments - Resolve the "." and ".." segments of the n bytes
+ *     of an absolute path in place, as RFC 3986 does. Returns its new
+ *     length.
+ */
+static size_t
+remove_dot_segments(char *path, size_t n)
+{
+    size_t r = 0, w = 0, seg_len;
+    const char *seg, *slash;
+
+    while (r < n) {
+        /* path[r] is the slash in front of the segment */
+        seg = path + r + 1;
+        slash = memchr(seg, '/', n - r - 1);
+        seg_len = slash ? slash - seg : n - r - 1;
+
+        if (seg_len == 1 && seg[0] == '.') {
+            if (!slash)
+                path[w++] = '/';
+        } else if (seg_len == 2 && seg[0] == '.' && seg[1] == '.') {
+            while (w > 0 && path[--w] != '/')
+                ;
+            if (!slash)
+                path[w++] = '/';
+        } else {
+            memmove(path + w, path + r, seg_len + 1);
+            w += seg_len + 1;
+        }
+        r += seg_len + 1;
+    }
+
+    if (w == 0)
+        path[w++] = '/';
+    return w;
+}
+
+/*
+ * find_hdr - Copy the value of the first header of hdrs called name to
+ *     value, without the blanks around it. Returns -1 if there is none.
+ */
 static int
-parse_response(int connfd, Response *response)
+find_hdr(const char *hdrs, const char *name, char *value)
 {
-    Sio sio;
-    ssize_t content_len;
-    char response_line[MAX_LINE], response_hdrs[MAX_BUF];
+    size_t name_len = strlen(name), n;
+    const char *line, *p;
+
+    for (line = hdrs; *line; line = p + (*p == '\n')) {
+        p = line + strcspn(line, "\n");
+        if (strncasecmp(line, name, name_len) || line[name_len] != ':')
+            continue;
+        p = line + name_len + 1;
+        p += strspn(p, " \t");
+        n = strcspn(p, "\r\n");
+        while (n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\t'))
+            n--;
+        if (n >= MAX_LINE)
+            n = MAX_LINE - 1;
+        memcpy(value, p, n);
+        value[n] = '\0';
+        return 0;
+    }
+    return -1;
+}
 
-    sio_initbuf(&sio, connfd);
+/*
+ * get_vary - Copy the header names of the Vary header of a response to
+ *     vary, in lower case and separated by commas alone. Returns their
+ *     length, 0 if there is no Vary header and -1 if it is "*", which
+ *     means the response can not be cached.
+ */
+static int
+get_vary(const char *response_hdrs, char *vary)
+{
+    int n = 0;
+    char value[MAX_LINE];
+
+    if (find_hdr(response_hdrs, "Vary", value) < 0)
+        return 0;
+
+    for (char *p = value; *p; p++) {
+        if (*p == '*')
+            return -1;
+        if (*p != ' ' && *p != '\t')
+            vary[n++] = tolower((unsigned char) *p);
+    }
+    vary[n] = '\0';
+    return n;
+}
+
+/*
+ * vary_key - Extend the key of a response with the values the request
+ *     has for the headers named by vary. Returns the new key length, 0 if
+ *     it does not fit.
+ */
+static size_t
+vary_key(char *key, size_t key_len, const char *vary,
+         const char *request_hdrs)
+{
+    size_t name_len;
+    char name[MAX_LINE], value[MAX_LINE];
+
+    for (const char *p = vary; *p; p += name_len + (p[name_len] == ',')) {
+        name_len = strcspn(p, ",");
+        memcpy(name, p, name_len);
+        name[name_len] = '\0';
+        if (find_hdr(request_hdrs, name, value) < 0)
+            value[0] = '\0';
+
+        if (key_len + name_len + strlen(value) + 3 > CACHE_KEY_SIZE)
+            return 0;
+        key_len += sprintf(key + key_len, "\n%s:%s", name, value);
+    }
+    return key_len;
+}
 
-    /* Parse response line */ 
-    if (sio_read_line(&sio, response_line, MAX_LINE) < 0)
+/*
+ * parse_cache_control - Collect the directives of all the Cache-Control
+ *     headers. Without any, "Pragma: no-cache" is taken as no-cache.
+ *     Directives limited to some fields are taken as whole.
+ */
+static void
+parse_cache_control(const char *hdrs, CacheControl *cc)
+{
+    long *arg;
+    size_t line_len, n;
+    const char *line, *p, *end, *eq;
+    char value[MAX_LINE];
+
+    memset(cc, 0, sizeof(*cc));
+    cc->cc_max_age = cc->cc_s_maxage = cc->cc_min_fresh = -1;
+    cc->cc_stale_while_revalidate = -1;
+
+    for (line = hdrs; *line; line += line_len) {
+        line_len = strcspn(line, "\n");
+        line_len += line[line_len] == '\n';
+        if (strncasecmp(line, "Cache-Control:", 14))
+            continue;
+        cc->cc_present = 1;
+
+        end = line + line_len;
+        for (p = line + 14; p < end; p += n + 1) {
+            p += strspn(p, " \t");
+            n = strcspn(p, ",\r\n");
+            if (p + n > end)
+                n = end - p;
+
+            arg = NULL;
+            if (!strncasecmp(p, "no-store", 8))
+                cc->cc_no_store = 1;
+            else if (!strncasecmp(p, "no-cache", 8))
+                cc->cc_no_cache = 1;
+            else if (!strncasecmp(p, "private", 7))
+                cc->cc_private = 1;
+            else if (!strncasecmp(p, "public", 6))
+                cc->cc_public = 1;
+            else if (!strncasecmp(p, "must-revalidate", 15) ||
+                     !strncasecmp(p, "proxy-revalidate", 16))
+                cc->cc_must_revalidate = 1;
+            else if (!strncasecmp(p, "max-age=", 8))
+                arg = &cc->cc_max_age;
+            else if (!strncasecmp(p, "s-maxage=", 9))
+                arg = &cc->cc_s_maxage;
+            else if (!strncasecmp(p, "min-fresh=", 10))
+                arg = &cc->cc_min_fresh;
+            else if (!strncasecmp(p, "stale-while-revalidate=", 23))
+                arg = &cc->cc_stale_while_revalidate;
+
+            /* A value that is no number makes the response stale */
+            if (arg) {
+                eq = (const char *) memchr(p, '=', n) + 1;
+                *arg = strtol(eq + (*eq == '"'), NULL, 10);
+                if (*arg < 0)
+                    *arg = 0;
+            }
+        }
+    }
+
+    if (!cc->cc_present && find_hdr(hdrs, "Pragma", value) == 0 &&
+        strcasestr(value, "no-cache"))
+        cc->cc_no_cache = 1;
+}
+
+/*
+ * parse_http_date - Parse a date in any of the formats HTTP allows.
+ *     Returns -1 if it is none of them.
+ */
+static time_t
+parse_http_date(const char *value)
+{
+    static const char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",    /* IMF-fixdate */
+        "%A, %d-%b-%y %H:%M:%S GMT",    /* RFC 850 */
+        "%a %b %e %H:%M:%S %Y",         /* asctime() */
+        NULL
+    };
+    struct tm tm;
+    const char *end;
+
+    for (int i = 0; formats[i]; i++) {
+        memset(&tm, 0, sizeof(tm));
+        if ((end = strptime(value, formats[i], &tm)) && !*end)
+            return timegm(&tm);
+    }
+    return -1;
+}
+
+/*
+ * response_freshness - Work out, as a shared cache does, whether a
+ *     response to the request may be cached and if so when its age was 0
+ *     (date), until when it is fresh (expires) and until when it may be
+ *     sent stale while it is refreshed (stale_until). The lifetime comes
+ *     from s-maxage, max-age or Expires, else it is a part of the time
+ *     since the Last-Modified date, or the default TTL of the cache
+ *     without one. The stale window is the stale-while-revalidate of the
+ *     response or the one of the cache. now is when the response arrived.
+ *     Returns -1 if it must not be cached.
+ */
+static int
+response_freshness(const char *request_hdrs, const char *response_line,
+                   const char *response_hdrs, time_t now,
+                   const Cache *proxy_cache, time_t *date, time_t *expires,
+                   time_t *stale_until)
+{
+    int status = 0, heuristic, validated;
+    long age = 0;
+    time_t served, lifetime, modified, expiry;
+    char value[MAX_LINE];
+    CacheControl req_cc, cc;
+
+    /* Partial responses are not put together, a 304 is only about the
+     * response the request had */
+    sscanf(response_line, "HTTP/%*d.%*d %d", &status);
+    if (status < 200 || status == 206 || status == 304)
         return -1;
-    /* Parse response headrs */
-    if ((content_len = parse_response_hdrs(&sio, response_hdrs)) < 0)
+
+    parse_cache_control(request_hdrs, &req_cc);
+    parse_cache_control(response_hdrs, &cc);
+    if (req_cc.cc_no_store || cc.cc_no_store || cc.cc_private)
         return -1;
-    /* Parse content */
-    response->rs_content = malloc(content_len);
-    if (sio_readn(&sio, response->rs_content, content_len) < 0)
+    /* A response for one user only is not shared unless it says so */
+    if (find_hdr(request_hdrs, "Authorization", value) == 0 &&
+        !cc.cc_public && cc.cc_s_maxage < 0 && !cc.cc_must_revalidate)
         return -1;
 
-    /* Build the response struct */
-    response->rs_content_length = content_len;
-    response->rs_line = strdup(response_line);
-    response->rs_hdrs = strdup(response_hdrs);
+    /* The age on arrival is the larger of the one the server tells and
+     * the one its clock shows */
+    served = find_hdr(response_hdrs, "Date", value) == 0 ?
+             parse_http_date(value) : -1;
+    if (served < 0 || served > now)
+        served = now;
+    if (find_hdr(response_hdrs, "Age", value) == 0)
+        age = strtol(value, NULL, 10);
+    if (age < now - served)
+        age = now - served;
+    if (age < 0)
+        age = 0;
+    *date = now - age;
+
+    heuristic = status == 200 || status == 203 || status == 204 ||
+                status == 300 || status == 301 || status == 308 ||
+                status == 404 || status == 405 || status == 410 ||
+                status == 414 || status == 501;
+    modified = find_hdr(response_hdrs, "Last-Modified", value) == 0 ?
+               parse_http_date(value) : -1;
+
+    if (cc.cc_s_maxage >= 0) {
+        lifetime = cc.cc_s_maxage;
+    } else if (cc.cc_max_age >= 0) {
+        lifetime = cc.cc_max_age;
+    } else if (find_hdr(response_hdrs, "Expires", value) == 0) {
+        /* An invalid date means already expired */
+        expiry = parse_http_date(value);
+        lifetime = expiry > served ? expiry - served : 0;
+    } else if (!heuristic) {
+        return -1;
+    } else if (modified >= 0 && modified <= served) {
+        lifetime = (served - modified) * CACHE_HEURISTIC_PCT / 100;
+        if (lifetime > CACHE_HEURISTIC_MAX)
+            lifetime = CACHE_HEURISTIC_MAX;
+    } else {
+        lifetime = proxy_cache->default_ttl;
+    }
+    if (cc.cc_no_cache)
+        lifetime = 0;
+
+    /* A response stale on arrival is only worth keeping if the server
+     * can be asked whether it is still current */
+    validated = modified >= 0 ||
+                find_hdr(response_hdrs, "ETag", value) == 0;
+    if (lifetime <= age && !validated)
+        return -1;
 
+    *expires = *date + lifetime;
+    *stale_until = *expires;
+    if (!cc.cc_no_cache && !cc.cc_must_revalidate)
+        *stale_until += cc.cc_stale_while_revalidate >= 0 ?
+                        cc.cc_stale_while_revalidate :
+                        proxy_cache->stale_window;
     return 0;
 }
 
-static ssize_t
-parse_response_hdrs(Sio *sio, char *response_hdrs)
+/*
+ * entry_state - Whether a cached response can answer the request without
+ *     asking the server: fresh and as fresh as the request wants, or
+ *     stale but within its stale window and the request does not mind
+ */
+static enum entry_state
+entry_state(const CacheEntry *entry, const char *request_hdrs, time_t now)
 {
-    ssize_t content_len = -1;
-    char hdr_linebuf[MAX_LINE];
+    CacheControl cc;
+
+    parse_cache_control(request_hdrs, &cc);
+    if (cc.cc_no_cache)
+        return ENTRY_STALE;
+    if (cc.cc_max_age >= 0 && now - entry->date > cc.cc_max_age)
+        return ENTRY_STALE;
+    if (cc.cc_min_fresh >= 0 && entry->expires - now < cc.cc_min_fresh)
+        return ENTRY_STALE;
+    if (now < entry->expires)
+        return ENTRY_FRESH;
+    return now < entry->stale_until ? ENTRY_REFRESH : ENTRY_STALE;
+}
 
-    /* Initialize request_hdrs to be ready for appending (concatination) */
-    response_hdrs[0] = '\0';
-    do {
-        if (sio_read_line(sio, hdr_linebuf, MAX_LINE) < 0)
-            return -1;
+/*
+ * schedule_refresh - Have the refresher fetch the cached response again
+ *     with the request of the client
+ */
+static int
+schedule_refresh(CacheEntry *entry, const Request *client_request,
+                 const char *request_hdrs, const char *key, size_t key_len,
+                 int ahead)
+{
+    return refresh_schedule(entry, client_request->rq_hostname,
+                     client_request->rq_port,
+                     build_request_line(client_request), request_hdrs,
+                     key, key_len, ahead);
+}
+
+/*
+ * entry_head - Copy the response line and headers of a cached response
+ *     to a malloc'ed string
+ */
+static char *
+entry_head(const CacheEntry *entry)
+{
+    char *head = malloc(entry->conn_off + 1);
+
+    memcpy(head, entry->data, entry->conn_off);
+    head[entry->conn_off] = '\0';
+    return head;
+}
 
-        strcat(response_hdrs, hdr_linebuf);
-        strtolwr(hdr_linebuf);
-        sscanf(hdr_linebuf, "content-length: %zu", &content_len);
-    } while (strcmp(hdr_linebuf, "\r\n"));
+/*
+ * has_validators - Whether the server can tell if the cached response is
+ *     still current
+ */
+static int
+has_validators(const CacheEntry *entry)
+{
+    int rc;
+    char *head = entry_head(entry), value[MAX_LINE];
 
-    return content_len;
+    rc = find_hdr(head, "ETag", value) == 0 ||
+         find_hdr(head, "Last-Modified", value) == 0;
+    free(head);
+    return rc;
+}
+
+/*
+ * filter_hdrs - Append to the len bytes of out the headers of hdrs that
+ *     are worth caching and not in skip: the framing and Age are left out,
+ *     a cache entry adds them itself. out has room for all of hdrs.
+ *     Returns the new length of out.
+ */
+static size_t
+filter_hdrs(const char *hdrs, const char *skip, char *out, size_t len)
+{
+    size_t line_len, name_len;
+    const char *line, *colon;
+    char name[MAX_LINE], value[MAX_LINE];
+
+    for (line = hdrs; *line; line += line_len) {
+        line_len = strcspn(line, "\n");
+        line_len += line[line_len] == '\n';
+        if (!(colon = memchr(line, ':', line_len)) ||
+            colon - line >= MAX_LINE || is_hop_by_hop(line) || !strncasecmp(line, "Content-Length:", 15) ||
+            !strncasecmp(line, "Age:", 4))
+            continue;
+
+        name_len = colon - line;
+        memcpy(name, line, name_len);
+        name[name_len] = '\0';
+        if (find_hdr(skip, name, value) == 0)
+            continue;
+        memcpy(out + len, line, line_len);
+        len += line_len;
+    }
+    out[len] = '\0';
+    return len;
 }
 
 static void
 client_error(int clientfd, char *cause, char *errnum,
              char *short_msg, char *long_msg)
 {
-    char linebuf[MAX_LINE], body[MAX_BUF];
+    char linebuf[MAX_LINE], body[3 * MAX_LINE];
+    struct iovec iov[2];
 
     /* Build the HTTP response body */
     sprintf(body, "<html><title>Proxy Error</title>");
     strcat(body, "<body bgcolor=""ffffff"">\r\n");
-    sprintf(linebuf, "%s: %s\r\n", errnum, short_msg);
+    snprintf(linebuf, sizeof(linebuf), "%s: %s\r\n", errnum, short_msg);
     strcat(body, linebuf);
-    sprintf(linebuf, "%s: %s\r\n", long_msg, cause);
+    snprintf(linebuf, sizeof(linebuf), "%s: %s\r\n", long_msg, cause);
     strcat(body, linebuf);
 
-    /* Send the HTTP response */
-    sprintf(linebuf, "HTTP/1.0 %s %s\r\n", errnum, short_msg);
-    if (sio_writen(clientfd, linebuf, strlen(linebuf)) < 0)
-        return;
-    sprintf(linebuf, "Content-Type: text/html\r\n");
-    if (sio_writen(clientfd, linebuf, strlen(linebuf)) < 0)
-        return;
-    sprintf(linebuf, "Content-Length: %zu\r\n\r\n", strlen(body));
-    if (sio_writen(clientfd, linebuf, strlen(linebuf)) < 0)
-        return;
-    if (sio_writen(clientfd, body, strlen(body)) < 0)
-        return;
-}
-
-static void
-strtolwr(char *str)
-{
-    for (int i = 0; str[i] != '\0'; i++) {
-        if (isalpha(str[i]))
-            str[i] = tolower(str[i]);
-    }
+    /* Send the HTTP response, head and body at once */
+    snprintf(linebuf, sizeof(linebuf), "HTTP/1.0 %s %s\r\n"
+             "Content-Type: text/html\r\n"
+             "Content-Length: %zu\r\n\r\n", errnum, short_msg, strlen(body));
+    iov[0].iov_base = linebuf;
+    iov[0].iov_len = strlen(linebuf);
+    iov[1].iov_base = body;
+    iov[1].iov_len = strlen(body);
+    if (sio_sendv(clientfd, iov, 2, 0) >= 0)
+        sio_response_sent();
 }
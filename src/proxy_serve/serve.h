@@ -2,14 +2,24 @@
 #define _SERVER_H_
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 
+#include "../proxy_arena/arena.h"
+#include "../proxy_buf/buf.h"
 #include "../proxy_cache/cache.h"
+#include "../proxy_flight/flight.h"
+#include "../safe_io/sio.h"
 
 #define MAX_LINE    8192        /* 8KB line buffer */
-#define MAX_BUF     1048576     /* 1MB buffer size */
 #define PORT_LEN    10          /* 10B port length */
 #define VERSION_LEN 10          /* 10B http version length */
 #define METHOD_LEN  10          /* 10B method length */
+#define CACHED_IOVS 4           /* Most buffers build_cached_iov fills */
+#define SPLICE_MIN  65536       /* Smaller bodies are copied, not spliced */
+#define SPLICE_SIZE 65536       /* Body bytes through the pipe at once */
+#define RELAY_IOVS  32          /* Buffers of a response gathered in a write */
+#define SIZE_LINE_LEN 20        /* Size line of a chunk, "%zx\r\n" */
 
 typedef struct request {
     char *rq_method;
@@ -17,23 +27,147 @@ typedef struct request {
     char *rq_port;
     char *rq_path;
     char *rq_hdrs;
+    int rq_http11;              /* Client speaks HTTP/1.1 */
+    int rq_keep_alive;          /* Client wants the connection kept open */
+    Arena *rq_arena;            /* Where its strings are allocated */
 } Request;
 
+/* Framing of a body relayed from the server */
+enum body_state {
+    BODY_LENGTH,        /* rs_body_left bytes */
+    BODY_EOF,           /* Everything up to the end of the connection */
+    BODY_CHUNK_SIZE,    /* Chunked, next is a chunk size line */
+    BODY_CHUNK_DATA,    /* Chunked, rs_body_left bytes of the chunk */
+    BODY_CHUNK_END,     /* Chunked, next is the CRLF ending a chunk */
+    BODY_TRAILER,       /* Chunked, next is a trailer line */
+    BODY_DONE
+};
+
 typedef struct response {
     char *rs_line;
+    int rs_status;              /* Status code of rs_line */
     char *rs_hdrs;
-    void *rs_content;
-    size_t rs_content_length;
+    BufChain rs_content;        /* Body teed to the cache, in the pages */
+    Sio *rs_server_sio;         /* Server whose body is not relayed yet */
+    enum body_state rs_body_state;
+    size_t rs_body_left;        /* Body or chunk bytes left to relay */
+    int rs_server_close;        /* Server closes the connection after it */
+    int rs_reused;              /* Connection was kept alive by the pool */
+    const char *rs_hostname;    /* Server the connection goes back to, */
+    const char *rs_port;        /* ... owned by the request */
+    Cache *rs_cache;            /* Cache the relayed response goes to */
+    char *rs_request_line;      /* Request sent to the server */
+    char *rs_request_hdrs;
+    char *rs_key;               /* Cache key of the response */
+    size_t rs_key_len;
+    int rs_chunk_out;           /* Body is chunked again for the client */
+    int rs_client_close;        /* Client connection closes after it */
+    CacheEntry *rs_entry;       /* Cached response, sent as it is */
+    CacheEntry *rs_stale;       /* Cached response the server is asked about */
+    time_t rs_date;             /* Freshness of the response to cache */
+    time_t rs_expires, rs_stale_until;
+    char rs_age_hdr[32];        /* Age of the cached response */
+    Flight *rs_flight;          /* Fetch led for the waiting clients */
+    Arena *rs_arena;            /* Where its strings and buffers are */
 } Response;
 
 int
-parse_request(int clientfd, Request *client_request);
+parse_request(Sio *sio, Request *client_request);
 
 int
 forward_client_request(const Request *client_request, Cache *proxy_cache,
                        Response *server_response);
 
 int
-forward_server_response(int clientfd, const Response *server_response);
+forward_server_response(int clientfd, const Request *client_request,
+                        Response *server_response);
+
+void
+build_server_request(const Request *client_request, char **request_line,
+                     char **request_hdrs);
+
+size_t
+build_cache_key(const Request *client_request, char *key);
+
+CacheEntry *
+fetch_cached(Cache *proxy_cache, const char *key, size_t key_len,
+             const char *request_hdrs);
+
+CacheEntry *
+fetch_fresh(Cache *proxy_cache, const Request *client_request,
+            const char *request_hdrs, const char *key, size_t key_len,
+            CacheEntry **stale);
+
+char *
+add_validators(const CacheEntry *stale, Arena *arena,
+               const char *request_hdrs);
+
+int
+revalidate(Response *response, Cache *proxy_cache);
+
+int
+refresh_cached(Cache *proxy_cache, CacheEntry *entry, const char *hostname,
+               const char *port, const char *request_line,
+               const char *request_hdrs, const char *key, size_t key_len);
+
+char *
+build_client_head(const Request *client_request, Response *server_response,
+                  size_t *len);
+
+int
+build_cached_iov(const Request *client_request, Response *server_response,
+                 struct iovec *iov);
+
+void
+init_resources(Request *request, Response *response, Arena *arena);
+
+void
+free_resources(Request *request, Response *response);
+
+int
+parse_response_head(Sio *sio, Response *response);
+
+int
+body_span(Response *response, size_t *len);
+
+void
+body_consume(Response *response, size_t len);
+
+int
+body_eof(Response *response);
+
+int
+gather_body(Response *response, struct iovec *iov, int iovcnt,
+            char *size_line, size_t len);
+
+int
+gather_end(Response *response, struct iovec *iov, int iovcnt);
+
+void
+release_server(Response *response);
+
+void
+tee_init(Response *response, Cache *proxy_cache);
+
+void
+tee_content(Response *response, size_t n);
+
+void
+tee_finish(Response *response);
+
+void
+land_flight(Response *response);
+
+void
+set_splice(int enabled);
+
+int
+splice_ok(const Response *response);
+
+void
+set_zerocopy(int enabled);
+
+void
+zerocopy_client(int clientfd);
 
 #endif
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+
+#include "sketch.h"
+
+static size_t
+row_index(const Sketch *sketch, int row, unsigned long key);
+
+static void
+age(Sketch *sketch);
+
+static const unsigned long seeds[SKETCH_DEPTH] = {
+    0xc3a5c85c97cb3127UL, 0xb492b66fbe98f273UL,
+    0x9ae16a3b2f90404fUL, 0xcbf29ce484222325UL
+};
+
+/*
+ * sketch_init - Size the rows for about nkeys keys
+ */
+void
+sketch_init(Sketch *sketch, size_t nkeys)
+{
+    sketch->sk_width = 64;
+    while (sketch->sk_width < nkeys)
+        sketch->sk_width *= 2;
+    sketch->sk_counters = calloc(SKETCH_DEPTH * sketch->sk_width,
+                                 sizeof(*sketch->sk_counters));
+    atomic_init(&sketch->sk_additions, 0);
+    sketch->sk_sample = SKETCH_SAMPLE * sketch->sk_width;
+    atomic_init(&sketch->sk_agings, 0);
+}
+
+/*
+ * sketch_increment - Count key once more. Only its smallest counters are
+ *     raised (conservative update), the others already overestimate it.
+ */
+void
+sketch_increment(Sketch *sketch, unsigned long key)
+{
+    unsigned char count[SKETCH_DEPTH], min = SKETCH_MAX_COUNT;
+    atomic_uchar *counter[SKETCH_DEPTH];
+
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        counter[i] = &sketch->sk_counters[i * sketch->sk_width
+                                          + row_index(sketch, i, key)];
+        count[i] = atomic_load_explicit(counter[i], memory_order_relaxed);
+        if (count[i] < min)
+            min = count[i];
+    }
+    if (min == SKETCH_MAX_COUNT)
+        return;
+
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        if (count[i] == min)
+            atomic_store_explicit(counter[i], min + 1, memory_order_relaxed);
+    }
+
+    /* Only the thread that reaches the sample ages the counters */
+    if (atomic_fetch_add_explicit(&sketch->sk_additions, 1,
+                                  memory_order_relaxed) + 1
+        == sketch->sk_sample)
+        age(sketch);
+}
+
+/*
+ * sketch_estimate - How often key was seen, at most SKETCH_MAX_COUNT
+ */
+unsigned int
+sketch_estimate(Sketch *sketch, unsigned long key)
+{
+    unsigned int count, min = SKETCH_MAX_COUNT;
+
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        count = atomic_load_explicit(&sketch->sk_counters[i * sketch->sk_width
+                                     + row_index(sketch, i, key)],
+                                     memory_order_relaxed);
+        if (count < min)
+            min = count;
+    }
+    return min;
+}
+
+static size_t
+row_index(const Sketch *sketch, int row, unsigned long key)
+{
+    unsigned long hash = (key + seeds[row]) * seeds[row];
+
+    return (hash ^ (hash >> 32)) & (sketch->sk_width - 1);
+}
+
+/*
+ * age - Halve every counter, and the additions with them
+ */
+static void
+age(Sketch *sketch)
+{
+    size_t n = SKETCH_DEPTH * sketch->sk_width;
+    unsigned char count;
+
+    for (size_t i = 0; i < n; i++) {
+        count = atomic_load_explicit(&sketch->sk_counters[i],
+                                     memory_order_relaxed);
+        atomic_store_explicit(&sketch->sk_counters[i], count / 2,
+                              memory_order_relaxed);
+    }
+    atomic_fetch_sub_explicit(&sketch->sk_additions, sketch->sk_sample / 2,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&sketch->sk_agings, 1, memory_order_relaxed);
+}
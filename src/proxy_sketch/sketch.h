@@ -0,0 +1,34 @@
+#ifndef _SKETCH_H_
+#define _SKETCH_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define SKETCH_DEPTH        4       /* Rows, each hashed differently */
+#define SKETCH_MAX_COUNT    15      /* Counters saturate here */
+#define SKETCH_SAMPLE       10      /* Additions per counter between agings */
+
+/*
+ * Count-min sketch estimating how often keys were seen lately. Once
+ * sk_sample counters were raised every counter is halved, so old
+ * popularity fades. Updates take no lock and a lost one only makes an
+ * estimate a little lower.
+ */
+typedef struct sketch {
+    size_t sk_width;                /* Counters per row, a power of 2 */
+    atomic_uchar *sk_counters;      /* SKETCH_DEPTH rows of sk_width */
+    atomic_size_t sk_additions;     /* Raised counters since the last aging */
+    size_t sk_sample;
+    atomic_ulong sk_agings;
+} Sketch;
+
+void
+sketch_init(Sketch *sketch, size_t nkeys);
+
+void
+sketch_increment(Sketch *sketch, unsigned long key);
+
+unsigned int
+sketch_estimate(Sketch *sketch, unsigned long key);
+
+#endif
@@ -0,0 +1,315 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "slab.h"
+#include "../proxy_stats/stats.h"
+
+#define SLAB_ALIGN 16
+
+/* In front of every chunk, the free ones link through next */
+typedef struct chunk {
+    struct slab *ch_slab;
+    union {
+        size_t ch_size;             /* Bytes asked for */
+        struct chunk *ch_next;      /* Next free chunk of the slab */
+    };
+} Chunk;
+
+/* One mapping cut into chunks of one class, its header comes first */
+typedef struct slab {
+    SlabClass *sl_class;
+    struct slab *sl_prev, *sl_next; /* Slabs of the class with room */
+    Chunk *sl_free;
+    size_t sl_fresh;                /* Chunks never handed out, at the end */
+    size_t sl_used;
+    size_t sl_bytes;
+    char *sl_chunks;
+} Slab;
+
+static SlabClass *
+find_class(SlabPool *pool, size_t size);
+
+static Slab *
+new_slab(SlabClass *class);
+
+static void
+free_slab(Slab *slab);
+
+static void
+unlink_slab(Slab *slab);
+
+static void
+slab_report(FILE *out, void *arg);
+
+static SlabPool *pools;
+static size_t page_size;
+
+/*
+ * slab_init - Build the size classes of a pool from SLAB_MIN_CHUNK up to
+ *     max_alloc, each SLAB_GROWTH times the previous one. At most budget
+ *     bytes are ever mapped for its slabs, and a slab of small chunks
+ *     takes no more than a class's share of them, so a few chunks of
+ *     every class fit at once. One report covers all pools.
+ */
+void
+slab_init(SlabPool *pool, size_t budget, size_t max_alloc)
+{
+    size_t size, hdr, slab_size;
+    SlabClass *class;
+
+    pool->sp_budget = budget;
+    pool->sp_nclasses = 0;
+    atomic_init(&pool->sp_mapped, 0);
+    atomic_init(&pool->sp_full, 0);
+    page_size = sysconf(_SC_PAGESIZE);
+    hdr = (sizeof(Slab) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    max_alloc += sizeof(Chunk);
+
+    for (size = SLAB_MIN_CHUNK; pool->sp_nclasses < SLAB_MAX_CLASSES;
+         size = size * SLAB_GROWTH) {
+        size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+        if (size >= max_alloc || pool->sp_nclasses == SLAB_MAX_CLASSES - 1)
+            size = (max_alloc + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+
+        class = &pool->sp_classes[pool->sp_nclasses++];
+        class->sc_pool = pool;
+        class->sc_chunk = size;
+        class->sc_partial = NULL;
+        class->sc_slabs = class->sc_used = class->sc_requested = 0;
+        pthread_mutex_init(&class->sc_mutex, NULL);
+        if (size >= max_alloc)
+            break;
+    }
+
+    slab_size = budget / pool->sp_nclasses & ~(page_size - 1);
+    if (slab_size > SLAB_PAGE_SIZE)
+        slab_size = SLAB_PAGE_SIZE;
+    if (slab_size < page_size)
+        slab_size = page_size;
+    for (int i = 0; i < pool->sp_nclasses; i++) {
+        class = &pool->sp_classes[i];
+        class->sc_nchunks = class->sc_chunk + hdr < slab_size ?
+                            (slab_size - hdr) / class->sc_chunk : 1;
+    }
+
+    if (!pools)
+        stats_register("slab", slab_report, NULL);
+    pool->sp_next = pools;
+    pools = pool;
+}
+
+/*
+ * slab_alloc - Take a chunk of the smallest class that holds size bytes.
+ *     Returns NULL if size is too large or the budget of the pool is used
+ *     up, the caller then frees chunks of its own to make room.
+ */
+void *
+slab_alloc(SlabPool *pool, size_t size)
+{
+    SlabClass *class;
+    Slab *slab;
+    Chunk *chunk;
+
+    if (!(class = find_class(pool, size + sizeof(Chunk)))) {
+        pool->sp_full++;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&class->sc_mutex);
+    if (!(slab = class->sc_partial) && !(slab = new_slab(class))) {
+        pthread_mutex_unlock(&class->sc_mutex);
+        pool->sp_full++;
+        return NULL;
+    }
+
+    if ((chunk = slab->sl_free)) {
+        slab->sl_free = chunk->ch_next;
+    } else {
+        /* Fresh chunks are only touched now, so RSS follows use */
+        chunk = (Chunk *) (slab->sl_chunks + (class->sc_nchunks
+                                              - slab->sl_fresh)
+                                             * class->sc_chunk);
+        slab->sl_fresh--;
+    }
+    if (++slab->sl_used == class->sc_nchunks)
+        unlink_slab(slab);
+
+    chunk->ch_slab = slab;
+    chunk->ch_size = size;
+    class->sc_used++;
+    class->sc_requested += size;
+    pthread_mutex_unlock(&class->sc_mutex);
+    return chunk + 1;
+}
+
+/*
+ * slab_free - Give a chunk back to its slab. An empty slab is unmapped,
+ *     so its bytes are free for any class of its pool.
+ */
+void
+slab_free(void *ptr)
+{
+    Chunk *chunk = (Chunk *) ptr - 1;
+    Slab *slab = chunk->ch_slab;
+    SlabClass *class = slab->sl_class;
+
+    pthread_mutex_lock(&class->sc_mutex);
+    class->sc_used--;
+    class->sc_requested -= chunk->ch_size;
+
+    /* A full slab has room again */
+    if (slab->sl_used-- == class->sc_nchunks) {
+        slab->sl_prev = NULL;
+        slab->sl_next = class->sc_partial;
+        if (class->sc_partial)
+            class->sc_partial->sl_prev = slab;
+        class->sc_partial = slab;
+    }
+    chunk->ch_next = slab->sl_free;
+    slab->sl_free = chunk;
+
+    if (slab->sl_used == 0) {
+        unlink_slab(slab);
+        free_slab(slab);
+    }
+    pthread_mutex_unlock(&class->sc_mutex);
+}
+
+/*
+ * slab_chunk_size - Bytes a size byte allocation takes, 0 if too large
+ */
+size_t
+slab_chunk_size(SlabPool *pool, size_t size)
+{
+    SlabClass *class = find_class(pool, size + sizeof(Chunk));
+
+    return class ? class->sc_chunk : 0;
+}
+
+static SlabClass *
+find_class(SlabPool *pool, size_t size)
+{
+    int lo = 0, hi = pool->sp_nclasses - 1, mid;
+    SlabClass *classes = pool->sp_classes;
+
+    if (pool->sp_nclasses == 0 || size > classes[hi].sc_chunk)
+        return NULL;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (classes[mid].sc_chunk < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return &classes[lo];
+}
+
+/*
+ * new_slab - Map a slab for the class if the budget of its pool has room
+ *     for it and put it on the list of slabs with room. Called with its
+ *     mutex held.
+ */
+static Slab *
+new_slab(SlabClass *class)
+{
+    size_t hdr, bytes, used;
+    SlabPool *pool = class->sc_pool;
+    Slab *slab;
+
+    hdr = (sizeof(Slab) + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    bytes = hdr + class->sc_nchunks * class->sc_chunk;
+    bytes = (bytes + page_size - 1) & ~(page_size - 1);
+
+    used = atomic_load(&pool->sp_mapped);
+    do {
+        if (used + bytes > pool->sp_budget)
+            return NULL;
+    } while (!atomic_compare_exchange_weak(&pool->sp_mapped, &used,
+                                           used + bytes));
+
+    slab = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+        atomic_fetch_sub(&pool->sp_mapped, bytes);
+        return NULL;
+    }
+
+    slab->sl_class = class;
+    slab->sl_free = NULL;
+    slab->sl_fresh = class->sc_nchunks;
+    slab->sl_used = 0;
+    slab->sl_bytes = bytes;
+    slab->sl_chunks = (char *) slab + hdr;
+    slab->sl_prev = NULL;
+    slab->sl_next = class->sc_partial;
+    if (class->sc_partial)
+        class->sc_partial->sl_prev = slab;
+    class->sc_partial = slab;
+    class->sc_slabs++;
+    return slab;
+}
+
+static void
+free_slab(Slab *slab)
+{
+    size_t bytes = slab->sl_bytes;
+    SlabClass *class = slab->sl_class;
+
+    class->sc_slabs--;
+    munmap(slab, bytes);
+    atomic_fetch_sub(&class->sc_pool->sp_mapped, bytes);
+}
+
+/*
+ * unlink_slab - Take a slab off the list of slabs with room
+ */
+static void
+unlink_slab(Slab *slab)
+{
+    if (slab->sl_prev)
+        slab->sl_prev->sl_next = slab->sl_next;
+    else
+        slab->sl_class->sc_partial = slab->sl_next;
+    if (slab->sl_next)
+        slab->sl_next->sl_prev = slab->sl_prev;
+    slab->sl_prev = slab->sl_next = NULL;
+}
+
+static void
+slab_report(FILE *out, void *arg)
+{
+    size_t slabs = 0, chunks = 0, chunk_bytes = 0, requested = 0;
+    size_t budget = 0, total = 0;
+    unsigned long full = 0;
+    int npools = 0;
+    SlabClass *class;
+
+    for (SlabPool *pool = pools; pool; pool = pool->sp_next, npools++) {
+        for (int i = 0; i < pool->sp_nclasses; i++) {
+            class = &pool->sp_classes[i];
+            pthread_mutex_lock(&class->sc_mutex);
+            slabs += class->sc_slabs;
+            chunks += class->sc_used;
+            chunk_bytes += class->sc_used * class->sc_chunk;
+            requested += class->sc_requested;
+            pthread_mutex_unlock(&class->sc_mutex);
+        }
+        budget += pool->sp_budget;
+        total += atomic_load(&pool->sp_mapped);
+        full += atomic_load(&pool->sp_full);
+    }
+
+    /* Occupancy is the part of the mapped bytes in chunks handed out,
+     * fragmentation the part of those chunks not asked for */
+    fprintf(out, " pools=%d classes=%d budget=%zu mapped=%zu slabs=%zu "
+            "chunks=%zu requested=%zu occupancy=%.1f%% fragmentation=%.1f%% "
+            "full=%lu", npools, pools ? pools->sp_nclasses : 0, budget,
+            total, slabs, chunks, requested,
+            total ? 100.0 * chunk_bytes / total : 0.0,
+            chunk_bytes ? 100.0 * (chunk_bytes - requested) / chunk_bytes
+                        : 0.0, full);
+}
@@ -0,0 +1,46 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define SLAB_PAGE_SIZE      65536   /* Most a slab of small chunks takes */
+#define SLAB_MIN_CHUNK      64      /* Size of the smallest class */
+#define SLAB_GROWTH         1.25    /* Ratio of consecutive class sizes */
+#define SLAB_MAX_CLASSES    64
+
+typedef struct slab_pool SlabPool;
+
+typedef struct slab_class {
+    SlabPool *sc_pool;
+    size_t sc_chunk;                /* Chunk size, header included */
+    size_t sc_nchunks;              /* Chunks per slab */
+    struct slab *sc_partial;        /* Slabs with room */
+    size_t sc_slabs, sc_used, sc_requested;
+    pthread_mutex_t sc_mutex;
+} SlabClass;
+
+/* Size classes mapping their slabs from a budget of their own */
+struct slab_pool {
+    SlabClass sp_classes[SLAB_MAX_CLASSES];
+    int sp_nclasses;
+    size_t sp_budget;
+    atomic_size_t sp_mapped;
+    atomic_ulong sp_full;           /* Allocations refused */
+    SlabPool *sp_next;              /* Pools in the report */
+};
+
+void
+slab_init(SlabPool *pool, size_t budget, size_t max_alloc);
+
+void *
+slab_alloc(SlabPool *pool, size_t size);
+
+void
+slab_free(void *ptr);
+
+size_t
+slab_chunk_size(SlabPool *pool, size_t size);
+
+#endif
@@ -0,0 +1,84 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+typedef struct report {
+    const char *rp_name;
+    StatsReport rp_report;
+    void *rp_arg;
+} Report;
+
+static void *
+stats_thread(void *vargp);
+
+static Report reports[MAX_REPORTS];
+static int nreports;
+static pthread_mutex_t reports_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * stats_init - Start the thread that prints every registered report to
+ *     stderr whenever the proxy gets SIGUSR1. Must be called before any
+ *     other thread is created so that all of them inherit the blocked
+ *     signal and leave it to the stats thread.
+ */
+void
+stats_init(void)
+{
+    pthread_t tid;
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_create(&tid, NULL, stats_thread, NULL);
+}
+
+/*
+ * stats_register - Add a report printed under the given name
+ */
+void
+stats_register(const char *name, StatsReport report, void *arg)
+{
+    pthread_mutex_lock(&reports_mutex);
+    if (nreports < MAX_REPORTS) {
+        reports[nreports].rp_name = name;
+        reports[nreports].rp_report = report;
+        reports[nreports].rp_arg = arg;
+        nreports++;
+    }
+    pthread_mutex_unlock(&reports_mutex);
+}
+
+/*
+ * stats_print - Print every registered report, one line each
+ */
+void
+stats_print(FILE *out)
+{
+    pthread_mutex_lock(&reports_mutex);
+    for (int i = 0; i < nreports; i++) {
+        fprintf(out, "%s:", reports[i].rp_name);
+        reports[i].rp_report(out, reports[i].rp_arg);
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&reports_mutex);
+    fflush(out);
+}
+
+static void *
+stats_thread(void *vargp)
+{
+    int sig;
+    sigset_t set;
+
+    pthread_detach(pthread_self());
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (1) {
+        if (sigwait(&set, &sig) == 0)
+            stats_print(stderr);
+    }
+    return NULL;
+}
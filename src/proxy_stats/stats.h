@@ -0,0 +1,19 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+
+#define MAX_REPORTS 32
+
+typedef void (*StatsReport)(FILE *out, void *arg);
+
+void
+stats_init(void);
+
+void
+stats_register(const char *name, StatsReport report, void *arg);
+
+void
+stats_print(FILE *out);
+
+#endif
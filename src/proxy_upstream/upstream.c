@@ -0,0 +1,225 @@
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "upstream.h"
+#include "../proxy_stats/stats.h"
+
+typedef struct idle_conn {
+    char *ic_key;                   /* "hostname:port" */
+    int ic_fd;
+    time_t ic_since;
+    struct idle_conn *ic_next;
+} IdleConn;
+
+static unsigned long
+key_hash(const char *key);
+
+static char *
+make_key(const char *hostname, const char *port);
+
+static int
+is_healthy(int connfd);
+
+static void
+sweep(time_t now);
+
+static void
+upstream_report(FILE *out, void *arg);
+
+/* Idle connections hashed by key, most recently checked in first */
+static IdleConn *buckets[UPSTREAM_BUCKETS];
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int max_idle_per_host = DEFAULT_MAX_IDLE;
+static int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+static int nidle;
+static time_t last_sweep;
+static atomic_ulong hits, misses, reuses, checkins, expired, unhealthy, overflow;
+
+/*
+ * upstream_init - Set the caps of the pool of idle server connections and
+ *     register its report. Idle connections are kept per hostname and
+ *     port, at most max_idle of them and for idle_timeout seconds.
+ */
+void
+upstream_init(int max_idle, int timeout)
+{
+    if (max_idle >= 0)
+        max_idle_per_host = max_idle;
+    if (timeout > 0)
+        idle_timeout = timeout;
+    last_sweep = time(NULL);
+    stats_register("upstream", upstream_report, NULL);
+}
+
+/*
+ * upstream_checkout - Take an idle connection to <hostname, port> out of
+ *     the pool. Connections that timed out or were closed by the server
+ *     are dropped on the way. Returns -1 if there is none left.
+ */
+int
+upstream_checkout(const char *hostname, const char *port)
+{
+    int connfd = -1;
+    char *key;
+    time_t now;
+    IdleConn **link, *ic;
+
+    key = make_key(hostname, port);
+    now = time(NULL);
+
+    pthread_mutex_lock(&pool_mutex);
+    link = &buckets[key_hash(key) % UPSTREAM_BUCKETS];
+    while ((ic = *link) && connfd < 0) {
+        if (strcmp(ic->ic_key, key)) {
+            link = &ic->ic_next;
+            continue;
+        }
+
+        /* Unlink it, then keep it only if it is still usable */
+        *link = ic->ic_next;
+        nidle--;
+        if (now - ic->ic_since >= idle_timeout) {
+            atomic_fetch_add(&expired, 1);
+            close(ic->ic_fd);
+        } else if (!is_healthy(ic->ic_fd)) {
+            atomic_fetch_add(&unhealthy, 1);
+            close(ic->ic_fd);
+        } else {
+            connfd = ic->ic_fd;
+        }
+        free(ic->ic_key);
+        free(ic);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    free(key);
+    atomic_fetch_add(connfd < 0 ? &misses : &hits, 1);
+    return connfd;
+}
+
+/*
+ * upstream_checkin - Give a connection whose last response was read
+ *     completely back to the pool, or close it if the host has enough
+ *     idle connections already
+ */
+void
+upstream_checkin(const char *hostname, const char *port, int connfd)
+{
+    int count = 0;
+    time_t now;
+    IdleConn *ic, **head;
+
+    ic = malloc(sizeof(IdleConn));
+    ic->ic_key = make_key(hostname, port);
+    ic->ic_fd = connfd;
+    ic->ic_since = now = time(NULL);
+
+    pthread_mutex_lock(&pool_mutex);
+    if (now - last_sweep >= idle_timeout)
+        sweep(now);
+
+    head = &buckets[key_hash(ic->ic_key) % UPSTREAM_BUCKETS];
+    for (IdleConn *p = *head; p; p = p->ic_next) {
+        if (!strcmp(p->ic_key, ic->ic_key))
+            count++;
+    }
+    if (count < max_idle_per_host) {
+        ic->ic_next = *head;
+        *head = ic;
+        nidle++;
+        ic = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (ic) {
+        atomic_fetch_add(&overflow, 1);
+        close(connfd);
+        free(ic->ic_key);
+        free(ic);
+    } else {
+        atomic_fetch_add(&checkins, 1);
+    }
+}
+
+/*
+ * upstream_reused - Count a request served on a checked out connection
+ */
+void
+upstream_reused(void)
+{
+    atomic_fetch_add(&reuses, 1);
+}
+
+static unsigned long
+key_hash(const char *key)
+{
+    unsigned long hash = 5381;
+
+    while (*key)
+        hash = ((hash << 5) + hash) + *key++; /* hash * 33 + c */
+    return hash;
+}
+
+static char *
+make_key(const char *hostname, const char *port)
+{
+    char *key;
+
+    key = malloc(strlen(hostname) + strlen(port) + 2);
+    sprintf(key, "%s:%s", hostname, port);
+    return key;
+}
+
+/*
+ * is_healthy - An idle connection must have nothing to read: readable
+ *     means the server closed it or sent something unexpected
+ */
+static int
+is_healthy(int connfd)
+{
+    struct pollfd pfd = { connfd, POLLIN, 0 };
+
+    return poll(&pfd, 1, 0) == 0;
+}
+
+/*
+ * sweep - Close every connection idle for too long, pool_mutex is held
+ */
+static void
+sweep(time_t now)
+{
+    IdleConn **link, *ic;
+
+    for (int i = 0; i < UPSTREAM_BUCKETS; i++) {
+        link = &buckets[i];
+        while ((ic = *link)) {
+            if (now - ic->ic_since < idle_timeout) {
+                link = &ic->ic_next;
+                continue;
+            }
+            *link = ic->ic_next;
+            nidle--;
+            atomic_fetch_add(&expired, 1);
+            close(ic->ic_fd);
+            free(ic->ic_key);
+            free(ic);
+        }
+    }
+    last_sweep = now;
+}
+
+static void
+upstream_report(FILE *out, void *arg)
+{
+    fprintf(out, " idle=%d hits=%lu misses=%lu reuses=%lu checkins=%lu "
+            "expired=%lu unhealthy=%lu overflow=%lu", nidle,
+            atomic_load(&hits), atomic_load(&misses), atomic_load(&reuses),
+            atomic_load(&checkins), atomic_load(&expired),
+            atomic_load(&unhealthy), atomic_load(&overflow));
+}
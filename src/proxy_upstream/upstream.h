@@ -0,0 +1,20 @@
+#ifndef _UPSTREAM_H_
+#define _UPSTREAM_H_
+
+#define UPSTREAM_BUCKETS        256
+#define DEFAULT_MAX_IDLE        8       /* Idle connections kept per host */
+#define DEFAULT_IDLE_TIMEOUT    30      /* Seconds an idle connection is kept */
+
+void
+upstream_init(int max_idle, int timeout);
+
+int
+upstream_checkout(const char *hostname, const char *port);
+
+void
+upstream_checkin(const char *hostname, const char *port, int connfd);
+
+void
+upstream_reused(void);
+
+#endif
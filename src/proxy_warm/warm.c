@@ -0,0 +1,251 @@
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "warm.h"
+#include "../proxy_arena/arena.h"
+#include "../proxy_serve/serve.h"
+#include "../proxy_stats/stats.h"
+
+static void *
+warm_thread(void *vargp);
+
+static void *
+sink_thread(void *vargp);
+
+static int
+warm_url(const char *url, size_t *bytes);
+
+static double
+elapsed_ms(void);
+
+static void
+warm_report(FILE *out, void *arg);
+
+static Cache *cache;
+static int sink_epfd;               /* Client ends the responses are read from */
+static struct timespec started;
+
+/* URLs left start at next_url, running is the number of threads left */
+static char **urls;
+static size_t nurls, next_url;
+static int running;
+static pthread_mutex_t warm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t warm_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long loaded, uncached, failed, loaded_bytes;
+static double duration_ms;
+static int deadline_hit;
+
+/*
+ * warm_start - Fetch the URLs listed in the file at path, one a line, into
+ *     the cache on parallel threads, each as a client asking the proxy for
+ *     it would. Empty lines and lines starting with # are skipped. Returns
+ *     -1 if the file can not be read.
+ */
+int
+warm_start(const char *path, Cache *proxy_cache, int parallel)
+{
+    FILE *fp;
+    char line[MAX_LINE], *url, *end;
+    size_t max = 0;
+    pthread_t tid;
+
+    if (!(fp = fopen(path, "r"))) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        for (url = line; isspace((unsigned char) *url); url++)
+            ;
+        for (end = url + strlen(url); end > url &&
+             isspace((unsigned char) end[-1]); end--)
+            ;
+        *end = '\0';
+        if (!*url || *url == '#')
+            continue;
+        if (nurls == max) {
+            max = max ? 2 * max : 64;
+            urls = realloc(urls, max * sizeof(*urls));
+        }
+        urls[nurls++] = strdup(url);
+    }
+    fclose(fp);
+
+    if ((sink_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    pthread_create(&tid, NULL, sink_thread, NULL);
+    cache = proxy_cache;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (parallel < 1)
+        parallel = DEFAULT_WARM_PARALLEL;
+    running = parallel;
+    for (int i = 0; i < parallel; i++)
+        pthread_create(&tid, NULL, warm_thread, NULL);
+    stats_register("warm", warm_report, NULL);
+    return 0;
+}
+
+/*
+ * warm_wait - Wait for the warm-up to be done, at most deadline seconds.
+ *     It goes on meanwhile the proxy accepts if it is not.
+ */
+void
+warm_wait(int deadline)
+{
+    int rc = 0;
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += deadline;
+
+    pthread_mutex_lock(&warm_mutex);
+    while (running && rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&warm_cond, &warm_mutex, &until);
+    deadline_hit = running > 0;
+    pthread_mutex_unlock(&warm_mutex);
+}
+
+static void *
+warm_thread(void *vargp)
+{
+    int rc;
+    size_t bytes;
+    const char *url;
+
+    pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&warm_mutex);
+        if (next_url == nurls) {
+            if (--running == 0) {
+                duration_ms = elapsed_ms();
+                pthread_cond_broadcast(&warm_cond);
+            }
+            pthread_mutex_unlock(&warm_mutex);
+            return NULL;
+        }
+        url = urls[next_url++];
+        pthread_mutex_unlock(&warm_mutex);
+
+        bytes = 0;
+        rc = warm_url(url, &bytes);
+
+        pthread_mutex_lock(&warm_mutex);
+        if (rc < 0)
+            failed++;
+        else if (bytes)
+            loaded++;
+        else
+            uncached++;
+        loaded_bytes += bytes;
+        pthread_mutex_unlock(&warm_mutex);
+    }
+}
+
+/*
+ * sink_thread - Read the responses off the client ends and drop them. A
+ *     client end is closed here once the proxy end shut its writes.
+ */
+static void *
+sink_thread(void *vargp)
+{
+    int n;
+    char buf[WARM_SINK_READ];
+    struct epoll_event events[16];
+
+    pthread_detach(pthread_self());
+    while (1) {
+        if ((n = epoll_wait(sink_epfd, events, 16, -1)) < 0)
+            continue;
+        for (int i = 0; i < n; i++) {
+            if (read(events[i].data.fd, buf, sizeof(buf)) <= 0)
+                close(events[i].data.fd);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * warm_url - Have the proxy serve a GET of url to a client on the other
+ *     end of a socket pair, whose response the sink thread drops. Sets
+ *     bytes to the size of the response the cache then holds, 0 if it did
+ *     not keep it. Returns -1 on error.
+ */
+static int
+warm_url(const char *url, size_t *bytes)
+{
+    int fds[2], rc, n;
+    char request[MAX_LINE], key[CACHE_KEY_SIZE];
+    Sio sio;
+    Request client_request;
+    Response server_response;
+    CacheEntry *entry;
+    Arena arena;
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    n = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\n\r\n", url);
+    if (n >= sizeof(request) ||
+        socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        return -1;
+    rc = write(fds[1], request, n) == n ? 0 : -1;
+    shutdown(fds[1], SHUT_WR);
+    ev.data.fd = fds[1];
+    if (epoll_ctl(sink_epfd, EPOLL_CTL_ADD, fds[1], &ev) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    arena_start(&arena);
+    init_resources(&client_request, &server_response, &arena);
+    sio_initbuf(&sio, fds[0]);
+    if (rc == 0)
+        rc = parse_request(&sio, &client_request);
+    if (rc == 0)
+        rc = forward_client_request(&client_request, cache, &server_response);
+    if (rc == 0)
+        rc = forward_server_response(fds[0], &client_request,
+                                     &server_response);
+
+    if (rc == 0) {
+        build_cache_key(&client_request, key);
+        if ((entry = cache_lookup(cache, key, strlen(key)))) {
+            *bytes = entry->len;
+            cache_release(entry);
+        }
+    }
+    free_resources(&client_request, &server_response);
+    sio_release(&sio);
+    arena_free(&arena);
+    close(fds[0]);
+    return rc;
+}
+
+static double
+elapsed_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started.tv_sec) * 1e3
+           + (now.tv_nsec - started.tv_nsec) / 1e6;
+}
+
+static void
+warm_report(FILE *out, void *arg)
+{
+    pthread_mutex_lock(&warm_mutex);
+    fprintf(out, " urls=%zu done=%lu loaded=%lu uncached=%lu failed=%lu "
+            "bytes=%lu duration_ms=%.1f deadline_hit=%d", nurls,
+            loaded + uncached + failed, loaded, uncached, failed, loaded_bytes,
+            running ? elapsed_ms() : duration_ms, deadline_hit);
+    pthread_mutex_unlock(&warm_mutex);
+}
@@ -0,0 +1,16 @@
+#ifndef _WARM_H_
+#define _WARM_H_
+
+#include "../proxy_cache/cache.h"
+
+#define DEFAULT_WARM_PARALLEL   4   /* URLs fetched at once */
+#define DEFAULT_WARM_DEADLINE   5   /* Seconds accepting may wait for it */
+#define WARM_SINK_READ          65536 /* Bytes of a response dropped at once */
+
+int
+warm_start(const char *path, Cache *cache, int parallel);
+
+void
+warm_wait(int deadline);
+
+#endif
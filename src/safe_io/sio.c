@@ -1,137 +1,351 @@
+#define _GNU_SOURCE         /* splice */
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include "sio.h"
+#include "../proxy_stats/stats.h"
 
-static ssize_t
-sio_read(Sio *sio, char *usrbuf, size_t n);
+static int
+make_room(Sio *sio);
+
+static int
+zerocopy_wait(int fd, unsigned int sent, int timeout);
+
+static void
+sio_report(FILE *out, void *arg);
+
+/* System calls writing to the sockets, to see how many a response takes */
+static atomic_ulong responses, sends, partial, splices;
+static atomic_ulong zerocopy_sends, zerocopy_copied;
+
+void
+sio_init(void)
+{
+    stats_register("io", sio_report, NULL);
+}
 
 /*
- * sio_initbuf - Associate a descriptor with a read buffer and reset buffer
+ * sio_initbuf - Associate a descriptor with a read buffer and reset buffer,
+ *     which takes a page with the first read
  */
 void
 sio_initbuf(Sio *sio, int fd)
 {
     sio->sio_fd = fd;  
     sio->sio_cnt = 0;  
-    sio->sio_bufptr = sio->sio_buf;
+    sio->sio_page = NULL;
+    sio->sio_bufptr = NULL;
+}
+
+/*
+ * sio_consume - Drop the first n unread bytes, parsed or relayed in place
+ */
+void
+sio_consume(Sio *sio, size_t n)
+{
+    sio->sio_bufptr += n;
+    sio->sio_cnt -= n;
+}
+
+/*
+ * sio_release - Give the page back, with whatever is left unread in it
+ */
+void
+sio_release(Sio *sio)
+{
+    if (sio->sio_page)
+        buf_page_put(sio->sio_page);
+    sio->sio_page = NULL;
+    sio->sio_bufptr = NULL;
+    sio->sio_cnt = 0;
+}
+
+/*
+ * sio_splice - Move up to n bytes from descriptor in to descriptor out
+ *     without copying them to user space, one of them being a pipe.
+ *     Returns the bytes moved, 0 at the end of in, -1 with errno set on
+ *     error, EAGAIN if one of them is non-blocking and not ready.
+ */
+ssize_t
+sio_splice(int in, int out, size_t n, unsigned int flags)
+{
+    ssize_t nmoved;
+
+    do {
+        atomic_fetch_add_explicit(&splices, 1, memory_order_relaxed);
+        nmoved = splice(in, NULL, out, NULL, n, flags);
+    } while (nmoved < 0 && errno == EINTR); /* Interrupted by sig handler */
+    return nmoved;
 }
 
 /*
- * sio_readn - Safely read n bytes (buffered)
+ * sio_splicen - Move n bytes from the pipe in to descriptor out, both
+ *     blocking
  */
 ssize_t
-sio_readn(Sio *sio, void *usrbuf, size_t n)
+sio_splicen(int in, int out, size_t n, unsigned int flags)
 {
     size_t nleft = n;
-    ssize_t nread;
-    char *bufp = usrbuf;
+    ssize_t nmoved;
 
     while (nleft > 0) {
-        if ((nread = sio_read(sio, bufp, nleft)) < 0) 
-            return -1;          /* errno set by read() */ 
-        else if (nread == 0)
-            break;              /* EOF */
-        nleft -= nread;
-        bufp += nread;
+        if ((nmoved = sio_splice(in, out, nleft, flags)) <= 0)
+            return -1;              /* errno set by splice() */
+        nleft -= nmoved;
     }
-    return (n - nleft);         /* return >= 0 */
+    return n;
 }
 
-/* 
- * sio_read_line - Safely read a text line (buffered)
+/*
+ * sio_send - Write the buffers of iov to the socket with one sendmsg,
+ *     which writes as much as the socket takes. Flags are those of
+ *     sendmsg, MSG_MORE tells more of the message follows right away.
+ *     Returns the bytes written, -1 with errno set on error, EAGAIN if the
+ *     socket is non-blocking and full.
  */
 ssize_t
-sio_read_line(Sio *sio, void *usrbuf, size_t maxlen)
+sio_send(int fd, const struct iovec *iov, int iovcnt, int flags)
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = sio_read(sio, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                n++;
-                break;
-            }
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0;       /* EOF, no data read */
-            else
-                break;          /* EOF, some data was read */
-        } else {
-            return -1;	    /* Error */
-        }
+    ssize_t nwritten;
+    size_t n = 0;
+    struct msghdr msg = { .msg_iov = (struct iovec *) iov,
+                          .msg_iovlen = iovcnt };
+
+    do {
+        atomic_fetch_add_explicit(&sends, 1, memory_order_relaxed);
+        nwritten = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+    } while (nwritten < 0 && errno == EINTR);
+
+    for (int i = 0; i < iovcnt; i++)
+        n += iov[i].iov_len;
+    if (nwritten >= 0 && (size_t) nwritten < n)
+        atomic_fetch_add_explicit(&partial, 1, memory_order_relaxed);
+    return nwritten;
+}
+
+/*
+ * sio_sendv - Safely write all the buffers of iov to a blocking socket,
+ *     sending again what a partial write left. Iov is consumed on the way.
+ */
+ssize_t
+sio_sendv(int fd, struct iovec *iov, int iovcnt, int flags)
+{
+    ssize_t nwritten, n = 0;
+
+    while (iovcnt > 0) {
+        if ((nwritten = sio_send(fd, iov, iovcnt, flags)) < 0)
+            return -1;                  /* errno set by sendmsg() */
+        iovcnt = sio_iov_consume(iov, iovcnt, nwritten);
+        n += nwritten;
     }
-    *bufp = 0;
-    return n-1;
+    return n;
 }
 
 /*
- * sio_writen - Safely write n bytes (unbuffered)
+ * sio_sendzc - Like sio_sendv, but the kernel sends the bytes from the
+ *     pages of iov instead of copying them, on a socket with SO_ZEROCOPY
+ *     set. They must stay as they are until it is done with them, so this
+ *     waits up to timeout ms for the client to take them. If it does not,
+ *     the connection is reset to drop them and -1 is returned.
  */
 ssize_t
-sio_writen(int fd, void *usrbuf, size_t n)
+sio_sendzc(int fd, struct iovec *iov, int iovcnt, int timeout)
 {
-    size_t nleft = n;
-    ssize_t nwritten;
-    char *bufp = usrbuf;
+    unsigned int sent = 0;
+    ssize_t nwritten, n = 0;
+    struct linger reset = { 1, 0 };
 
-    while (nleft > 0) {
-	    if ((nwritten = write(fd, bufp, nleft)) <= 0) {
-	        if (errno == EINTR) {           /* Interrupted by sig handler return */
-	    	    nwritten = 0;               /* and call write() again */
-            } else if (errno == EPIPE) {    /* Interrupted by SIGPIPE */
-                errno = 0;              /* Reset errno */     
-                return -1;
-            } else {
-	    	    return -1;              /* errno set by write() */
-            }
-	    }
-	    nleft -= nwritten;
-	    bufp += nwritten;
+    while (iovcnt > 0) {
+        if ((nwritten = sio_send(fd, iov, iovcnt, MSG_ZEROCOPY)) > 0) {
+            sent++;
+        } else if (nwritten < 0 && errno == ENOBUFS) {
+            /* Out of memory to pin the pages, the rest is copied */
+            nwritten = sio_send(fd, iov, iovcnt, 0);
+        }
+        if (nwritten < 0)
+            break;
+        iovcnt = sio_iov_consume(iov, iovcnt, nwritten);
+        n += nwritten;
+    }
+    atomic_fetch_add_explicit(&zerocopy_sends, sent, memory_order_relaxed);
+
+    if (zerocopy_wait(fd, sent, timeout) < 0 || iovcnt > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        return -1;
     }
     return n;
 }
 
-/* 
- * sio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, sio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    sio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, sio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+/*
+ * sio_response_sent - Count a response written to a client
+ */
+void
+sio_response_sent(void)
+{
+    atomic_fetch_add_explicit(&responses, 1, memory_order_relaxed);
+}
+
+/*
+ * sio_iov_consume - Drop the first n written bytes from iov, moving the
+ *    buffers left to its front. Returns how many are left.
+ */
+int
+sio_iov_consume(struct iovec *iov, int iovcnt, size_t n)
+{
+    int i = 0;
+
+    while (i < iovcnt && n >= iov[i].iov_len)
+        n -= iov[i++].iov_len;
+    if (i < iovcnt) {
+        iov[i].iov_base = (char *) iov[i].iov_base + n;
+        iov[i].iov_len -= n;
+    }
+    memmove(iov, iov + i, (iovcnt - i) * sizeof(*iov));
+    return iovcnt - i;
+}
+
+/*
+ * sio_fill - Append whatever the descriptor has ready to the unread bytes
+ *    of the page without consuming anything. Callers collect a complete
+ *    message with it and parse it in place, or relay the bytes from there.
+ *    A non-blocking descriptor with nothing ready and nothing unread gives
+ *    its page back, unless others hold bytes of it.
+ *
+ *    Returns the number of bytes read, 0 on EOF and -1 on error (errno is
+ *    EAGAIN if nothing is ready, ENOBUFS if the page is full).
+ */
+ssize_t
+sio_fill(Sio *sio)
+{
+    ssize_t nread;
+    size_t room;
+
+    if (make_room(sio) < 0)
+        return -1;
+
+    room = sio->sio_page->pg_data + BUF_PAGE_SIZE
+           - (sio->sio_bufptr + sio->sio_cnt);
+    while ((nread = read(sio->sio_fd, sio->sio_bufptr + sio->sio_cnt,
+                         room)) < 0) {
+        if (errno == EAGAIN && sio->sio_cnt == 0 &&
+            !buf_page_shared(sio->sio_page))
+            sio_release(sio);
+        if (errno != EINTR)
+            return -1;
+    }
+    sio->sio_cnt += nread;
+    return nread;
+}
+
+/*
+ * make_room - Make sure there is room after the unread bytes. They are
+ *    moved to the front of the page once it is full, or to a new page if
+ *    others hold bytes of it.
  */
-static ssize_t
-sio_read(Sio *sio, char *usrbuf, size_t n)
+static int
+make_room(Sio *sio)
 {
-    int cnt;
-
-    while (sio->sio_cnt <= 0) {  /* Refill if buf is empty */
-	    sio->sio_cnt = read(sio->sio_fd, sio->sio_buf, 
-	    		   sizeof(sio->sio_buf));
-	    if (sio->sio_cnt < 0) {
-	        if (errno != EINTR) {   /* Interrupted by sig handler return */
-	    	    return -1;
-            } else if (errno == ECONNRESET) {
-                errno = 0;
+    BufPage *page = sio->sio_page;
+
+    if (!page) {
+        if (!(sio->sio_page = buf_page_get())) {
+            errno = ENOMEM;
+            return -1;
+        }
+        sio->sio_bufptr = sio->sio_page->pg_data;
+        return 0;
+    }
+
+    /* Nothing left to read in a page of its own, it starts over */
+    if (sio->sio_cnt == 0 && !buf_page_shared(page))
+        sio->sio_bufptr = page->pg_data;
+
+    if (sio->sio_bufptr + sio->sio_cnt < page->pg_data + BUF_PAGE_SIZE)
+        return 0;
+    if (sio->sio_bufptr == page->pg_data) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (buf_page_shared(page)) {
+        if (!(sio->sio_page = buf_page_get())) {
+            sio->sio_page = page;
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(sio->sio_page->pg_data, sio->sio_bufptr, sio->sio_cnt);
+        buf_page_put(page);
+    } else {
+        memmove(page->pg_data, sio->sio_bufptr, sio->sio_cnt);
+    }
+    sio->sio_bufptr = sio->sio_page->pg_data;
+    return 0;
+}
+
+/*
+ * zerocopy_wait - Wait for the completions of the sent zerocopy sends on
+ *     the error queue of the socket. Each one covers a range of them,
+ *     numbered in the order they were sent.
+ */
+static int
+zerocopy_wait(int fd, unsigned int sent, int timeout)
+{
+    unsigned int done = 0;
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                            sizeof(struct sockaddr_in6))];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    struct pollfd pfd = { .fd = fd };   /* POLLERR is always watched */
+
+    while (done < sent) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN || poll(&pfd, 1, timeout) <= 0)
                 return -1;
-            }
-	    } else if (sio->sio_cnt == 0) { /* EOF */
-	            return 0;
-        } else {
-	        sio->sio_bufptr = sio->sio_buf; /* Reset buffer ptr */
+            continue;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 &&
+                  cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            done += serr->ee_data - serr->ee_info + 1;
+            /* The device could not send from the pages, loopback never */
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                atomic_fetch_add_explicit(&zerocopy_copied, 1,
+                                          memory_order_relaxed);
         }
     }
+    return 0;
+}
+
+static void
+sio_report(FILE *out, void *arg)
+{
+    unsigned long nresponses = atomic_load(&responses);
+    unsigned long nsends = atomic_load(&sends);
 
-    /* Copy min(n, sio->sio_cnt) bytes from internal buf to user buf */
-    cnt = n;          
-    if (sio->sio_cnt < n)   
-	    cnt = sio->sio_cnt;
-    memcpy(usrbuf, sio->sio_bufptr, cnt);
-    sio->sio_bufptr += cnt;
-    sio->sio_cnt -= cnt;
-    return cnt;
+    fprintf(out, " responses=%lu sends=%lu partial=%lu splices=%lu "
+            "sends_per_response=%.2f zerocopy=%lu zerocopy_copied=%lu",
+            nresponses, nsends, atomic_load(&partial), atomic_load(&splices),
+            nresponses ? (double) nsends / nresponses : 0.0,
+            atomic_load(&zerocopy_sends), atomic_load(&zerocopy_copied));
 }
@@ -2,26 +2,53 @@
 #define _SIO_H_
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
-#define SIO_BUFSIZE 8192    /* 8KB buffer */
+#include "../proxy_buf/buf.h"
+
+#define SIO_ZEROCOPY_MIN 16384  /* Smaller bodies are copied to the socket */
 
 typedef struct {
-    char sio_buf[SIO_BUFSIZE]; /* Internal buffer */
-    char *sio_bufptr;          /* Next unread byte in internal buf */
-    int sio_fd;                /* Descriptor for this internal buf */
-    int sio_cnt;               /* Unread bytes in internal buf */
+    BufPage *sio_page;         /* Page read into, none while it is idle */
+    char *sio_bufptr;          /* Next unread byte in the page */
+    int sio_fd;                /* Descriptor for this buffer */
+    int sio_cnt;               /* Unread bytes in the page */
 } Sio;
 
+void
+sio_init(void);
+
 void
 sio_initbuf(Sio *sio, int fd); 
 
+void
+sio_consume(Sio *sio, size_t n);
+
+void
+sio_release(Sio *sio);
+
+ssize_t
+sio_send(int fd, const struct iovec *iov, int iovcnt, int flags);
+
+ssize_t
+sio_sendv(int fd, struct iovec *iov, int iovcnt, int flags);
+
+ssize_t
+sio_sendzc(int fd, struct iovec *iov, int iovcnt, int timeout);
+
+void
+sio_response_sent(void);
+
 ssize_t
-sio_readn(Sio *sio, void *usrbuf, size_t n);
+sio_splice(int in, int out, size_t n, unsigned int flags);
 
 ssize_t
-sio_read_line(Sio *sio, void *usrbuf, size_t maxlen);
+sio_splicen(int in, int out, size_t n, unsigned int flags);
+
+int
+sio_iov_consume(struct iovec *iov, int iovcnt, size_t n);
 
 ssize_t
-sio_writen(int fd, void *usrbuf, size_t n);
+sio_fill(Sio *sio);
 
 #endif
@@ -1,25 +1,39 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "interface.h"
 
 #define LISTENQ 1024
 
+static long
+now_ms(void);
+
+static ClientTimeouts client_timeouts = {
+    DEFAULT_CONNECT_TIMEOUT * 1000,
+    DEFAULT_READ_TIMEOUT * 1000,
+    DEFAULT_WRITE_TIMEOUT * 1000
+};
+
 /*  
  * open_listenfd - Open and return a listening socket on port. This
- *     function is reentrant and protocol-independent.
+ *     function is reentrant and protocol-independent. With reuseport set,
+ *     other sockets may listen on the port too.
  *
  *     On error, returns: 
  *       -2 for getaddrinfo error
  *       -1 with errno set for other errors.
  */
 int
-open_listenfd(char *port)
+open_listenfd(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval = 1;
@@ -43,6 +57,9 @@ open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
                    (const void *)&optval, sizeof(int));
+        if (reuseport)
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval, sizeof(int));
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -66,50 +83,233 @@ open_listenfd(char *port)
     return listenfd;
 }
 
+/*
+ * set_client_timeouts - Set the seconds open_clientfd waits for a server to
+ *     accept the connection, and then to send or accept data
+ */
+void
+set_client_timeouts(int connect, int read, int write)
+{
+    if (connect > 0)
+        client_timeouts.ct_connect_ms = connect * 1000;
+    if (read > 0)
+        client_timeouts.ct_read_ms = read * 1000;
+    if (write > 0)
+        client_timeouts.ct_write_ms = write * 1000;
+}
+
+/*
+ * get_client_timeouts - Get the timeouts, in ms, for the clients that wait
+ *     for their sockets themselves
+ */
+const ClientTimeouts *
+get_client_timeouts(void)
+{
+    return &client_timeouts;
+}
+
 /*
  * open_clientfd - Open connection to server at <hostname, port> and
  *     return a socket descriptor ready for reading and writing. This
- *     function is reentrant and protocol-independent.
+ *     function is reentrant and protocol-independent. The name is looked
+ *     up in the DNS cache, waiting for it to be resolved if needed, and
+ *     its addresses are raced. Reads and writes on the descriptor time out.
  *
  *     On error, returns: 
- *       -2 for getaddrinfo error
- *       -1 with errno set for other errors.
+ *       -2 for name resolution error
+ *       -1 with errno set for other errors, ETIMEDOUT if no address
+ *          accepted the connection in time.
  */
 int
 open_clientfd(char *hostname, char *port)
 {
-    int client_fd, rc;
-    struct addrinfo hints, *listp, *p;
+    int client_fd;
+    long left, deadline;
+    DnsAddrs addrs;
+    ConnectRace race;
+    struct timeval tv;
 
     /* Get a list of potential server addresses */
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_socktype = SOCK_STREAM; /* Open a connection */
-    hints.ai_flags = AI_NUMERICSERV; /* ... using a numeric port arg. */
-    hints.ai_flags |= AI_ADDRCONFIG; /* Recommended for connections */
-    if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
-        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
+    if (dns_resolve(hostname, port, &addrs) < 0)
         return -2;
+
+    race_init(&race, &addrs);
+    if (race_next(&race) < 0)
+        return -1;
+    left = client_timeouts.ct_connect_ms;
+    deadline = now_ms() + left;
+    while ((client_fd = race_poll(&race, left < CONNECT_RACE_DELAY_MS ?
+                                         left : CONNECT_RACE_DELAY_MS)) < 0) {
+        if ((left = deadline - now_ms()) <= 0) {
+            race_abort(&race);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        /* The next address is tried once an attempt failed, or when the
+         * ones in progress had no answer for CONNECT_RACE_DELAY_MS */
+        if (race_next(&race) < 0 && !race.cr_nfds)
+            return -1;              /* All connects failed */
     }
 
-    /* Walk the list for one that we can successfully connect to */
-    for (p = listp; p; p = p->ai_next) {
-        /* Create a socket descriptor */
-        if ((client_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+    set_blocking(client_fd);
+    tv.tv_sec = client_timeouts.ct_read_ms / 1000;
+    tv.tv_usec = client_timeouts.ct_read_ms % 1000 * 1000;
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    tv.tv_sec = client_timeouts.ct_write_ms / 1000;
+    tv.tv_usec = client_timeouts.ct_write_ms % 1000 * 1000;
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return client_fd;
+}
+
+/*
+ * race_init - Get ready to race the connections to the server addresses,
+ *     alternating between their families, first address first
+ */
+void
+race_init(ConnectRace *race, const DnsAddrs *addrs)
+{
+    int first = 0, other = 0;
+    int family = addrs->da_count ? addrs->da_list[0].da_family : 0;
+
+    race->cr_addrs.da_count = addrs->da_count;
+    race->cr_next = 0;
+    race->cr_nfds = 0;
+    for (int i = 0; i < addrs->da_count; i++) {
+        /* The next address of the family whose turn it is, or of the
+         * other one once it has none left */
+        while (first < addrs->da_count &&
+               addrs->da_list[first].da_family != family)
+            first++;
+        while (other < addrs->da_count &&
+               addrs->da_list[other].da_family == family)
+            other++;
+        if ((i % 2 == 0 && first < addrs->da_count) ||
+            other == addrs->da_count)
+            race->cr_addrs.da_list[i] = addrs->da_list[first++];
+        else
+            race->cr_addrs.da_list[i] = addrs->da_list[other++];
+    }
+}
+
+/*
+ * race_next - Start a non-blocking connection to the next address that
+ *     takes one. Returns its descriptor, or -1 with errno set if none does.
+ */
+int
+race_next(ConnectRace *race)
+{
+    int client_fd;
+    DnsAddr *p;
+
+    while (race->cr_next < race->cr_addrs.da_count) {
+        p = &race->cr_addrs.da_list[race->cr_next++];
+        /* Create a non-blocking socket descriptor */
+        if ((client_fd = socket(p->da_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
             continue;               /* Socket failed, try the next */
 
-        /* Connect to the server */
-        if (connect(client_fd, p->ai_addr, p->ai_addrlen) != -1)
-            break;                  /* Success */
-        if (close(client_fd) < 0) { /* Connect failed, try another */
-            fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
-            return -1;
+        /* Start connecting to the server */
+        if (connect(client_fd, (struct sockaddr *) &p->da_addr,
+                    p->da_len) == 0 || errno == EINPROGRESS) {
+            race->cr_fds[race->cr_nfds++] = client_fd;
+            return client_fd;       /* Success or pending */
         }
+        close(client_fd);           /* Connect failed, try another */
     }
+    return -1;
+}
 
-    /* Clean up */
-    freeaddrinfo(listp);
-    if (!p) /* All connects failed */
+/*
+ * race_poll - Wait up to timeout ms for one of the connections in progress
+ *     to be established. Returns the descriptor of the first one, having
+ *     closed the others. Otherwise returns -1 with errno set to EINPROGRESS
+ *     if none answered, or to the error of the ones that failed, which are
+ *     closed.
+ */
+int
+race_poll(ConnectRace *race, int timeout)
+{
+    int n, err, failed = 0, winner = -1;
+    socklen_t len = sizeof(err);
+    struct pollfd pfds[DNS_MAX_ADDRS];
+
+    for (n = 0; n < race->cr_nfds; n++) {
+        pfds[n].fd = race->cr_fds[n];
+        pfds[n].events = POLLOUT;
+    }
+    if (poll(pfds, n, timeout) <= 0) {
+        errno = EINPROGRESS;
         return -1;
-    else /* The last connect succeeded */
-        return client_fd;
+    }
+
+    race->cr_nfds = 0;
+    for (int i = 0; i < n; i++) {
+        if (!pfds[i].revents) {
+            race->cr_fds[race->cr_nfds++] = pfds[i].fd;
+            continue;
+        }
+        if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+        if (!err && winner < 0) {
+            winner = pfds[i].fd;
+            continue;
+        }
+        close(pfds[i].fd);
+        if (err)
+            failed = err;
+    }
+
+    if (winner >= 0) {
+        race_abort(race);
+        return winner;
+    }
+    errno = failed ? failed : EINPROGRESS;
+    return -1;
+}
+
+/*
+ * race_abort - Close the connections still in progress
+ */
+void
+race_abort(ConnectRace *race)
+{
+    for (int i = 0; i < race->cr_nfds; i++)
+        close(race->cr_fds[i]);
+    race->cr_nfds = 0;
+}
+
+/*
+ * set_nonblocking - Put the descriptor into non-blocking mode.
+ *     Returns 0 on success, -1 with errno set on error.
+ */
+int
+set_nonblocking(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * set_blocking - Put the descriptor back into blocking mode.
+ *     Returns 0 on success, -1 with errno set on error.
+ */
+int
+set_blocking(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+static long
+now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
@@ -1,10 +1,57 @@
 #ifndef _INTERFACE_H_
 #define _INTERFACE_H_
 
+#include "../proxy_dns/dns.h"
+
+#define CONNECT_RACE_DELAY_MS   250 /* Next address tried if no answer by then */
+#define DEFAULT_CONNECT_TIMEOUT 5   /* Seconds for a server to accept */
+#define DEFAULT_READ_TIMEOUT    30  /* Seconds for a server to send data */
+#define DEFAULT_WRITE_TIMEOUT   30  /* Seconds for a server to accept data */
+#define CLIENT_IDLE_TIMEOUT     5   /* Seconds a kept client may stay idle */
+
+typedef struct client_timeouts {
+    int ct_connect_ms;
+    int ct_read_ms;
+    int ct_write_ms;
+} ClientTimeouts;
+
+/* Connections to the addresses of a server in progress at once, the first
+ * one established wins */
+typedef struct connect_race {
+    DnsAddrs cr_addrs;              /* In the order they are tried */
+    int cr_next;                    /* Next address to try */
+    int cr_fds[DNS_MAX_ADDRS];      /* Connects in progress */
+    int cr_nfds;
+} ConnectRace;
+
 int
-open_listenfd(char *port);
+open_listenfd(char *port, int reuseport);
 
 int
 open_clientfd(char *hostname, char *port);
 
+void
+set_client_timeouts(int connect, int read, int write);
+
+const ClientTimeouts *
+get_client_timeouts(void);
+
+void
+race_init(ConnectRace *race, const DnsAddrs *addrs);
+
+int
+race_next(ConnectRace *race);
+
+int
+race_poll(ConnectRace *race, int timeout);
+
+void
+race_abort(ConnectRace *race);
+
+int
+set_nonblocking(int fd);
+
+int
+set_blocking(int fd);
+
 #endif